@@ -0,0 +1,243 @@
+##
+# IO/File benchmarks
+#
+# Each case prints one tab-separated line to stdout:
+#
+#   BENCH  name  size  iterations  ns/op  MB/s  allocs/op
+#
+# size is the size in bytes of the file the case worked on, MB/s the bytes
+# moved per second (0 for cases that move none, such as FileTest) and
+# allocs/op is the number of objects allocated per iteration, counted in a
+# separate pass with the GC disabled (-1 without ObjectSpace).
+
+module MRubyIOBench
+  SIZES = [64, 4096, 65536, 1048576]
+
+  # roughly how many bytes each timed case should move
+  VOLUME = 16 * 1048576
+
+  # and how long it should run at least, in seconds
+  MIN_TIME = 0.05
+
+  # iterations of the allocation counting pass
+  ALLOC_ITERATIONS = 16
+
+  def self.header
+    MRubyIOBenchUtil.emit ["BENCH", "name", "size", "iterations", "ns/op", "MB/s", "allocs/op"].join("\t")
+  end
+
+  def self.live_objects
+    c = ObjectSpace.count_objects
+    c[:TOTAL] - c[:FREE]
+  end
+
+  # objects allocated by n calls of blk, less the cost of counting
+  def self.allocations(n, &blk)
+    return -1 unless Object.const_defined?(:ObjectSpace)
+    GC.start
+    GC.disable
+    begin
+      base = live_objects
+      base = live_objects - base
+      before = live_objects
+      i = 0
+      while i < n
+        blk.call
+        i += 1
+      end
+      per = ((live_objects - before - base).to_f / n).round(2)
+      per < 0 ? 0.0 : per
+    ensure
+      GC.enable
+    end
+  end
+
+  def self.time(n, &blk)
+    t0 = MRubyIOBenchUtil.clock
+    i = 0
+    while i < n
+      blk.call
+      i += 1
+    end
+    MRubyIOBenchUtil.clock - t0
+  end
+
+  def self.iterations_for(size)
+    n = VOLUME / (size > 0 ? size : 1)
+    n = 16 if n < 16
+    n = 100000 if n > 100000
+    n
+  end
+
+  # bytes is what one call of blk moves, if not size
+  def self.run(name, size, bytes = size, &blk)
+    n = iterations_for(bytes)
+    blk.call                            # warm up
+    elapsed = time(n, &blk)
+    while elapsed < MIN_TIME && n < 10000000
+      n *= 4
+      elapsed = time(n, &blk)
+    end
+    ns = (elapsed * 1e9 / n).round(1)
+    mbs = bytes > 0 ? (bytes.to_f * n / elapsed / 1048576).round(2) : 0
+    allocs = allocations(ALLOC_ITERATIONS, &blk)
+    MRubyIOBenchUtil.emit ["BENCH", name, size, n, ns, mbs, allocs].join("\t")
+    true
+  end
+
+  # a scratch file of each size, removed again by cleanup
+  def self.files
+    @files ||= SIZES.map { |size| [size, MRubyIOBenchUtil.make_file(size)] }
+  end
+
+  def self.scratch
+    @scratch ||= MRubyIOBenchUtil.make_file(0)
+  end
+
+  def self.cleanup
+    files.each { |_, path| MRubyIOBenchUtil.remove path }
+    MRubyIOBenchUtil.remove scratch
+    @files = @scratch = nil
+  end
+end
+
+assert('bench: setup') do
+  MRubyIOBench.header
+  MRubyIOBench.files.size == MRubyIOBench::SIZES.size
+end
+
+assert('bench: IO#read') do
+  MRubyIOBench.files.each do |size, path|
+    File.open(path) do |f|
+      MRubyIOBench.run("read", size) do
+        f.seek 0
+        f.read
+      end
+    end
+    File.open(path) do |f|
+      MRubyIOBench.run("read(4096)", size) do
+        f.seek 0
+        while f.read(4096); end
+      end
+    end
+  end
+end
+
+assert('bench: IO#gets / IO#readline') do
+  MRubyIOBench.files.each do |size, path|
+    File.open(path) do |f|
+      MRubyIOBench.run("gets", size) do
+        f.seek 0
+        while f.gets; end
+      end
+    end
+    File.open(path) do |f|
+      MRubyIOBench.run("readline", size) do
+        f.seek 0
+        begin
+          while true
+            f.readline
+          end
+        rescue EOFError
+        end
+      end
+    end
+  end
+end
+
+assert('bench: IO#each_byte') do
+  MRubyIOBench.files.each do |size, path|
+    next if size > 65536
+    File.open(path) do |f|
+      MRubyIOBench.run("each_byte", size) do
+        f.seek 0
+        f.each_byte { |b| }
+      end
+    end
+  end
+end
+
+assert('bench: IO#write / IO#puts') do
+  line = "abcdefghijklmnopqrstuvwxyz01234"
+  MRubyIOBench.files.each do |size, _|
+    chunk = "x" * size
+    [true, false].each do |sync|
+      mode = sync ? "sync" : "buffered"
+      File.open(MRubyIOBench.scratch, "w") do |f|
+        f.sync = sync
+        MRubyIOBench.run("write/#{mode}", size) do
+          f.seek 0
+          f.write chunk
+        end
+      end
+      File.open(MRubyIOBench.scratch, "w") do |f|
+        f.sync = sync
+        lines = size / 32
+        lines = 1 if lines == 0
+        MRubyIOBench.run("puts/#{mode}", size, lines * 32) do
+          f.seek 0
+          i = 0
+          while i < lines
+            f.puts line
+            i += 1
+          end
+        end
+      end
+    end
+  end
+end
+
+assert('bench: IO#write_row / IO#printf') do
+  row = [123456, 0.5, -12.25, 7, 1000.125] * 4
+  fmt = (["%d,%.3f,%.3f,%d,%.3f"] * 4).join(",") + "\n"
+  File.open(MRubyIOBench.scratch, "w") do |f|
+    MRubyIOBench.run("write_row/20", 0, 0) do
+      f.seek 0
+      f.write_row row, ",", 3
+    end
+    MRubyIOBench.run("printf/20", 0, 0) do
+      f.seek 0
+      f.printf fmt, *row
+    end
+  end
+end
+
+assert('bench: IO.read') do
+  MRubyIOBench.files.each do |size, path|
+    MRubyIOBench.run("IO.read", size) do
+      IO.read path
+    end
+  end
+end
+
+assert('bench: File.open / close') do
+  path = MRubyIOBench.files.first[1]
+  MRubyIOBench.run("File.open+close", 0) do
+    File.open(path).close
+  end
+  MRubyIOBench.run("File.open{}", 0) do
+    File.open(path) { |f| }
+  end
+end
+
+assert('bench: FileTest') do
+  MRubyIOBench.files.each do |size, path|
+    MRubyIOBench.run("FileTest.exist?", size, 0) do
+      FileTest.exist? path
+    end
+    MRubyIOBench.run("FileTest.file?", size, 0) do
+      FileTest.file? path
+    end
+    MRubyIOBench.run("FileTest.size", size, 0) do
+      FileTest.size path
+    end
+  end
+  MRubyIOBench.run("FileTest.exist?/missing", 0) do
+    FileTest.exist? "tmp.mruby-io-bench.missing"
+  end
+end
+
+assert('bench: cleanup') do
+  MRubyIOBench.cleanup
+  true
+end
@@ -0,0 +1,96 @@
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mruby.h"
+#include "mruby/string.h"
+
+/*
+ * Helpers for the scripts in bench/, built into mrbtest in place of
+ * test/mruby_io_test.c when MRB_IO_BENCH is set (see mrbgem.rake).
+ */
+
+/* 32 bytes: files made for the benchmarks are lines of this */
+static const char bench_line[] = "abcdefghijklmnopqrstuvwxyz01234\n";
+
+/* MRubyIOBenchUtil.clock -> Float (seconds, monotonic where available) */
+static mrb_value
+mrb_io_bench_clock(mrb_state *mrb, mrb_value self)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return mrb_float_value(mrb, (mrb_float)ts.tv_sec + (mrb_float)ts.tv_nsec / 1e9);
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return mrb_float_value(mrb, (mrb_float)tv.tv_sec + (mrb_float)tv.tv_usec / 1e6);
+#endif
+}
+
+/* MRubyIOBenchUtil.make_file(size) -> path of a new file of size bytes */
+static mrb_value
+mrb_io_bench_make_file(mrb_state *mrb, mrb_value self)
+{
+  char fname[] = "tmp.mruby-io-bench.XXXXXXXX";
+  mrb_int size, n;
+  FILE *fp;
+  int fd;
+
+  mrb_get_args(mrb, "i", &size);
+  fd = mkstemp(fname);
+  if (fd == -1) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't create temporary file");
+  }
+  fp = fdopen(fd, "w");
+  if (fp == NULL) {
+    close(fd);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't open temporary file");
+  }
+  for (; size > 0; size -= n) {
+    n = size < (mrb_int)sizeof(bench_line) - 1 ? size : (mrb_int)sizeof(bench_line) - 1;
+    fwrite(bench_line, 1, n, fp);
+  }
+  fclose(fp);
+  return mrb_str_new_cstr(mrb, fname);
+}
+
+/* MRubyIOBenchUtil.remove(path) */
+static mrb_value
+mrb_io_bench_remove(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path;
+
+  mrb_get_args(mrb, "S", &path);
+  remove(mrb_string_value_cstr(mrb, &path));
+  return mrb_nil_value();
+}
+
+/* MRubyIOBenchUtil.emit(line): results go straight to stdout, unbuffered */
+static mrb_value
+mrb_io_bench_emit(mrb_state *mrb, mrb_value self)
+{
+  mrb_value line;
+
+  mrb_get_args(mrb, "S", &line);
+  fwrite(RSTRING_PTR(line), 1, RSTRING_LEN(line), stdout);
+  fputc('\n', stdout);
+  fflush(stdout);
+  return mrb_nil_value();
+}
+
+void
+mrb_mruby_ev3rt_io_gem_test(mrb_state* mrb)
+{
+  struct RClass *bench = mrb_define_module(mrb, "MRubyIOBenchUtil");
+  mrb_define_class_method(mrb, bench, "clock", mrb_io_bench_clock, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, bench, "make_file", mrb_io_bench_make_file, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, bench, "remove", mrb_io_bench_remove, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, bench, "emit", mrb_io_bench_emit, MRB_ARGS_REQ(1));
+}
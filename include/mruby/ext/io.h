@@ -5,14 +5,55 @@
 #ifndef MRUBY_IO_H
 #define MRUBY_IO_H
 
+#include <sys/types.h>
+#include <stdint.h>
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
+/*
+ * Define MRB_IO_POSIX when building for a hosted POSIX system such as
+ * Linux.  Without it the gem targets EV3RT, where newlib file I/O sits on
+ * top of FatFS and fcntl(), mmap(), poll() and the like are unavailable.
+ */
+
+#define MRB_IO_BUF_SIZE            4096
+
+struct mrb_io_buf {
+  char *ptr;  /* buffer memory, or NULL until first use */
+  int capa;   /* allocated size of ptr */
+  int start;  /* offset of the first unconsumed byte */
+  int end;    /* offset just past the last valid byte */
+};
+
+/*
+ * Syscall counters, kept for every IO and for the mrb_state as a whole
+ * (IO#stats, IO.stats).  writev(2) counts as one write.
+ */
+struct mrb_io_stats {
+  uint64_t reads, writes;           /* read and write syscalls */
+  uint64_t read_bytes, write_bytes;
+  uint64_t short_reads;             /* reads returning less than asked, EOF aside */
+  uint64_t seeks;
+  uint64_t refills;                 /* read buffer refills */
+  uint64_t opens, closes;
+  uint64_t emfile_retries;          /* opens retried after reclaiming IOs */
+  uint64_t sys_nsec;                /* time spent in the syscalls above */
+};
+
+struct mrb_io_registry;
+
 struct mrb_io {
   int fd;   /* file descriptor, or -1 */
   int fd2;  /* file descriptor to write if it's different from fd, or -1 */
   int pid;  /* child's pid (for pipes)  */
+  mrb_int pos;             /* file offset as seen through the buffer */
+  struct mrb_io_buf rbuf;  /* read buffer */
+  struct mrb_io_buf wbuf;  /* write buffer, bypassed while sync is set */
+  struct mrb_io_registry *reg;          /* registry listing this IO, or NULL */
+  struct mrb_io *reg_prev, *reg_next;   /* neighbours in the registry */
+  struct mrb_io_stats stats;
   unsigned int writable:1,
                sync:1;
 };
@@ -24,11 +65,141 @@ struct mrb_io {
 #define FMODE_APPEND               0x00000040
 #define FMODE_CREATE               0x00000080
 #define FMODE_TRUNC                0x00000800
+#define FMODE_NONBLOCK             0x00010000
 
 #define E_IO_ERROR                 (mrb_class_get(mrb, "IOError"))
 #define E_EOF_ERROR                (mrb_class_get(mrb, "EOFError"))
 
+/* what File::Stat reports; on FatFS the mode is derived from attributes */
+struct mrb_io_stat {
+  mrb_int size;
+  int mode;                  /* st_mode bits */
+  mrb_int atime, mtime, ctime;  /* seconds since the Epoch */
+  mrb_int dev, ino, nlink, uid, gid;
+};
+
+/* one directory entry; name stays valid until the next readdir */
+struct mrb_io_dirent {
+  const char *name;
+  int is_dir;  /* 1, 0, or -1 when the backend does not know */
+};
+
+/*
+ * A storage backend.  Every file operation of the gem goes through one of
+ * these; all functions return -1 with errno set on failure.  The default
+ * backend (POSIX with MRB_IO_POSIX, FatFS otherwise, or whatever
+ * MRB_IO_DEFAULT_BACKEND names) serves every path that is not under a
+ * mount point.
+ */
+struct mrb_io_backend {
+  const char *name;
+  int native;  /* descriptors are OS descriptors: poll(), fcntl() etc. apply */
+  int (*open)(const char *path, int flags, int perm);
+  int (*close)(int fd);
+  ssize_t (*read)(int fd, void *buf, size_t len);
+  ssize_t (*write)(int fd, const void *buf, size_t len);
+  off_t (*seek)(int fd, off_t offset, int whence);
+  int (*fstat)(int fd, struct mrb_io_stat *st);
+  int (*stat)(const char *path, struct mrb_io_stat *st);
+  int (*lstat)(const char *path, struct mrb_io_stat *st);  /* not following links */
+  int (*unlink)(const char *path);
+  int (*rename)(const char *from, const char *to);
+  int (*mkdir)(const char *path, int mode);
+  int (*rmdir)(const char *path);
+  void *(*opendir)(const char *path);
+  int (*readdir)(void *dir, struct mrb_io_dirent *ent);  /* 1, 0 at the end, -1 */
+  void (*rewinddir)(void *dir);
+  int (*closedir)(void *dir);
+};
+
+#ifdef MRB_IO_POSIX
+extern const struct mrb_io_backend mrb_io_backend_posix;
+#else
+extern const struct mrb_io_backend mrb_io_backend_fatfs;
+#endif
+extern const struct mrb_io_backend mrb_io_backend_ram;
+
+/*
+ * Serve paths under prefix (e.g. "/ram") from be; 0 or -1 with errno.
+ * The mount table is process-wide, shared by every mrb_state.  Mounts
+ * made here stay until mrb_io_unmount(); those made with File.mount are
+ * dropped when the gem of their mrb_state is finalized.
+ */
+int mrb_io_mount(const char *prefix, const struct mrb_io_backend *be);
+int mrb_io_unmount(const char *prefix);
+
+/* dispatch to the backend owning a path or descriptor */
+int mrb_io_sys_open(const char *path, int flags, int perm);
+int mrb_io_sys_close(int fd);
+ssize_t mrb_io_sys_read(int fd, void *buf, size_t len);
+ssize_t mrb_io_sys_write(int fd, const void *buf, size_t len);
+off_t mrb_io_sys_seek(int fd, off_t offset, int whence);
+int mrb_io_sys_fstat(int fd, struct mrb_io_stat *st);
+int mrb_io_sys_stat(const char *path, struct mrb_io_stat *st);
+int mrb_io_sys_lstat(const char *path, struct mrb_io_stat *st);
+int mrb_io_sys_unlink(const char *path);
+int mrb_io_sys_rename(const char *from, const char *to);
+int mrb_io_sys_mkdir(const char *path, int mode);
+int mrb_io_sys_rmdir(const char *path);
+void *mrb_io_sys_opendir(const char *path);
+int mrb_io_sys_readdir(void *dir, struct mrb_io_dirent *ent);
+void mrb_io_sys_rewinddir(void *dir);
+int mrb_io_sys_closedir(void *dir);
+int mrb_io_sys_native(int fd);
+
+/*
+ * Trace hook, called after every syscall the IO class makes.  It may run
+ * from the GC when an IO is collected, so it must not call back into the
+ * VM.  The clock behind nsec is clock_gettime(2) with MRB_IO_POSIX;
+ * elsewhere define MRB_IO_STATS_CLOCK() to an expression giving
+ * nanoseconds, or nsec and the sys_time counters stay 0.  The clock is
+ * read only while a hook is installed or IO.stats_timing is on.
+ */
+enum mrb_io_trace_op {
+  MRB_IO_TRACE_OPEN,
+  MRB_IO_TRACE_CLOSE,
+  MRB_IO_TRACE_READ,
+  MRB_IO_TRACE_WRITE,
+  MRB_IO_TRACE_SEEK
+};
+
+struct mrb_io_trace {
+  enum mrb_io_trace_op op;
+  int fd;
+  const char *path;  /* MRB_IO_TRACE_OPEN only, otherwise NULL */
+  mrb_int len;       /* bytes asked for, or the offset of a seek */
+  mrb_int ret;       /* what the call returned */
+  int err;           /* errno when ret is -1 */
+  uint64_t nsec;
+};
+
+typedef void (*mrb_io_trace_func)(mrb_state *mrb, const struct mrb_io_trace *ev, void *ud);
+
+/* install func (NULL to remove) for this mrb_state */
+void mrb_io_set_trace(mrb_state *mrb, mrb_io_trace_func func, void *ud);
+
+/*
+ * IO::Ring is a single-producer, single-consumer byte ring: mruby reads
+ * it like an IO while one native thread or task produces into it with
+ * the functions below, without locks.  The ring must stay referenced
+ * from Ruby while the producer uses it, and there must be one producer
+ * at a time (IO::Ring#write counts as one).
+ */
+struct mrb_io_ring;
+
+/* the ring of an IO::Ring; raises TypeError for other objects */
+struct mrb_io_ring *mrb_io_ring_ptr(mrb_state *mrb, mrb_value ring);
+/* copy up to len bytes in; returns how many fitted */
+size_t mrb_io_ring_write(struct mrb_io_ring *ring, const void *buf, size_t len);
+/* bytes that can be written right now */
+size_t mrb_io_ring_writable(struct mrb_io_ring *ring);
+/* end of data: the reader sees EOF once it has read what was written */
+void mrb_io_ring_close_write(struct mrb_io_ring *ring);
+
 mrb_value mrb_io_fileno(mrb_state *mrb, mrb_value io);
+mrb_int mrb_io_write_count(mrb_state *mrb);
+int mrb_file_stat(mrb_state *mrb, mrb_value obj, struct mrb_io_stat *st);
+void mrb_file_stat_cache_clear(mrb_state *mrb);
 
 #if defined(__cplusplus)
 } /* extern "C" { */
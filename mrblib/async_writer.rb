@@ -0,0 +1,30 @@
+class IO
+  class AsyncWriter
+    def <<(str)
+      write str
+      self
+    end
+
+    def print(*args)
+      args.each { |arg| write arg }
+      nil
+    end
+
+    def puts(*args)
+      if args.empty?
+        write "\n"
+        return nil
+      end
+      args.each do |arg|
+        if arg.is_a?(Array)
+          arg.empty? ? write("\n") : puts(*arg)
+          next
+        end
+        s = arg.to_s
+        write s
+        write "\n" unless s[-1] == "\n"
+      end
+      nil
+    end
+  end
+end
@@ -0,0 +1,91 @@
+##
+# Dir
+
+class Dir
+  include Enumerable
+
+  attr_reader :path
+  alias to_path path
+
+  def self.open(path, &block)
+    dir = self.new(path)
+
+    return dir unless block
+
+    begin
+      yield dir
+    ensure
+      dir.close unless dir.closed?
+    end
+  end
+
+  def self.foreach(path, &block)
+    return self.to_enum(:foreach, path) unless block
+
+    self.open(path) do |dir|
+      dir.each(&block)
+    end
+    nil
+  end
+
+  def self.entries(path)
+    self.open(path) { |dir| dir.to_a }
+  end
+
+  def self.each_child(path, &block)
+    return self.to_enum(:each_child, path) unless block
+
+    self.open(path) do |dir|
+      dir.each_child(&block)
+    end
+    nil
+  end
+
+  def self.children(path)
+    self.open(path) { |dir| dir.children }
+  end
+
+  def self.exist?(path)
+    File.directory?(path)
+  end
+
+  def self.glob(patterns, &block)
+    patterns = [patterns] unless patterns.is_a? Array
+    matches = []
+    patterns.each do |pattern|
+      matches.concat(self._glob(pattern))
+    end
+
+    return matches unless block
+
+    matches.each(&block)
+    nil
+  end
+
+  def self.[](*patterns)
+    self.glob(patterns)
+  end
+
+  def each(&block)
+    return self.to_enum(:each) unless block
+
+    while name = self.read
+      yield name
+    end
+    self
+  end
+
+  def each_child(&block)
+    return self.to_enum(:each_child) unless block
+
+    self.each do |name|
+      yield name unless name == "." || name == ".."
+    end
+  end
+
+  def children
+    names = []
+    self.each_child { |name| names << name }
+    names
+  end
+end
@@ -11,6 +11,17 @@ class IO
 
   BUF_SIZE = 4096
 
+  module WaitReadable; end
+  module WaitWritable; end
+
+  class EAGAINWaitReadable < IOError
+    include IO::WaitReadable
+  end
+
+  class EAGAINWaitWritable < IOError
+    include IO::WaitWritable
+  end
+
   def self.open(*args, &block)
     io = self.new(*args)
 
@@ -51,272 +62,75 @@ class IO
       length = nil
     end
 
-    str = ""
-    fd = -1
-    io = nil
-    begin
-      if path[0] == "|"
-        io = IO.popen(path[1..-1], (opt[:mode] || "r"))
-      else
-        fd = IO.sysopen(path)
-        io = IO.open(fd, opt[:mode] || "r")
-      end
-      io.seek(offset) if offset > 0
-      str = io.read(length)
-    ensure
-      if io
+    if path[0] == "|"
+      str = nil
+      io = IO.popen(path[1..-1], (opt[:mode] || "r"))
+      begin
+        io.seek(offset) if offset > 0
+        str = io.read(length)
+      ensure
         io.close
-      elsif fd != -1
-        IO._sysclose(fd)
       end
+      return str
     end
-    str
-  end
 
-  def flush
-    # mruby-io always writes immediately (no output buffer).
-    raise IOError, "closed stream" if self.closed?
-    self
+    _read_file(path, length, offset)
   end
 
-  def write(string)
-    str = string.is_a?(String) ? string : string.to_s
-    return str.size unless str.size > 0
-
-    len = syswrite(str)
-    if len != -1
-      @pos += len
-      return len
-    end
-
-    raise IOError
+  def self.binread(path, length=nil, offset=0)
+    _read_file(path, length, offset)
   end
 
-  def eof?
-    return true if @buf && @buf.size > 0
-
-    ret = false
-    char = ''
-
-    begin
-      char = sysread(1)
-    rescue EOFError => e
-      ret = true
-    ensure
-      _ungets(char)
+  def self.readlines(path, *args)
+    self.open(IO.sysopen(path)) do |io|
+      io.readlines(*args)
     end
-
-    ret
   end
-  alias_method :eof, :eof?
 
-  def pos
-    raise IOError if closed?
-    @pos
-  end
-  alias_method :tell, :pos
+  def self.foreach(path, *args, &block)
+    return to_enum(:foreach, path, *args) unless block
 
-  def pos=(i)
-    seek(i, SEEK_SET)
-  end
-
-  def seek(i, whence = SEEK_SET)
-    raise IOError if closed?
-    @pos = sysseek(i, whence)
-    @buf = ''
-    0
-  end
-
-  def _read_buf
-    return @buf if @buf && @buf.size > 0
-    @buf = sysread(BUF_SIZE)
-  end
-
-  def _ungets(substr)
-    raise TypeError.new "expect String, got #{substr.class}" unless substr.is_a?(String)
-    raise IOError if @pos == 0 || @pos.nil?
-    @pos -= substr.size
-    if @buf.empty?
-      @buf = substr
-    else
-      @buf = substr + @buf
+    self.open(IO.sysopen(path)) do |io|
+      io.each_line(*args, &block)
     end
     nil
   end
 
-  def ungetc(char)
-    raise IOError if @pos == 0 || @pos.nil?
-    _ungets(char)
-    nil
-  end
+  def self.pipe(&block)
+    r, w = _pipe
+    return [r, w] unless block
 
-  def read(length = nil)
-    unless length.nil?
-      unless length.is_a? Fixnum
-        raise TypeError.new "can't convert #{length.class} into Integer"
-      end
-      if length < 0
-        raise ArgumentError.new "negative length: #{length} given"
-      end
-      if length == 0
-        return ""   # easy case
-      end
-    end
-
-    array = []
-    start_pos = @pos
-    while 1
-      begin
-        _read_buf
-      rescue EOFError => e
-        array = nil if array.empty? and (not length.nil?) and length != 0
-        break
-      end
-
-      if length && (@pos - start_pos + @buf.size) >= length
-        len = length - (@pos - start_pos)
-        array.push @buf[0, len]
-        @pos += len
-        @buf = @buf[len, @buf.size - len]
-        break
-      else
-        array.push @buf
-        @pos += @buf.size
-        @buf = ''
-      end
-    end
-
-    array && array.join
-  end
-
-  def readline(arg = $/, limit = nil)
-    case arg
-    when String
-      rs = arg
-    when Fixnum
-      rs = $/
-      limit = arg
-    else
-      raise ArgumentError
-    end
-
-    if rs.nil?
-      return read
-    end
-
-    if rs == ""
-      rs = $/ + $/
-    end
-
-    array = []
-    start_pos = @pos
-    while 1
-      begin
-        _read_buf
-      rescue EOFError => e
-        array = nil if array.empty?
-        break
-      end
-
-      if limit && (@pos - start_pos + @buf.size) >= limit
-        len = limit - (@pos - start_pos)
-        array.push @buf[0, len]
-        @pos += len
-        @buf = @buf[len, @buf.size - len]
-        break
-      elsif idx = @buf.index(rs)
-        len = idx + rs.size
-        array.push @buf[0, len]
-        @pos += len
-        @buf = @buf[len, @buf.size - len]
-        break
-      else
-        array.push @buf
-        @pos += @buf.size
-        @buf = ''
-      end
-    end
-
-    raise EOFError.new "end of file reached" if array.nil?
-
-    array.join
-  end
-
-  def gets(*args)
     begin
-      readline(*args)
-    rescue EOFError => e
-      nil
+      yield r, w
+    ensure
+      r.close unless r.closed?
+      w.close unless w.closed?
     end
   end
 
-  def readchar
-    _read_buf
-    c = @buf[0]
-    @buf = @buf[1, @buf.size]
-    @pos += 1
-    c
-  end
-
-  def getc
+  def self.copy_stream(src, dst, length=nil, src_offset=nil)
+    src_io = src.kind_of?(IO) ? src : self.open(IO.sysopen(src))
     begin
-      readchar
-    rescue EOFError => e
-      nil
-    end
-  end
-
-  # 15.2.20.5.3
-  def each(&block)
-    while line = self.gets
-      block.call(line)
-    end
-    self
-  end
-
-  # 15.2.20.5.4
-  def each_byte(&block)
-    while char = self.getc
-      block.call(char)
+      dst_io = dst.kind_of?(IO) ? dst : self.open(IO.sysopen(dst, "w"), "w")
+      begin
+        _copy_stream(src_io, dst_io, length, src_offset)
+      ensure
+        dst_io.close unless dst_io.equal?(dst)
+      end
+    ensure
+      src_io.close unless src_io.equal?(src)
     end
-    self
   end
 
-  # 15.2.20.5.5
-  alias each_line each
-
-  alias each_char each_byte
-
-  def readlines
-    ary = []
-    while (line = gets)
-      ary << line
-    end
-    ary
+  def pos=(i)
+    seek(i, SEEK_SET)
   end
 
-  def puts(*args)
-    i = 0
-    len = args.size
-    while i < len
-      s = args[i].to_s
-      write s
-      write "\n" if (s[-1] != "\n")
-      i += 1
-    end
-    write "\n" if len == 0
+  def ungetc(char)
+    _ungets(char)
     nil
   end
 
-  def print(*args)
-    i = 0
-    len = args.size
-    while i < len
-      write args[i].to_s
-      i += 1
-    end
-  end
-
   def printf(*args)
     write sprintf(*args)
     nil
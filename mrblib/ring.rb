@@ -0,0 +1,31 @@
+class IO
+  class Ring
+    def <<(str)
+      write str
+      self
+    end
+
+    def readline(*args)
+      line = gets(*args)
+      raise EOFError, "end of file reached" if line.nil?
+      line
+    end
+
+    def readlines(*args)
+      lines = []
+      while line = gets(*args)
+        lines << line
+      end
+      lines
+    end
+
+    def each_line(*args, &block)
+      return to_enum(:each_line, *args) unless block
+      while line = gets(*args)
+        block.call(line)
+      end
+      self
+    end
+    alias each each_line
+  end
+end
@@ -7,6 +7,12 @@ if __FILE__ == $0
   repository, dir = 'https://github.com/mruby/mruby.git', 'tmp/mruby'
   build_args = ARGV
 
+  # "bench" runs bench/ through mrbtest instead of the tests
+  if build_args.delete('bench')
+    ENV['MRB_IO_BENCH'] = '1'
+    build_args << 'test' unless build_args.include?('test')
+  end
+
   Dir.mkdir 'tmp'  unless File.exist?('tmp')
   unless File.exist?(dir)
     system "git clone #{repository} #{dir}"
@@ -18,6 +24,7 @@ end
 MRuby::Build.new do |conf|
   toolchain :gcc
   conf.gembox 'default'
+  conf.cc.defines << 'MRB_IO_POSIX'
 
   conf.gem :git => 'https://github.com/iij/mruby-env.git'
 
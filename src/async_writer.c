@@ -0,0 +1,534 @@
+/*
+** async_writer.c - IO::AsyncWriter class
+*/
+
+#include "mruby.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include "mruby/ext/io.h"
+
+#include "mruby/error.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#ifdef MRB_IO_POSIX
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ASYNC_DEFAULT_CAPA  65536
+#define ASYNC_FINAL_WAIT    1     /* seconds the finalizer waits for a flush */
+
+enum async_overflow {
+  ASYNC_BLOCK,   /* wait for the thread to make room */
+  ASYNC_DROP,    /* discard the whole write */
+  ASYNC_ERROR    /* raise IOError */
+};
+
+/*
+ * Write-behind to a descriptor.  Writers copy into a ring buffer under
+ * the lock and return; a thread of our own takes the oldest queued bytes
+ * and write(2)s them with the lock released.  The bytes being written
+ * stay counted in len until they are out, so writers never reuse them.
+ * The thread never touches the mrb_state.  The descriptor is our own
+ * (opened or dup(2)ed), and the struct and buf come from malloc(3): when
+ * the object is collected while the thread is stuck in write(2), the
+ * thread is detached and frees them itself once it gets out.
+ */
+struct mrb_io_async {
+  pthread_mutex_t lock;
+  pthread_cond_t more;     /* data queued, or closing */
+  pthread_cond_t room;     /* data written out */
+  pthread_t thread;
+  char *buf;
+  size_t capa;
+  size_t start;            /* offset of the oldest queued byte */
+  size_t len;              /* queued bytes, including those in write(2) */
+  int fd;
+  int overflow;            /* enum async_overflow */
+  int idle;                /* thread is waiting for more */
+  int closing;
+  int closed;
+  int done;                /* thread has left its loop */
+  int abandoned;           /* finalized; the thread frees everything */
+  int err;                 /* errno of a failed write not reported yet */
+  /* stats */
+  size_t max_queued;
+  uint64_t written, dropped, blocked, writes, errors;
+};
+
+static void
+async_release(struct mrb_io_async *w)
+{
+  pthread_cond_destroy(&w->more);
+  pthread_cond_destroy(&w->room);
+  pthread_mutex_destroy(&w->lock);
+  free(w->buf);
+  free(w);
+}
+
+static void *
+async_thread(void *arg)
+{
+  struct mrb_io_async *w = (struct mrb_io_async *)arg;
+  size_t chunk;
+  ssize_t n;
+  struct pollfd pfd;
+  int abandoned;
+
+  pfd.fd = w->fd;
+  pfd.events = POLLOUT;
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->len == 0 && !w->closing) {
+      w->idle = 1;
+      pthread_cond_wait(&w->more, &w->lock);
+      w->idle = 0;
+    }
+    if (w->len == 0) {
+      break;
+    }
+    chunk = w->capa - w->start;
+    if (chunk > w->len) {
+      chunk = w->len;
+    }
+    pthread_mutex_unlock(&w->lock);
+    for (;;) {
+      n = write(w->fd, w->buf + w->start, chunk);
+      if (n >= 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        break;
+      }
+      if (errno != EINTR) {
+        /* O_NONBLOCK descriptor: we are the ones who may wait */
+        poll(&pfd, 1, -1);
+      }
+    }
+    pthread_mutex_lock(&w->lock);
+    w->writes++;
+    if (n < 0) {
+      /* the chunk is lost; the error goes to the next caller */
+      if (w->err == 0) {
+        w->err = errno;
+      }
+      w->errors++;
+      n = chunk;
+    } else {
+      w->written += n;
+    }
+    w->start = (w->start + n) % w->capa;
+    w->len -= n;
+    pthread_cond_broadcast(&w->room);
+  }
+  w->done = 1;
+  abandoned = w->abandoned;
+  pthread_cond_broadcast(&w->room);
+  pthread_mutex_unlock(&w->lock);
+  if (abandoned) {
+    close(w->fd);
+    async_release(w);
+  }
+  return NULL;
+}
+
+/* stop the thread after it has written everything; lock not held */
+static void
+async_stop(struct mrb_io_async *w)
+{
+  pthread_mutex_lock(&w->lock);
+  w->closing = 1;
+  pthread_cond_signal(&w->more);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  close(w->fd);
+  w->closed = 1;
+}
+
+/*
+ * GC and mrb_close must not hang on a descriptor that never drains (a
+ * full pipe nobody reads), so give the thread ASYNC_FINAL_WAIT seconds to
+ * write what is queued, then leave it to finish and clean up on its own.
+ */
+static void
+mrb_io_async_free(mrb_state *mrb, void *ptr)
+{
+  struct mrb_io_async *w = (struct mrb_io_async *)ptr;
+  struct timespec ts;
+  pthread_t thread;
+
+  if (w == NULL) {
+    return;
+  }
+  if (!w->closed) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ASYNC_FINAL_WAIT;
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_signal(&w->more);
+    while (!w->done) {
+      if (pthread_cond_timedwait(&w->room, &w->lock, &ts) == ETIMEDOUT) {
+        break;
+      }
+    }
+    if (!w->done) {
+      /* w may be gone as soon as the lock is released */
+      thread = w->thread;
+      w->abandoned = 1;
+      pthread_mutex_unlock(&w->lock);
+      pthread_detach(thread);
+      return;
+    }
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    close(w->fd);
+  }
+  async_release(w);
+}
+
+struct mrb_data_type mrb_io_async_type = { "IO::AsyncWriter", mrb_io_async_free };
+
+static struct mrb_io_async *
+async_get(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_async *w;
+
+  w = (struct mrb_io_async *)mrb_get_datatype(mrb, self, &mrb_io_async_type);
+  if (w == NULL || w->closed) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream.");
+  }
+  return w;
+}
+
+/* raise the pending write error, if any; lock held, released on raise */
+static void
+async_check_error(mrb_state *mrb, struct mrb_io_async *w)
+{
+  int err = w->err;
+
+  if (err != 0) {
+    w->err = 0;
+    pthread_mutex_unlock(&w->lock);
+    errno = err;
+    mrb_sys_fail(mrb, "IO::AsyncWriter");
+  }
+}
+
+static mrb_value
+async_opt(mrb_state *mrb, mrb_value opt, const char *name)
+{
+  if (!mrb_hash_p(opt)) {
+    return mrb_nil_value();
+  }
+  return mrb_hash_get(mrb, opt, mrb_symbol_value(mrb_intern_cstr(mrb, name)));
+}
+
+static int
+async_overflow_mode(mrb_state *mrb, mrb_value v)
+{
+  mrb_sym sym;
+
+  if (mrb_nil_p(v)) {
+    return ASYNC_BLOCK;
+  }
+  if (mrb_symbol_p(v)) {
+    sym = mrb_symbol(v);
+    if (sym == mrb_intern_lit(mrb, "block")) return ASYNC_BLOCK;
+    if (sym == mrb_intern_lit(mrb, "drop"))  return ASYNC_DROP;
+    if (sym == mrb_intern_lit(mrb, "error")) return ASYNC_ERROR;
+  }
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid overflow mode: %S", v);
+  return ASYNC_BLOCK;
+}
+#endif /* MRB_IO_POSIX */
+
+/*
+ * call-seq:
+ *   IO::AsyncWriter.new(io_or_path, capacity: 65536, overflow: :block)
+ *
+ * Starts a thread that writes everything handed to #write to io (an IO
+ * or a descriptor) or to the file at path, opened for appending.  Up to
+ * capacity bytes can be queued; when a write does not fit, :block waits
+ * for room, :drop discards it and :error raises IOError.  An IO passed in
+ * is flushed first and stays open after #close; do not write to it
+ * directly meanwhile.
+ */
+mrb_value
+mrb_io_async_initialize(mrb_state *mrb, mrb_value self)
+{
+#ifdef MRB_IO_POSIX
+  struct mrb_io_async *w;
+  mrb_value target, opt = mrb_nil_value(), v;
+  mrb_int capa = ASYNC_DEFAULT_CAPA;
+  const char *path = NULL;
+  int fd, overflow;
+
+  mrb_get_args(mrb, "o|o", &target, &opt);
+  v = async_opt(mrb, opt, "capacity");
+  if (!mrb_nil_p(v)) {
+    capa = mrb_fixnum(mrb_to_int(mrb, v));
+    if (capa <= 0) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid capacity: %S", v);
+    }
+  }
+  overflow = async_overflow_mode(mrb, async_opt(mrb, opt, "overflow"));
+
+  if (mrb_fixnum_p(target)) {
+    fd = mrb_fixnum(target);
+  } else if (mrb_string_p(target)) {
+    path = mrb_string_value_cstr(mrb, &target);
+    fd = mrb_io_sys_open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd == -1) {
+      mrb_sys_fail(mrb, path);
+    }
+    mrb_file_stat_cache_clear(mrb);
+  } else {
+    mrb_funcall(mrb, target, "flush", 0);
+    fd = mrb_fixnum(mrb_io_fileno(mrb, target));
+  }
+  if (!mrb_io_sys_native(fd)) {
+    if (path != NULL) {
+      mrb_io_sys_close(fd);
+    }
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "IO::AsyncWriter needs an OS file descriptor");
+  }
+  if (path == NULL) {
+    /* a descriptor of our own: the thread may outlive the IO */
+    fd = dup(fd);
+    if (fd == -1) {
+      mrb_sys_fail(mrb, "dup");
+    }
+  }
+
+  if (DATA_PTR(self) != NULL) {
+    mrb_io_async_free(mrb, DATA_PTR(self));
+  }
+  DATA_TYPE(self) = &mrb_io_async_type;
+  DATA_PTR(self) = NULL;
+
+  w = (struct mrb_io_async *)calloc(1, sizeof(struct mrb_io_async));
+  if (w != NULL) {
+    w->buf = (char *)malloc(capa);
+  }
+  if (w == NULL || w->buf == NULL) {
+    free(w);
+    close(fd);
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "capacity too large");
+  }
+  w->capa = capa;
+  w->fd = fd;
+  w->overflow = overflow;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->more, NULL);
+  pthread_cond_init(&w->room, NULL);
+  errno = pthread_create(&w->thread, NULL, async_thread, w);
+  if (errno != 0) {
+    w->closed = 1;
+    close(fd);
+    DATA_PTR(self) = w;
+    mrb_sys_fail(mrb, "pthread_create");
+  }
+  DATA_PTR(self) = w;
+  return self;
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "IO::AsyncWriter is not supported on the platform");
+  return mrb_nil_value();
+#endif
+}
+
+#ifdef MRB_IO_POSIX
+/* copy len bytes into the ring at its end; they must fit */
+static void
+async_put(struct mrb_io_async *w, const char *ptr, size_t len)
+{
+  size_t end = (w->start + w->len) % w->capa;
+  size_t first = w->capa - end;
+
+  if (first > len) {
+    first = len;
+  }
+  memcpy(w->buf + end, ptr, first);
+  memcpy(w->buf, ptr + first, len - first);
+  w->len += len;
+  if (w->len > w->max_queued) {
+    w->max_queued = w->len;
+  }
+  if (w->idle) {
+    pthread_cond_signal(&w->more);
+  }
+}
+
+/*
+ * call-seq:
+ *   writer.write(str)  -> Integer
+ *
+ * Queues str and returns the number of bytes queued, which is 0 when
+ * str was dropped.  An error of an earlier background write is raised
+ * here.
+ */
+mrb_value
+mrb_io_async_write(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_async *w = async_get(mrb, self);
+  mrb_value str;
+  const char *ptr;
+  size_t len, room, n;
+
+  mrb_get_args(mrb, "o", &str);
+  if (!mrb_string_p(str)) {
+    str = mrb_obj_as_string(mrb, str);
+  }
+  ptr = RSTRING_PTR(str);
+  len = RSTRING_LEN(str);
+
+  pthread_mutex_lock(&w->lock);
+  async_check_error(mrb, w);
+  if (len > w->capa - w->len) {
+    switch (w->overflow) {
+    case ASYNC_DROP:
+      w->dropped += len;
+      pthread_mutex_unlock(&w->lock);
+      return mrb_fixnum_value(0);
+    case ASYNC_ERROR:
+      pthread_mutex_unlock(&w->lock);
+      mrb_raise(mrb, E_IO_ERROR, "IO::AsyncWriter queue full");
+      break;
+    }
+    w->blocked++;
+  }
+  /* a write larger than the whole ring goes in as room appears */
+  n = 0;
+  while (n < len) {
+    while ((room = w->capa - w->len) == 0) {
+      pthread_cond_wait(&w->room, &w->lock);
+    }
+    if (room > len - n) {
+      room = len - n;
+    }
+    async_put(w, ptr + n, room);
+    n += room;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return mrb_fixnum_value(len);
+}
+
+/* writer.flush -> writer; returns once everything queued is written */
+mrb_value
+mrb_io_async_flush(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_async *w = async_get(mrb, self);
+
+  pthread_mutex_lock(&w->lock);
+  while (w->len > 0) {
+    pthread_cond_wait(&w->room, &w->lock);
+  }
+  async_check_error(mrb, w);
+  pthread_mutex_unlock(&w->lock);
+  return self;
+}
+
+/* writer.close -> nil; flushes and stops the thread */
+mrb_value
+mrb_io_async_close(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_async *w = async_get(mrb, self);
+  int err;
+
+  async_stop(w);
+  err = w->err;
+  if (err != 0) {
+    w->err = 0;
+    errno = err;
+    mrb_sys_fail(mrb, "IO::AsyncWriter");
+  }
+  return mrb_nil_value();
+}
+
+mrb_value
+mrb_io_async_closed(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_async *w;
+
+  w = (struct mrb_io_async *)mrb_get_datatype(mrb, self, &mrb_io_async_type);
+  return mrb_bool_value(w == NULL || w->closed);
+}
+
+static mrb_value
+async_num(mrb_state *mrb, uint64_t n)
+{
+  if (n > (uint64_t)MRB_INT_MAX) {
+    return mrb_float_value(mrb, (mrb_float)n);
+  }
+  return mrb_fixnum_value((mrb_int)n);
+}
+
+/*
+ * call-seq:
+ *   writer.stats  -> Hash
+ *
+ * :capacity, :queued (bytes waiting now), :max_queued, :written,
+ * :dropped, :blocked (writes that waited for room), :writes (write(2)
+ * calls) and :errors.
+ */
+mrb_value
+mrb_io_async_stats(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_async *w;
+  uint64_t v[8];
+  mrb_value hash;
+
+  w = (struct mrb_io_async *)mrb_get_datatype(mrb, self, &mrb_io_async_type);
+  if (w == NULL) {
+    mrb_raise(mrb, E_IO_ERROR, "uninitialized IO::AsyncWriter");
+  }
+  pthread_mutex_lock(&w->lock);
+  v[0] = w->capa;
+  v[1] = w->len;
+  v[2] = w->max_queued;
+  v[3] = w->written;
+  v[4] = w->dropped;
+  v[5] = w->blocked;
+  v[6] = w->writes;
+  v[7] = w->errors;
+  pthread_mutex_unlock(&w->lock);
+
+  hash = mrb_hash_new(mrb);
+#define ASYNC_STATS_SET(name, i) mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, name)), async_num(mrb, v[i]))
+  ASYNC_STATS_SET("capacity",   0);
+  ASYNC_STATS_SET("queued",     1);
+  ASYNC_STATS_SET("max_queued", 2);
+  ASYNC_STATS_SET("written",    3);
+  ASYNC_STATS_SET("dropped",    4);
+  ASYNC_STATS_SET("blocked",    5);
+  ASYNC_STATS_SET("writes",     6);
+  ASYNC_STATS_SET("errors",     7);
+#undef ASYNC_STATS_SET
+  return hash;
+}
+#endif /* MRB_IO_POSIX */
+
+void
+mrb_init_async_writer(mrb_state *mrb)
+{
+  struct RClass *io, *aw;
+
+  io = mrb_class_get(mrb, "IO");
+  aw = mrb_define_class_under(mrb, io, "AsyncWriter", mrb->object_class);
+  MRB_SET_INSTANCE_TT(aw, MRB_TT_DATA);
+
+  mrb_define_method(mrb, aw, "initialize", mrb_io_async_initialize, MRB_ARGS_ARG(1, 1));
+#ifdef MRB_IO_POSIX
+  mrb_define_method(mrb, aw, "write",   mrb_io_async_write,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, aw, "flush",   mrb_io_async_flush,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, aw, "close",   mrb_io_async_close,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, aw, "closed?", mrb_io_async_closed, MRB_ARGS_NONE());
+  mrb_define_method(mrb, aw, "stats",   mrb_io_async_stats,  MRB_ARGS_NONE());
+#endif
+}
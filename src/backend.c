@@ -0,0 +1,516 @@
+/*
+** backend.c - storage backend dispatch
+*/
+
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/ext/io.h"
+
+#include "mruby/error.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef MRB_IO_DEFAULT_BACKEND
+#ifdef MRB_IO_POSIX
+#define MRB_IO_DEFAULT_BACKEND mrb_io_backend_posix
+#else
+#define MRB_IO_DEFAULT_BACKEND mrb_io_backend_fatfs
+#endif
+#endif
+
+#define MOUNT_MAX        4
+#define MOUNT_PREFIX_MAX 32
+
+/*
+ * Descriptors of a mounted backend carry the mount slot above FD_SHIFT, so
+ * an fd alone is enough to find its backend again; those of the default
+ * backend are passed through unchanged.
+ */
+#define FD_SHIFT         20
+#define FD_LOCAL_MASK    ((1 << FD_SHIFT) - 1)
+
+struct mount {
+  char prefix[MOUNT_PREFIX_MAX];
+  size_t len;                       /* 0 for a free slot */
+  const struct mrb_io_backend *be;
+  int nopen;                        /* descriptors and dirs still open */
+  mrb_state *owner;                 /* File.mount caller, NULL from C */
+  int detached;                     /* unmounted, freed on the last close */
+};
+
+/*
+ * Mounts are a property of the process, like the files they hold: a mount
+ * made by one mrb_state serves every other one too.  Those made with
+ * File.mount go away with the mrb_state that made them.
+ */
+static struct mount mounts[MOUNT_MAX];
+
+static const struct mrb_io_backend *const default_backend = &MRB_IO_DEFAULT_BACKEND;
+
+/* a directory handle remembers which backend opened it */
+struct backend_dir {
+  const struct mrb_io_backend *be;
+  struct mount *m;
+  void *dir;
+};
+
+/*
+ * The mount serving path, if any, with *rest set to the path inside the
+ * mount ("/" for the mount point itself).  The longest prefix wins.
+ */
+static struct mount *
+mount_for_path(const char *path, const char **rest)
+{
+  struct mount *m, *found = NULL;
+
+  for (m = mounts; m < mounts + MOUNT_MAX; m++) {
+    if (m->len == 0 || m->detached || strncmp(path, m->prefix, m->len) != 0) {
+      continue;
+    }
+    if (path[m->len] != '\0' && path[m->len] != '/') {
+      continue;
+    }
+    if (found == NULL || m->len > found->len) {
+      found = m;
+    }
+  }
+  if (found != NULL) {
+    *rest = (path[found->len] == '\0') ? "/" : path + found->len;
+  } else {
+    *rest = path;
+  }
+  return found;
+}
+
+static const struct mrb_io_backend *
+backend_for_path(const char *path, const char **rest, struct mount **mp)
+{
+  struct mount *m = mount_for_path(path, rest);
+
+  if (mp != NULL) {
+    *mp = m;
+  }
+  return m ? m->be : default_backend;
+}
+
+static const struct mrb_io_backend *
+backend_for_fd(int fd, int *local)
+{
+  int slot;
+
+  if (fd < 0) {
+    *local = fd;
+    return default_backend;
+  }
+  slot = fd >> FD_SHIFT;
+  *local = fd & FD_LOCAL_MASK;
+  if (slot == 0) {
+    *local = fd;
+    return default_backend;
+  }
+  if (slot > MOUNT_MAX || mounts[slot - 1].len == 0) {
+    return NULL;
+  }
+  return mounts[slot - 1].be;
+}
+
+/* a descriptor or directory of m was closed */
+static void
+mount_release(struct mount *m)
+{
+  if (--m->nopen == 0 && m->detached) {
+    m->len = 0;
+    m->be = NULL;
+    m->detached = 0;
+  }
+}
+
+static struct mount *
+mount_add(const char *prefix, const struct mrb_io_backend *be)
+{
+  struct mount *m, *slot = NULL;
+  size_t len = strlen(prefix);
+
+  while (len > 1 && prefix[len - 1] == '/') {
+    len--;
+  }
+  if (len == 0 || len >= MOUNT_PREFIX_MAX) {
+    errno = EINVAL;
+    return NULL;
+  }
+  for (m = mounts; m < mounts + MOUNT_MAX; m++) {
+    if (m->len == len && !m->detached && strncmp(m->prefix, prefix, len) == 0) {
+      errno = EBUSY;
+      return NULL;
+    }
+    if (m->len == 0 && slot == NULL) {
+      slot = m;
+    }
+  }
+  if (slot == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memcpy(slot->prefix, prefix, len);
+  slot->prefix[len] = '\0';
+  slot->len = len;
+  slot->be = be;
+  slot->nopen = 0;
+  slot->owner = NULL;
+  return slot;
+}
+
+int
+mrb_io_mount(const char *prefix, const struct mrb_io_backend *be)
+{
+  return mount_add(prefix, be) ? 0 : -1;
+}
+
+int
+mrb_io_unmount(const char *prefix)
+{
+  struct mount *m;
+  size_t len = strlen(prefix);
+
+  while (len > 1 && prefix[len - 1] == '/') {
+    len--;
+  }
+  for (m = mounts; m < mounts + MOUNT_MAX; m++) {
+    if (m->len == len && !m->detached && strncmp(m->prefix, prefix, len) == 0) {
+      if (m->nopen > 0) {
+        errno = EBUSY;
+        return -1;
+      }
+      m->len = 0;
+      m->be = NULL;
+      return 0;
+    }
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+int
+mrb_io_sys_open(const char *path, int flags, int perm)
+{
+  const struct mrb_io_backend *be;
+  struct mount *m;
+  const char *rest;
+  int fd;
+
+  be = backend_for_path(path, &rest, &m);
+  fd = be->open(rest, flags, perm);
+  if (fd < 0 || m == NULL) {
+    return fd;
+  }
+  if (fd > FD_LOCAL_MASK) {
+    be->close(fd);
+    errno = EMFILE;
+    return -1;
+  }
+  m->nopen++;
+  return ((int)(m - mounts + 1) << FD_SHIFT) | fd;
+}
+
+int
+mrb_io_sys_close(int fd)
+{
+  const struct mrb_io_backend *be;
+  int local, n;
+
+  be = backend_for_fd(fd, &local);
+  if (be == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  n = be->close(local);
+  if (n == 0 && local != fd) {
+    mount_release(&mounts[(fd >> FD_SHIFT) - 1]);
+  }
+  return n;
+}
+
+ssize_t
+mrb_io_sys_read(int fd, void *buf, size_t len)
+{
+  const struct mrb_io_backend *be;
+  int local;
+
+  be = backend_for_fd(fd, &local);
+  if (be == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  return be->read(local, buf, len);
+}
+
+ssize_t
+mrb_io_sys_write(int fd, const void *buf, size_t len)
+{
+  const struct mrb_io_backend *be;
+  int local;
+
+  be = backend_for_fd(fd, &local);
+  if (be == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  return be->write(local, buf, len);
+}
+
+off_t
+mrb_io_sys_seek(int fd, off_t offset, int whence)
+{
+  const struct mrb_io_backend *be;
+  int local;
+
+  be = backend_for_fd(fd, &local);
+  if (be == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  return be->seek(local, offset, whence);
+}
+
+int
+mrb_io_sys_fstat(int fd, struct mrb_io_stat *st)
+{
+  const struct mrb_io_backend *be;
+  int local;
+
+  be = backend_for_fd(fd, &local);
+  if (be == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  return be->fstat(local, st);
+}
+
+int
+mrb_io_sys_native(int fd)
+{
+  return fd >= 0 && (fd >> FD_SHIFT) == 0 && default_backend->native;
+}
+
+int
+mrb_io_sys_stat(const char *path, struct mrb_io_stat *st)
+{
+  const char *rest;
+
+  return backend_for_path(path, &rest, NULL)->stat(rest, st);
+}
+
+int
+mrb_io_sys_lstat(const char *path, struct mrb_io_stat *st)
+{
+  const char *rest;
+
+  return backend_for_path(path, &rest, NULL)->lstat(rest, st);
+}
+
+int
+mrb_io_sys_unlink(const char *path)
+{
+  const char *rest;
+
+  return backend_for_path(path, &rest, NULL)->unlink(rest);
+}
+
+int
+mrb_io_sys_rename(const char *from, const char *to)
+{
+  const struct mrb_io_backend *be;
+  struct mount *m1, *m2;
+  const char *rest1, *rest2;
+
+  be = backend_for_path(from, &rest1, &m1);
+  backend_for_path(to, &rest2, &m2);
+  if (m1 != m2) {
+    errno = EXDEV;
+    return -1;
+  }
+  return be->rename(rest1, rest2);
+}
+
+int
+mrb_io_sys_mkdir(const char *path, int mode)
+{
+  const char *rest;
+
+  return backend_for_path(path, &rest, NULL)->mkdir(rest, mode);
+}
+
+int
+mrb_io_sys_rmdir(const char *path)
+{
+  const char *rest;
+
+  return backend_for_path(path, &rest, NULL)->rmdir(rest);
+}
+
+void *
+mrb_io_sys_opendir(const char *path)
+{
+  struct backend_dir *d;
+  const char *rest;
+
+  d = (struct backend_dir *)malloc(sizeof(struct backend_dir));
+  if (d == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  d->be = backend_for_path(path, &rest, &d->m);
+  d->dir = d->be->opendir(rest);
+  if (d->dir == NULL) {
+    free(d);
+    return NULL;
+  }
+  if (d->m != NULL) {
+    d->m->nopen++;
+  }
+  return d;
+}
+
+int
+mrb_io_sys_readdir(void *dir, struct mrb_io_dirent *ent)
+{
+  struct backend_dir *d = (struct backend_dir *)dir;
+
+  return d->be->readdir(d->dir, ent);
+}
+
+void
+mrb_io_sys_rewinddir(void *dir)
+{
+  struct backend_dir *d = (struct backend_dir *)dir;
+
+  d->be->rewinddir(d->dir);
+}
+
+int
+mrb_io_sys_closedir(void *dir)
+{
+  struct backend_dir *d = (struct backend_dir *)dir;
+  int n;
+
+  n = d->be->closedir(d->dir);
+  if (d->m != NULL) {
+    mount_release(d->m);
+  }
+  free(d);
+  return n;
+}
+
+static const struct mrb_io_backend *
+backend_by_name(const char *name)
+{
+  if (strcmp(name, mrb_io_backend_ram.name) == 0) {
+    return &mrb_io_backend_ram;
+  }
+  return NULL;
+}
+
+/*
+ * call-seq:
+ *   File.mount(prefix, backend)  -> prefix
+ *
+ * Serves the files under prefix from the named backend.  "ram" is the
+ * in-memory file system; paths are passed to it relative to prefix.
+ */
+mrb_value
+mrb_file_s_mount(mrb_state *mrb, mrb_value klass)
+{
+  const struct mrb_io_backend *be;
+  mrb_value prefix, name;
+  const char *cprefix;
+  struct mount *m;
+
+  mrb_get_args(mrb, "So", &prefix, &name);
+  if (mrb_symbol_p(name)) {
+    name = mrb_sym2str(mrb, mrb_symbol(name));
+  }
+  name = mrb_convert_type(mrb, name, MRB_TT_STRING, "String", "to_str");
+  be = backend_by_name(mrb_string_value_cstr(mrb, &name));
+  if (be == NULL) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown backend: %S", name);
+  }
+  cprefix = mrb_string_value_cstr(mrb, &prefix);
+  m = mount_add(cprefix, be);
+  if (m == NULL) {
+    mrb_sys_fail(mrb, cprefix);
+  }
+  m->owner = mrb;
+  mrb_file_stat_cache_clear(mrb);
+  return prefix;
+}
+
+mrb_value
+mrb_file_s_unmount(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value prefix;
+  const char *cprefix;
+
+  mrb_get_args(mrb, "S", &prefix);
+  cprefix = mrb_string_value_cstr(mrb, &prefix);
+  if (mrb_io_unmount(cprefix) == -1) {
+    mrb_sys_fail(mrb, cprefix);
+  }
+  mrb_file_stat_cache_clear(mrb);
+  return mrb_nil_value();
+}
+
+/* File.mounts -> {prefix => backend name} */
+mrb_value
+mrb_file_s_mounts(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value hash;
+  struct mount *m;
+
+  hash = mrb_hash_new(mrb);
+  for (m = mounts; m < mounts + MOUNT_MAX; m++) {
+    if (m->len > 0 && !m->detached) {
+      mrb_hash_set(mrb, hash, mrb_str_new(mrb, m->prefix, m->len), mrb_str_new_cstr(mrb, m->be->name));
+    }
+  }
+  return hash;
+}
+
+void
+mrb_init_backend(mrb_state *mrb)
+{
+  struct RClass *file;
+
+  file = mrb_class_get(mrb, "File");
+  mrb_define_class_method(mrb, file, "mount",   mrb_file_s_mount,   MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, file, "unmount", mrb_file_s_unmount, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, file, "mounts",  mrb_file_s_mounts,  MRB_ARGS_NONE());
+}
+
+/*
+ * Unmount what mrb mounted with File.mount.  Its IOs and Dirs are only
+ * collected after this, so a mount still in use stops serving paths now
+ * and its slot is freed when the last of them is closed.
+ */
+void
+mrb_final_backend(mrb_state *mrb)
+{
+  struct mount *m;
+
+  for (m = mounts; m < mounts + MOUNT_MAX; m++) {
+    if (m->len == 0 || m->detached || m->owner != mrb) {
+      continue;
+    }
+    m->owner = NULL;
+    if (m->nopen > 0) {
+      m->detached = 1;
+    } else {
+      m->len = 0;
+      m->be = NULL;
+    }
+  }
+}
@@ -0,0 +1,223 @@
+/*
+** backend_fatfs.c - storage backend on EV3RT FatFS
+*/
+
+#include "mruby.h"
+#include "mruby/ext/io.h"
+
+#ifndef MRB_IO_POSIX
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fatfs_dri.h"
+
+/*
+ * Descriptor I/O goes through newlib, which EV3RT backs with FatFS; path
+ * operations newlib does not cover call FatFS directly.
+ */
+
+struct fatfs_dir {
+  DIR dir;
+  FILINFO fno;
+#if _USE_LFN
+  char lfn[_MAX_LFN + 1];
+#endif
+};
+
+static int
+fatfs_fail(FRESULT res)
+{
+  switch (res) {
+  case FR_NO_FILE:
+  case FR_NO_PATH:
+  case FR_INVALID_NAME:
+    errno = ENOENT;
+    break;
+  case FR_EXIST:
+    errno = EEXIST;
+    break;
+  case FR_DENIED:
+    errno = EACCES;
+    break;
+  default:
+    errno = EIO;
+    break;
+  }
+  return -1;
+}
+
+/* days since 1970-01-01 of a proleptic Gregorian date */
+static mrb_int
+fatfs_days_from_civil(int y, int m, int d)
+{
+  int era, yoe, doy, doe;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (mrb_int)era * 146097 + doe - 719468;
+}
+
+/*
+ * FatFS keeps no inode data: the mode is made up from the attribute
+ * bits, and the single (local) timestamp serves as atime, mtime and ctime.
+ */
+static void
+fatfs_stat_convert(const FILINFO *fno, struct mrb_io_stat *st)
+{
+  mrb_int t;
+
+  memset(st, 0, sizeof(*st));
+  st->size = fno->fsize;
+  if (fno->fattrib & AM_DIR) {
+    st->mode = S_IFDIR | 0777;
+  } else {
+    st->mode = S_IFREG | ((fno->fattrib & AM_RDO) ? 0444 : 0666);
+  }
+  st->nlink = 1;
+  t = fatfs_days_from_civil((fno->fdate >> 9) + 1980, (fno->fdate >> 5) & 15, fno->fdate & 31) * 86400;
+  t += (fno->ftime >> 11) * 3600 + ((fno->ftime >> 5) & 63) * 60 + (fno->ftime & 31) * 2;
+  st->atime = st->mtime = st->ctime = t;
+}
+
+static int
+fatfs_open(const char *path, int flags, int perm)
+{
+  return open(path, flags, perm);
+}
+
+static int
+fatfs_fstat(int fd, struct mrb_io_stat *st)
+{
+  /* FatFS cannot get from a descriptor back to its directory entry */
+  errno = ENOSYS;
+  return -1;
+}
+
+static int
+fatfs_stat(const char *path, struct mrb_io_stat *st)
+{
+  FILINFO fno;
+  FRESULT res;
+
+#if _USE_LFN
+  fno.lfname = NULL;
+  fno.lfsize = 0;
+#endif
+  res = f_stat(path, &fno);
+  if (res != FR_OK) {
+    return fatfs_fail(res);
+  }
+  fatfs_stat_convert(&fno, st);
+  return 0;
+}
+
+static int
+fatfs_unlink(const char *path)
+{
+  FRESULT res = f_unlink(path);
+
+  return (res == FR_OK) ? 0 : fatfs_fail(res);
+}
+
+/* rename(2) semantics: an existing file at to is replaced */
+static int
+fatfs_rename(const char *from, const char *to)
+{
+  FRESULT res;
+
+  res = f_rename(from, to);
+  if (res == FR_EXIST && f_unlink(to) == FR_OK) {
+    res = f_rename(from, to);
+  }
+  return (res == FR_OK) ? 0 : fatfs_fail(res);
+}
+
+static int
+fatfs_mkdir(const char *path, int mode)
+{
+  FRESULT res = f_mkdir(path);
+
+  return (res == FR_OK) ? 0 : fatfs_fail(res);
+}
+
+static void *
+fatfs_opendir(const char *path)
+{
+  struct fatfs_dir *d;
+  FRESULT res;
+
+  d = (struct fatfs_dir *)malloc(sizeof(struct fatfs_dir));
+  if (d == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  res = f_opendir(&d->dir, path);
+  if (res != FR_OK) {
+    free(d);
+    fatfs_fail(res);
+    return NULL;
+  }
+  return d;
+}
+
+static int
+fatfs_readdir(void *dir, struct mrb_io_dirent *ent)
+{
+  struct fatfs_dir *d = (struct fatfs_dir *)dir;
+  FRESULT res;
+
+#if _USE_LFN
+  d->fno.lfname = d->lfn;
+  d->fno.lfsize = sizeof(d->lfn);
+#endif
+  res = f_readdir(&d->dir, &d->fno);
+  if (res != FR_OK) {
+    return fatfs_fail(res);
+  }
+  if (d->fno.fname[0] == '\0') {
+    return 0;
+  }
+#if _USE_LFN
+  ent->name = d->lfn[0] ? d->lfn : d->fno.fname;
+#else
+  ent->name = d->fno.fname;
+#endif
+  ent->is_dir = (d->fno.fattrib & AM_DIR) != 0;
+  return 1;
+}
+
+static void
+fatfs_rewinddir(void *dir)
+{
+  f_readdir(&((struct fatfs_dir *)dir)->dir, NULL);
+}
+
+static int
+fatfs_closedir(void *dir)
+{
+  struct fatfs_dir *d = (struct fatfs_dir *)dir;
+  FRESULT res;
+
+  res = f_closedir(&d->dir);
+  free(d);
+  return (res == FR_OK) ? 0 : fatfs_fail(res);
+}
+
+const struct mrb_io_backend mrb_io_backend_fatfs = {
+  "fatfs", 0,
+  fatfs_open, close, read, write, lseek,
+  fatfs_fstat, fatfs_stat, fatfs_stat, fatfs_unlink, fatfs_rename, fatfs_mkdir, fatfs_unlink,
+  fatfs_opendir, fatfs_readdir, fatfs_rewinddir, fatfs_closedir
+};
+
+#endif /* !MRB_IO_POSIX */
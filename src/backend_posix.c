@@ -0,0 +1,126 @@
+/*
+** backend_posix.c - storage backend on POSIX system calls
+*/
+
+#include "mruby.h"
+#include "mruby/ext/io.h"
+
+#ifdef MRB_IO_POSIX
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+static void
+posix_stat_convert(const struct stat *sb, struct mrb_io_stat *st)
+{
+  st->size = sb->st_size;
+  st->mode = sb->st_mode;
+  st->atime = sb->st_atime;
+  st->mtime = sb->st_mtime;
+  st->ctime = sb->st_ctime;
+  st->dev = sb->st_dev;
+  st->ino = sb->st_ino;
+  st->nlink = sb->st_nlink;
+  st->uid = sb->st_uid;
+  st->gid = sb->st_gid;
+}
+
+static int
+posix_open(const char *path, int flags, int perm)
+{
+  return open(path, flags, perm);
+}
+
+static int
+posix_fstat(int fd, struct mrb_io_stat *st)
+{
+  struct stat sb;
+
+  if (fstat(fd, &sb) == -1) {
+    return -1;
+  }
+  posix_stat_convert(&sb, st);
+  return 0;
+}
+
+static int
+posix_stat(const char *path, struct mrb_io_stat *st)
+{
+  struct stat sb;
+
+  if (stat(path, &sb) == -1) {
+    return -1;
+  }
+  posix_stat_convert(&sb, st);
+  return 0;
+}
+
+static int
+posix_lstat(const char *path, struct mrb_io_stat *st)
+{
+  struct stat sb;
+
+  if (lstat(path, &sb) == -1) {
+    return -1;
+  }
+  posix_stat_convert(&sb, st);
+  return 0;
+}
+
+static int
+posix_mkdir(const char *path, int mode)
+{
+  return mkdir(path, mode);
+}
+
+static void *
+posix_opendir(const char *path)
+{
+  return opendir(path);
+}
+
+static int
+posix_readdir(void *dir, struct mrb_io_dirent *ent)
+{
+  struct dirent *dp;
+
+  errno = 0;
+  dp = readdir((DIR *)dir);
+  if (dp == NULL) {
+    return errno ? -1 : 0;
+  }
+  ent->name = dp->d_name;
+#ifdef DT_DIR
+  ent->is_dir = (dp->d_type == DT_UNKNOWN || dp->d_type == DT_LNK) ? -1 : (dp->d_type == DT_DIR);
+#else
+  ent->is_dir = -1;
+#endif
+  return 1;
+}
+
+static void
+posix_rewinddir(void *dir)
+{
+  rewinddir((DIR *)dir);
+}
+
+static int
+posix_closedir(void *dir)
+{
+  return closedir((DIR *)dir);
+}
+
+const struct mrb_io_backend mrb_io_backend_posix = {
+  "posix", 1,
+  posix_open, close, read, write, lseek,
+  posix_fstat, posix_stat, posix_lstat, unlink, rename, posix_mkdir, rmdir,
+  posix_opendir, posix_readdir, posix_rewinddir, posix_closedir
+};
+
+#endif /* MRB_IO_POSIX */
@@ -0,0 +1,706 @@
+/*
+** backend_ram.c - in-memory storage backend
+*/
+
+#include "mruby.h"
+#include "mruby/ext/io.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * A small file system held in malloc'ed memory, for scratch files that
+ * should not touch the SD card.  Its contents belong to the process and
+ * outlive mounts: unmounting and mounting again finds the same files.
+ * Paths seen here are relative to the mount point, e.g. "/log/run1".
+ */
+
+#ifndef MRB_IO_RAMFS_FILES
+#define MRB_IO_RAMFS_FILES 16             /* descriptors open at once */
+#endif
+#ifndef MRB_IO_RAMFS_SIZE
+#define MRB_IO_RAMFS_SIZE  (1024 * 1024)  /* bytes of file data held at most */
+#endif
+
+#ifndef O_ACCMODE
+#define O_ACCMODE (O_RDONLY | O_WRONLY | O_RDWR)
+#endif
+
+#define RAM_PATH_MAX 256
+#define RAM_FD_BASE  3  /* keep clear of the standard descriptors */
+
+struct ram_node {
+  struct ram_node *next;
+  char *path;          /* normalised, e.g. "/a/b" */
+  int is_dir;
+  char *data;
+  size_t len, capa;
+  time_t mtime;
+  unsigned long ino;
+  int nopen;           /* descriptors open on the node */
+  int linked;          /* still reachable by its path */
+};
+
+struct ram_file {
+  struct ram_node *node;  /* NULL for a free slot */
+  off_t pos;
+  int flags;
+};
+
+struct ram_dir {
+  char path[RAM_PATH_MAX];
+  size_t len;
+  int index;  /* entries returned so far, "." and ".." included */
+};
+
+static struct ram_node ram_root = { NULL, (char *)"/", 1, NULL, 0, 0, 0, 1, 0, 1 };
+static struct ram_node *ram_head, *ram_tail;
+static struct ram_file ram_files[MRB_IO_RAMFS_FILES];
+static size_t ram_used;
+static unsigned long ram_ino = 1;
+
+/* collapse separators and drop a trailing one; "" and "/" are the root */
+static int
+ram_normalize(const char *path, char *buf)
+{
+  size_t len = 0;
+
+  buf[len++] = '/';
+  while (*path) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    if (buf[len - 1] != '/') {
+      buf[len++] = '/';
+    }
+    while (*path && *path != '/') {
+      if (len + 1 >= RAM_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+      }
+      buf[len++] = *path++;
+    }
+  }
+  buf[len] = '\0';
+  return 0;
+}
+
+static struct ram_node *
+ram_lookup(const char *path)
+{
+  struct ram_node *n;
+
+  if (strcmp(path, "/") == 0) {
+    return &ram_root;
+  }
+  for (n = ram_head; n != NULL; n = n->next) {
+    if (strcmp(n->path, path) == 0) {
+      return n;
+    }
+  }
+  return NULL;
+}
+
+/* is n directly inside the directory dir[0, len]? */
+static int
+ram_child_p(const struct ram_node *n, const char *dir, size_t len)
+{
+  const char *rest;
+
+  if (len == 1) {
+    rest = n->path + 1;
+  } else if (strncmp(n->path, dir, len) == 0 && n->path[len] == '/') {
+    rest = n->path + len + 1;
+  } else {
+    return 0;
+  }
+  return strchr(rest, '/') == NULL;
+}
+
+/* the directory path would be created in must exist */
+static int
+ram_check_parent(const char *path)
+{
+  char parent[RAM_PATH_MAX];
+  const char *slash = strrchr(path, '/');
+  struct ram_node *n;
+
+  if (slash == path) {
+    return 0;
+  }
+  memcpy(parent, path, slash - path);
+  parent[slash - path] = '\0';
+  n = ram_lookup(parent);
+  if (n == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (!n->is_dir) {
+    errno = ENOTDIR;
+    return -1;
+  }
+  return 0;
+}
+
+static struct ram_node *
+ram_create(const char *path, int is_dir)
+{
+  struct ram_node *n;
+  size_t len = strlen(path);
+
+  n = (struct ram_node *)malloc(sizeof(struct ram_node));
+  if (n == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  n->path = (char *)malloc(len + 1);
+  if (n->path == NULL) {
+    free(n);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memcpy(n->path, path, len + 1);
+  n->is_dir = is_dir;
+  n->data = NULL;
+  n->len = n->capa = 0;
+  n->mtime = time(NULL);
+  n->ino = ++ram_ino;
+  n->nopen = 0;
+  n->linked = 1;
+  n->next = NULL;
+  /* appended, so that readdir positions survive new files */
+  if (ram_tail != NULL) {
+    ram_tail->next = n;
+  } else {
+    ram_head = n;
+  }
+  ram_tail = n;
+  return n;
+}
+
+static void
+ram_free(struct ram_node *n)
+{
+  ram_used -= n->capa;
+  free(n->data);
+  free(n->path);
+  free(n);
+}
+
+/* take n off the path list; its memory goes once no descriptor uses it */
+static void
+ram_remove(struct ram_node *n)
+{
+  struct ram_node **p, *prev = NULL;
+
+  for (p = &ram_head; *p != NULL; prev = *p, p = &(*p)->next) {
+    if (*p == n) {
+      *p = n->next;
+      if (ram_tail == n) {
+        ram_tail = prev;
+      }
+      break;
+    }
+  }
+  n->linked = 0;
+  if (n->nopen == 0) {
+    ram_free(n);
+  }
+}
+
+static struct ram_file *
+ram_file(int fd)
+{
+  if (fd < RAM_FD_BASE || fd >= RAM_FD_BASE + MRB_IO_RAMFS_FILES ||
+      ram_files[fd - RAM_FD_BASE].node == NULL) {
+    errno = EBADF;
+    return NULL;
+  }
+  return &ram_files[fd - RAM_FD_BASE];
+}
+
+static int
+ram_reserve(struct ram_node *n, size_t need)
+{
+  size_t capa;
+  char *p;
+
+  if (need <= n->capa) {
+    return 0;
+  }
+  capa = n->capa < 64 ? 64 : n->capa * 2;
+  if (capa < need) {
+    capa = need;
+  }
+  if (ram_used - n->capa + capa > MRB_IO_RAMFS_SIZE) {
+    /* no room to grow ahead of need: try for just what is asked */
+    capa = need;
+    if (ram_used - n->capa + capa > MRB_IO_RAMFS_SIZE) {
+      errno = ENOSPC;
+      return -1;
+    }
+  }
+  p = (char *)realloc(n->data, capa);
+  if (p == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  ram_used += capa - n->capa;
+  n->data = p;
+  n->capa = capa;
+  return 0;
+}
+
+static int
+ram_open(const char *path, int flags, int perm)
+{
+  char buf[RAM_PATH_MAX];
+  struct ram_node *n;
+  int i, acc = flags & O_ACCMODE;
+
+  if (ram_normalize(path, buf) == -1) {
+    return -1;
+  }
+  for (i = 0; i < MRB_IO_RAMFS_FILES && ram_files[i].node != NULL; i++)
+    ;
+  if (i == MRB_IO_RAMFS_FILES) {
+    errno = EMFILE;
+    return -1;
+  }
+  n = ram_lookup(buf);
+  if (n != NULL) {
+    if ((flags & O_CREAT) && (flags & O_EXCL)) {
+      errno = EEXIST;
+      return -1;
+    }
+    if (n->is_dir) {
+      errno = EISDIR;
+      return -1;
+    }
+  } else {
+    if (!(flags & O_CREAT)) {
+      errno = ENOENT;
+      return -1;
+    }
+    if (ram_check_parent(buf) == -1 || (n = ram_create(buf, 0)) == NULL) {
+      return -1;
+    }
+  }
+  if ((flags & O_TRUNC) && acc != O_RDONLY) {
+    ram_used -= n->capa;
+    free(n->data);
+    n->data = NULL;
+    n->len = n->capa = 0;
+    n->mtime = time(NULL);
+  }
+  n->nopen++;
+  ram_files[i].node = n;
+  ram_files[i].pos = 0;
+  ram_files[i].flags = flags;
+  return RAM_FD_BASE + i;
+}
+
+static int
+ram_close(int fd)
+{
+  struct ram_file *f = ram_file(fd);
+  struct ram_node *n;
+
+  if (f == NULL) {
+    return -1;
+  }
+  n = f->node;
+  f->node = NULL;
+  if (--n->nopen == 0 && !n->linked) {
+    ram_free(n);
+  }
+  return 0;
+}
+
+static ssize_t
+ram_read(int fd, void *buf, size_t len)
+{
+  struct ram_file *f = ram_file(fd);
+  struct ram_node *n;
+
+  if (f == NULL) {
+    return -1;
+  }
+  if ((f->flags & O_ACCMODE) == O_WRONLY) {
+    errno = EBADF;
+    return -1;
+  }
+  n = f->node;
+  if ((size_t)f->pos >= n->len) {
+    return 0;
+  }
+  if (len > n->len - f->pos) {
+    len = n->len - f->pos;
+  }
+  memcpy(buf, n->data + f->pos, len);
+  f->pos += len;
+  return len;
+}
+
+static ssize_t
+ram_write(int fd, const void *buf, size_t len)
+{
+  struct ram_file *f = ram_file(fd);
+  struct ram_node *n;
+  size_t end;
+
+  if (f == NULL) {
+    return -1;
+  }
+  if ((f->flags & O_ACCMODE) == O_RDONLY) {
+    errno = EBADF;
+    return -1;
+  }
+  n = f->node;
+  if (f->flags & O_APPEND) {
+    f->pos = n->len;
+  }
+  end = f->pos + len;
+  if (ram_reserve(n, end) == -1) {
+    return -1;
+  }
+  if ((size_t)f->pos > n->len) {
+    /* a write past the end leaves a hole of zeros */
+    memset(n->data + n->len, 0, f->pos - n->len);
+  }
+  memcpy(n->data + f->pos, buf, len);
+  f->pos = end;
+  if (end > n->len) {
+    n->len = end;
+  }
+  n->mtime = time(NULL);
+  return len;
+}
+
+static off_t
+ram_seek(int fd, off_t offset, int whence)
+{
+  struct ram_file *f = ram_file(fd);
+  off_t pos;
+
+  if (f == NULL) {
+    return -1;
+  }
+  switch (whence) {
+  case SEEK_SET: pos = offset; break;
+  case SEEK_CUR: pos = f->pos + offset; break;
+  case SEEK_END: pos = f->node->len + offset; break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  if (pos < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  f->pos = pos;
+  return pos;
+}
+
+static void
+ram_stat_convert(const struct ram_node *n, struct mrb_io_stat *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->size = n->len;
+  st->mode = n->is_dir ? (S_IFDIR | 0777) : (S_IFREG | 0666);
+  st->atime = st->mtime = st->ctime = n->mtime;
+  st->ino = n->ino;
+  st->nlink = 1;
+}
+
+static int
+ram_fstat(int fd, struct mrb_io_stat *st)
+{
+  struct ram_file *f = ram_file(fd);
+
+  if (f == NULL) {
+    return -1;
+  }
+  ram_stat_convert(f->node, st);
+  return 0;
+}
+
+static int
+ram_stat(const char *path, struct mrb_io_stat *st)
+{
+  char buf[RAM_PATH_MAX];
+  struct ram_node *n;
+
+  if (ram_normalize(path, buf) == -1) {
+    return -1;
+  }
+  n = ram_lookup(buf);
+  if (n == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  ram_stat_convert(n, st);
+  return 0;
+}
+
+static int
+ram_unlink(const char *path)
+{
+  char buf[RAM_PATH_MAX];
+  struct ram_node *n;
+
+  if (ram_normalize(path, buf) == -1) {
+    return -1;
+  }
+  n = ram_lookup(buf);
+  if (n == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (n->is_dir) {
+    errno = EISDIR;
+    return -1;
+  }
+  ram_remove(n);
+  return 0;
+}
+
+static int
+ram_empty_dir_p(const char *path)
+{
+  struct ram_node *n;
+  size_t len = strlen(path);
+
+  for (n = ram_head; n != NULL; n = n->next) {
+    if (ram_child_p(n, path, len)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int
+ram_set_path(struct ram_node *n, const char *path, size_t len)
+{
+  char *p = (char *)malloc(len + 1);
+
+  if (p == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(p, path, len);
+  p[len] = '\0';
+  free(n->path);
+  n->path = p;
+  return 0;
+}
+
+static int
+ram_rename(const char *from, const char *to)
+{
+  char src[RAM_PATH_MAX], dst[RAM_PATH_MAX], buf[RAM_PATH_MAX];
+  struct ram_node *n, *old, *c;
+  size_t slen, dlen, rlen;
+
+  if (ram_normalize(from, src) == -1 || ram_normalize(to, dst) == -1) {
+    return -1;
+  }
+  n = ram_lookup(src);
+  if (n == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (n == &ram_root) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (strcmp(src, dst) == 0) {
+    return 0;
+  }
+  slen = strlen(src);
+  dlen = strlen(dst);
+  if (n->is_dir && strncmp(dst, src, slen) == 0 && dst[slen] == '/') {
+    /* a directory cannot move into itself */
+    errno = EINVAL;
+    return -1;
+  }
+  if (ram_check_parent(dst) == -1) {
+    return -1;
+  }
+  old = ram_lookup(dst);
+  if (old != NULL) {
+    if (old == &ram_root) {
+      errno = EBUSY;
+      return -1;
+    }
+    if (old->is_dir != n->is_dir) {
+      errno = old->is_dir ? EISDIR : ENOTDIR;
+      return -1;
+    }
+    if (old->is_dir && !ram_empty_dir_p(dst)) {
+      errno = ENOTEMPTY;
+      return -1;
+    }
+  }
+  if (n->is_dir) {
+    /* everything below moves along */
+    for (c = ram_head; c != NULL; c = c->next) {
+      if (strncmp(c->path, src, slen) == 0 && c->path[slen] == '/') {
+        rlen = strlen(c->path + slen);
+        if (dlen + rlen >= RAM_PATH_MAX) {
+          errno = ENAMETOOLONG;
+          return -1;
+        }
+      }
+    }
+    for (c = ram_head; c != NULL; c = c->next) {
+      if (strncmp(c->path, src, slen) == 0 && c->path[slen] == '/') {
+        rlen = strlen(c->path + slen);
+        memcpy(buf, dst, dlen);
+        memcpy(buf + dlen, c->path + slen, rlen);
+        if (ram_set_path(c, buf, dlen + rlen) == -1) {
+          return -1;
+        }
+      }
+    }
+  }
+  if (ram_set_path(n, dst, dlen) == -1) {
+    return -1;
+  }
+  if (old != NULL) {
+    ram_remove(old);
+  }
+  return 0;
+}
+
+static int
+ram_mkdir(const char *path, int mode)
+{
+  char buf[RAM_PATH_MAX];
+
+  if (ram_normalize(path, buf) == -1) {
+    return -1;
+  }
+  if (ram_lookup(buf) != NULL) {
+    errno = EEXIST;
+    return -1;
+  }
+  if (ram_check_parent(buf) == -1 || ram_create(buf, 1) == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+static int
+ram_rmdir(const char *path)
+{
+  char buf[RAM_PATH_MAX];
+  struct ram_node *n;
+
+  if (ram_normalize(path, buf) == -1) {
+    return -1;
+  }
+  n = ram_lookup(buf);
+  if (n == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (!n->is_dir) {
+    errno = ENOTDIR;
+    return -1;
+  }
+  if (n == &ram_root) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (!ram_empty_dir_p(buf)) {
+    errno = ENOTEMPTY;
+    return -1;
+  }
+  ram_remove(n);
+  return 0;
+}
+
+static void *
+ram_opendir(const char *path)
+{
+  struct ram_dir *d;
+  struct ram_node *n;
+  char buf[RAM_PATH_MAX];
+
+  if (ram_normalize(path, buf) == -1) {
+    return NULL;
+  }
+  n = ram_lookup(buf);
+  if (n == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+  if (!n->is_dir) {
+    errno = ENOTDIR;
+    return NULL;
+  }
+  d = (struct ram_dir *)malloc(sizeof(struct ram_dir));
+  if (d == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  d->len = strlen(buf);
+  memcpy(d->path, buf, d->len + 1);
+  d->index = 0;
+  return d;
+}
+
+static int
+ram_readdir(void *dir, struct mrb_io_dirent *ent)
+{
+  struct ram_dir *d = (struct ram_dir *)dir;
+  struct ram_node *n;
+  int i = 2;
+
+  if (d->index < 2) {
+    ent->name = (d->index == 0) ? "." : "..";
+    ent->is_dir = 1;
+    d->index++;
+    return 1;
+  }
+  for (n = ram_head; n != NULL; n = n->next) {
+    if (!ram_child_p(n, d->path, d->len)) {
+      continue;
+    }
+    if (i++ == d->index) {
+      ent->name = strrchr(n->path, '/') + 1;
+      ent->is_dir = n->is_dir;
+      d->index++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void
+ram_rewinddir(void *dir)
+{
+  ((struct ram_dir *)dir)->index = 0;
+}
+
+static int
+ram_closedir(void *dir)
+{
+  free(dir);
+  return 0;
+}
+
+const struct mrb_io_backend mrb_io_backend_ram = {
+  "ram", 0,
+  ram_open, ram_close, ram_read, ram_write, ram_seek,
+  ram_fstat, ram_stat, ram_stat, ram_unlink, ram_rename, ram_mkdir, ram_rmdir,
+  ram_opendir, ram_readdir, ram_rewinddir, ram_closedir
+};
@@ -0,0 +1,423 @@
+/*
+** dir.c - Dir class
+*/
+
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include "mruby/ext/io.h"
+
+#include "mruby/error.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <string.h>
+
+#define DIR_PATH_MAX 1024
+
+/*
+ * An open directory.  Entries are read one at a time from the storage
+ * backend, so listing a directory never holds more than one name.
+ */
+struct mrb_dir {
+  void *dir;  /* backend handle, or NULL once closed */
+};
+
+static int
+dir_open(struct mrb_dir *d, const char *path)
+{
+  d->dir = mrb_io_sys_opendir(path);
+  return d->dir ? 0 : -1;
+}
+
+/* next entry, or 0 at the end; -1 with errno on error */
+static int
+dir_next(struct mrb_dir *d, struct mrb_io_dirent *ent)
+{
+  return mrb_io_sys_readdir(d->dir, ent);
+}
+
+static void
+dir_close(struct mrb_dir *d)
+{
+  if (d->dir != NULL) {
+    mrb_io_sys_closedir(d->dir);
+    d->dir = NULL;
+  }
+}
+
+static void
+mrb_dir_free(mrb_state *mrb, void *ptr)
+{
+  struct mrb_dir *d = (struct mrb_dir *)ptr;
+
+  if (d != NULL) {
+    dir_close(d);
+    mrb_free(mrb, d);
+  }
+}
+
+struct mrb_data_type mrb_dir_type = { "Dir", mrb_dir_free };
+
+static struct mrb_dir *
+dir_get_open(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_dir *d;
+
+  d = (struct mrb_dir *)mrb_get_datatype(mrb, self, &mrb_dir_type);
+  if (d == NULL || d->dir == NULL) {
+    mrb_raise(mrb, E_IO_ERROR, "closed directory");
+  }
+  return d;
+}
+
+mrb_value
+mrb_dir_init(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_dir *d;
+  mrb_value path;
+  const char *cpath;
+
+  mrb_get_args(mrb, "S", &path);
+  d = (struct mrb_dir *)DATA_PTR(self);
+  if (d != NULL) {
+    mrb_dir_free(mrb, d);
+    DATA_PTR(self) = NULL;
+  }
+  DATA_TYPE(self) = &mrb_dir_type;
+
+  d = (struct mrb_dir *)mrb_malloc(mrb, sizeof(struct mrb_dir));
+  d->dir = NULL;
+  DATA_PTR(self) = d;
+  cpath = mrb_string_value_cstr(mrb, &path);
+  if (dir_open(d, cpath) == -1) {
+    mrb_sys_fail(mrb, cpath);
+  }
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@path"), path);
+  return self;
+}
+
+/* Dir#read -> String or nil */
+mrb_value
+mrb_dir_read(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_dir *d = dir_get_open(mrb, self);
+  struct mrb_io_dirent ent;
+  int r;
+
+  r = dir_next(d, &ent);
+  if (r < 0) {
+    mrb_sys_fail(mrb, "readdir");
+  }
+  if (r == 0) {
+    return mrb_nil_value();
+  }
+  return mrb_str_new_cstr(mrb, ent.name);
+}
+
+mrb_value
+mrb_dir_rewind(mrb_state *mrb, mrb_value self)
+{
+  mrb_io_sys_rewinddir(dir_get_open(mrb, self)->dir);
+  return self;
+}
+
+mrb_value
+mrb_dir_close(mrb_state *mrb, mrb_value self)
+{
+  dir_close(dir_get_open(mrb, self));
+  return mrb_nil_value();
+}
+
+mrb_value
+mrb_dir_closed_p(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_dir *d;
+
+  d = (struct mrb_dir *)mrb_get_datatype(mrb, self, &mrb_dir_type);
+  return mrb_bool_value(d == NULL || d->dir == NULL);
+}
+
+mrb_value
+mrb_dir_s_mkdir(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value path;
+  mrb_int mode = 0777;
+  const char *cpath;
+
+  mrb_get_args(mrb, "S|i", &path, &mode);
+  cpath = mrb_string_value_cstr(mrb, &path);
+  mrb_file_stat_cache_clear(mrb);
+  if (mrb_io_sys_mkdir(cpath, mode) == -1) {
+    mrb_sys_fail(mrb, cpath);
+  }
+  return mrb_fixnum_value(0);
+}
+
+mrb_value
+mrb_dir_s_rmdir(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value path;
+  const char *cpath;
+
+  mrb_get_args(mrb, "S", &path);
+  cpath = mrb_string_value_cstr(mrb, &path);
+  mrb_file_stat_cache_clear(mrb);
+  if (mrb_io_sys_rmdir(cpath) == -1) {
+    mrb_sys_fail(mrb, cpath);
+  }
+  return mrb_fixnum_value(0);
+}
+
+/*
+ * Match one path component against one pattern segment (p, plen):
+ * "*", "?", "[...]" (with "!" or "^" negation and ranges) and "\" escapes.
+ * Wildcards do not match a leading "." in name, as with File::FNM_PATHNAME.
+ */
+static int
+glob_match(const char *p, const char *pend, const char *s)
+{
+  const char *star_p = NULL, *star_s = NULL;
+  int negate, ok;
+
+  if (*s == '.' && *p != '.') {
+    return 0;
+  }
+  while (*s) {
+    if (p < pend && *p == '*') {
+      star_p = ++p;
+      star_s = s;
+      continue;
+    }
+    if (p < pend && *p == '?') {
+      p++;
+      s++;
+      continue;
+    }
+    if (p < pend && *p == '[') {
+      const char *q = p + 1;
+
+      negate = (q < pend && (*q == '!' || *q == '^'));
+      if (negate) {
+        q++;
+      }
+      ok = 0;
+      while (q < pend && (*q != ']' || q == p + 1 + negate)) {
+        if (q + 2 < pend && q[1] == '-' && q[2] != ']') {
+          if ((unsigned char)q[0] <= (unsigned char)*s && (unsigned char)*s <= (unsigned char)q[2]) {
+            ok = 1;
+          }
+          q += 3;
+        } else {
+          if (*q == *s) {
+            ok = 1;
+          }
+          q++;
+        }
+      }
+      if (q < pend && ok != negate) {
+        p = q + 1;
+        s++;
+        continue;
+      }
+    } else if (p < pend) {
+      if (*p == '\\' && p + 1 < pend) {
+        p++;
+      }
+      if (*p == *s) {
+        p++;
+        s++;
+        continue;
+      }
+    }
+    /* mismatch: let the last "*" swallow one more character */
+    if (star_p == NULL) {
+      return 0;
+    }
+    p = star_p;
+    s = ++star_s;
+  }
+  while (p < pend && *p == '*') {
+    p++;
+  }
+  return p == pend;
+}
+
+static int
+glob_has_magic(const char *p, const char *pend)
+{
+  for (; p < pend; p++) {
+    if (*p == '*' || *p == '?' || *p == '[' || *p == '\\') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* 1 for a directory, 0 for anything else, -1 if path does not exist */
+static int
+glob_stat(const char *path)
+{
+  struct mrb_io_stat st;
+
+  if (mrb_io_sys_stat(path, &st) == -1) {
+    return -1;
+  }
+  return S_ISDIR(st.mode) ? 1 : 0;
+}
+
+/* as glob_stat, but a symbolic link is not a directory */
+static int
+glob_lstat(const char *path)
+{
+  struct mrb_io_stat st;
+
+  if (mrb_io_sys_lstat(path, &st) == -1) {
+    return -1;
+  }
+  return S_ISDIR(st.mode) ? 1 : 0;
+}
+
+/* append "/" and name[0, n] to path[0, len]; returns the new length or 0 */
+static size_t
+glob_join(char *path, size_t len, const char *name, size_t n)
+{
+  if (len > 0 && path[len - 1] != '/') {
+    if (len + 1 >= DIR_PATH_MAX) {
+      return 0;
+    }
+    path[len++] = '/';
+  }
+  if (len + n >= DIR_PATH_MAX) {
+    return 0;
+  }
+  memcpy(path + len, name, n);
+  path[len + n] = '\0';
+  return len + n;
+}
+
+/*
+ * Expand the pattern segments in pat below the directory path[0, len]
+ * ("" is the current directory), appending matches to ary.  A literal
+ * segment is stepped into without listing the directory, and a wildcard
+ * segment only descends into the entries it matched, so subtrees the
+ * pattern cannot reach are never read.  A "**" segment matches zero or
+ * more directories, not counting symbolic links to them, as in Ruby.
+ */
+static void
+glob_walk(mrb_state *mrb, mrb_value ary, char *path, size_t len, const char *pat)
+{
+  struct mrb_dir d;
+  struct mrb_io_dirent ent;
+  const char *seg, *end;
+  size_t nlen;
+  int r, ai, recursive;
+
+  while (*pat == '/') {
+    pat++;
+  }
+  seg = pat;
+  end = strchr(seg, '/');
+  if (end == NULL) {
+    end = seg + strlen(seg);
+  }
+  recursive = (end - seg == 2 && seg[0] == '*' && seg[1] == '*' && *end == '/');
+
+  if (!glob_has_magic(seg, end)) {
+    nlen = glob_join(path, len, seg, end - seg);
+    if (nlen == 0) {
+      return;
+    }
+    r = glob_stat(path);
+    if (*end == '\0' ? r >= 0 : r == 1) {
+      if (*end == '\0') {
+        mrb_ary_push(mrb, ary, mrb_str_new(mrb, path, nlen));
+      } else {
+        glob_walk(mrb, ary, path, nlen, end);
+      }
+    }
+    path[len] = '\0';
+    return;
+  }
+
+  if (recursive) {
+    /* zero directories: the rest of the pattern applies right here */
+    glob_walk(mrb, ary, path, len, end);
+  }
+
+  if (dir_open(&d, len > 0 ? path : ".") == -1) {
+    return;
+  }
+  ai = mrb_gc_arena_save(mrb);
+  while (dir_next(&d, &ent) > 0) {
+    if (recursive) {
+      /* hidden directories are not entered */
+      if (ent.name[0] == '.') {
+        continue;
+      }
+    } else if (!glob_match(seg, end, ent.name)) {
+      continue;
+    }
+    nlen = glob_join(path, len, ent.name, strlen(ent.name));
+    if (nlen == 0) {
+      continue;
+    }
+    if (*end == '\0') {
+      mrb_ary_push(mrb, ary, mrb_str_new(mrb, path, nlen));
+    } else if (ent.is_dir >= 0 ? ent.is_dir : (recursive ? glob_lstat(path) : glob_stat(path)) == 1) {
+      glob_walk(mrb, ary, path, nlen, recursive ? seg : end);
+    }
+    path[len] = '\0';
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  dir_close(&d);
+}
+
+/* Dir._glob(pattern) -> Array */
+mrb_value
+mrb_dir_s_glob(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value pattern, ary;
+  const char *pat;
+  char path[DIR_PATH_MAX];
+  size_t len = 0;
+
+  mrb_get_args(mrb, "S", &pattern);
+  pat = mrb_string_value_cstr(mrb, &pattern);
+  ary = mrb_ary_new(mrb);
+  if (*pat == '\0') {
+    return ary;
+  }
+  if (*pat == '/') {
+    path[len++] = '/';
+  }
+  path[len] = '\0';
+  glob_walk(mrb, ary, path, len, pat);
+  return ary;
+}
+
+void
+mrb_init_dir(mrb_state *mrb)
+{
+  struct RClass *d;
+
+  d = mrb_define_class(mrb, "Dir", mrb->object_class);
+  MRB_SET_INSTANCE_TT(d, MRB_TT_DATA);
+
+  mrb_define_class_method(mrb, d, "mkdir",  mrb_dir_s_mkdir, MRB_ARGS_ARG(1, 1));
+  mrb_define_class_method(mrb, d, "rmdir",  mrb_dir_s_rmdir, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, d, "delete", mrb_dir_s_rmdir, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, d, "unlink", mrb_dir_s_rmdir, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, d, "_glob",  mrb_dir_s_glob,  MRB_ARGS_REQ(1));
+
+  mrb_define_method(mrb, d, "initialize", mrb_dir_init,     MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, d, "read",       mrb_dir_read,     MRB_ARGS_NONE());
+  mrb_define_method(mrb, d, "rewind",     mrb_dir_rewind,   MRB_ARGS_NONE());
+  mrb_define_method(mrb, d, "close",      mrb_dir_close,    MRB_ARGS_NONE());
+  mrb_define_method(mrb, d, "closed?",    mrb_dir_closed_p, MRB_ARGS_NONE());
+}
@@ -3,6 +3,7 @@
 */
 
 #include "mruby.h"
+#include "mruby/array.h"
 #include "mruby/class.h"
 #include "mruby/data.h"
 #include "mruby/string.h"
@@ -20,17 +21,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#define UNLINK f_unlink
-#define GETCWD f_getcwd
-#define CHMOD(a, b) 0
 #define MAXPATHLEN 1024
 #include <sys/file.h>
 #include <libgen.h>
 #include <sys/param.h>
 #include <pwd.h>
 
-#include "fatfs_dri.h"
-
 #define FILE_SEPARATOR "/"
 
 #ifndef LOCK_SH
@@ -67,7 +63,8 @@ mrb_file_s_unlink(mrb_state *mrb, mrb_value obj)
   for (i = 0; i < argc; i++) {
     pathv = mrb_convert_type(mrb, argv[i], MRB_TT_STRING, "String", "to_str");
     path = mrb_string_value_cstr(mrb, &pathv);
-    if (UNLINK(path) < 0) {
+    mrb_file_stat_cache_clear(mrb);
+    if (mrb_io_sys_unlink(path) < 0) {
       mrb_sys_fail(mrb, path);
     }
   }
@@ -82,61 +79,344 @@ mrb_file_s_rename(mrb_state *mrb, mrb_value obj)
   mrb_get_args(mrb, "SS", &from, &to);
   src = mrb_string_value_cstr(mrb, &from);
   dst = mrb_string_value_cstr(mrb, &to);
-  if (f_rename(src, dst) < 0) {
-    if (CHMOD(dst, 0666) == 0 && UNLINK(dst) == 0 && f_rename(src, dst) == 0) {
-      return mrb_fixnum_value(0);
-    }
+  mrb_file_stat_cache_clear(mrb);
+  if (mrb_io_sys_rename(src, dst) < 0) {
     mrb_sys_fail(mrb, mrb_str_to_cstr(mrb, mrb_format(mrb, "(%S, %S)", from, to)));
   }
   return mrb_fixnum_value(0);
 }
 
-static inline char *
-file_basename(char *file)
+#define isdirsep(c) ((c) == '/')
+
+/*
+ * Path helpers.  Each works on (pointer, length) pairs of the argument and
+ * writes its result into a single buffer, so no intermediate Strings are
+ * made while joining or normalising.
+ */
+
+/* the last component of path[0, len], not counting trailing separators */
+static const char *
+file_last_component(const char *path, mrb_int len, mrb_int *n)
 {
-  char *p = strrchr(file, '/');
-  if (p) {
-    return p + 1;
-  } else {
-    return file;
+  const char *beg, *end = path + len;
+
+  while (end > path && isdirsep(end[-1])) {
+    end--;
   }
+  beg = end;
+  while (beg > path && !isdirsep(beg[-1])) {
+    beg--;
+  }
+  *n = end - beg;
+  return beg;
 }
 
 static mrb_value
 mrb_file_basename(mrb_state *mrb, mrb_value klass)
 {
-  char *bname, *path;
   mrb_value s;
+  const char *bname;
+  mrb_int n;
+
   mrb_get_args(mrb, "S", &s);
-  path = mrb_str_to_cstr(mrb, s);
-  if ((bname = file_basename(path)) == NULL) {
-    mrb_sys_fail(mrb, "basename");
+  bname = file_last_component(RSTRING_PTR(s), RSTRING_LEN(s), &n);
+  if (n == 0 && RSTRING_LEN(s) > 0) {
+    /* nothing but separators */
+    return mrb_str_new_lit(mrb, FILE_SEPARATOR);
   }
-  return mrb_str_new_cstr(mrb, bname);
+  return mrb_str_new(mrb, bname, n);
 }
 
-mrb_value
-mrb_file__getwd(mrb_state *mrb, mrb_value klass)
+static mrb_value
+mrb_file_dirname(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value s;
+  const char *path, *end;
+  mrb_int n;
+
+  mrb_get_args(mrb, "S", &s);
+  path = RSTRING_PTR(s);
+  end = file_last_component(path, RSTRING_LEN(s), &n);
+  while (end > path && isdirsep(end[-1])) {
+    end--;
+  }
+  if (end == path) {
+    if (RSTRING_LEN(s) > 0 && isdirsep(path[0])) {
+      return mrb_str_new_lit(mrb, FILE_SEPARATOR);
+    }
+    return mrb_str_new_lit(mrb, ".");
+  }
+  return mrb_str_new(mrb, path, end - path);
+}
+
+static mrb_value
+mrb_file_extname(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value s;
+  const char *name, *p, *end, *dot = NULL;
+  mrb_int n;
+
+  mrb_get_args(mrb, "S", &s);
+  name = file_last_component(RSTRING_PTR(s), RSTRING_LEN(s), &n);
+  end = name + n;
+  /* leading dots name a dotfile, they do not start an extension */
+  for (p = name; p < end && *p == '.'; p++)
+    ;
+  for (; p < end; p++) {
+    if (*p == '.') {
+      dot = p;
+    }
+  }
+  if (dot == NULL || dot + 1 == end) {
+    return mrb_str_new_lit(mrb, "");
+  }
+  return mrb_str_new(mrb, dot, end - dot);
+}
+
+static mrb_int
+file_join_size(mrb_state *mrb, mrb_value *argv, mrb_int argc)
+{
+  mrb_int i, size = 0;
+
+  for (i = 0; i < argc; i++) {
+    if (mrb_string_p(argv[i])) {
+      size += RSTRING_LEN(argv[i]) + 1;
+    }
+  }
+  return size;
+}
+
+static void
+file_join_cat(mrb_state *mrb, mrb_value result, mrb_value name, int first, int depth)
+{
+  const char *p;
+  mrb_int len;
+
+  if (mrb_array_p(name)) {
+    mrb_int i;
+
+    if (depth > 64) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "recursive array");
+    }
+    for (i = 0; i < RARRAY_LEN(name); i++) {
+      file_join_cat(mrb, result, RARRAY_PTR(name)[i], first && i == 0, depth + 1);
+    }
+    return;
+  }
+  name = mrb_convert_type(mrb, name, MRB_TT_STRING, "String", "to_str");
+  if (!first) {
+    p = RSTRING_PTR(result);
+    len = RSTRING_LEN(result);
+    if (RSTRING_LEN(name) > 0 && isdirsep(RSTRING_PTR(name)[0])) {
+      /* keep exactly one separator between the two */
+      while (len > 0 && isdirsep(p[len - 1])) {
+        len--;
+      }
+      mrb_str_resize(mrb, result, len);
+    } else if (len == 0 || !isdirsep(p[len - 1])) {
+      mrb_str_cat_lit(mrb, result, FILE_SEPARATOR);
+    }
+  }
+  mrb_str_cat(mrb, result, RSTRING_PTR(name), RSTRING_LEN(name));
+}
+
+/*
+ * call-seq:
+ *   File.join(string, ...)  -> String
+ */
+static mrb_value
+mrb_file_s_join(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value *argv, result;
+  mrb_int argc, i;
+
+  mrb_get_args(mrb, "*", &argv, &argc);
+  result = mrb_str_buf_new(mrb, file_join_size(mrb, argv, argc));
+  for (i = 0; i < argc; i++) {
+    file_join_cat(mrb, result, argv[i], i == 0, 0);
+  }
+  return result;
+}
+
+/* an absolute path being built; ".." never removes the root prefix */
+struct file_path {
+  char ptr[MAXPATHLEN];
+  size_t len;
+  size_t root;
+};
+
+static int
+file_path_absolute_p(const char *s, const char *end)
+{
+  return (s < end && isdirsep(*s)) || (end - s >= 2 && s[1] == ':');
+}
+
+/* reset fp to the root of the absolute path s, and skip the root in s */
+static const char *
+file_path_root(struct file_path *fp, const char *s, const char *end)
 {
-  /* XXX f_getwd() is not supported on EV3RT */
-  return mrb_nil_value();
+  fp->len = 0;
+  if (end - s >= 2 && s[1] == ':') {
+    /* FatFS drive number, or a drive letter */
+    fp->ptr[fp->len++] = *s++;
+    fp->ptr[fp->len++] = *s++;
+  }
+  fp->ptr[fp->len++] = '/';
+  fp->root = fp->len;
+  return s;
+}
 
-  /*
-  mrb_value path;
+/* append the components of s to fp, dropping "." and resolving ".." */
+static void
+file_path_append(mrb_state *mrb, struct file_path *fp, const char *s, const char *end)
+{
+  const char *seg;
+  size_t n;
 
-  path = mrb_str_buf_new(mrb, MAXPATHLEN);
-  if (GETCWD(RSTRING_PTR(path), MAXPATHLEN) != FR_OK) {
-    mrb_sys_fail(mrb, "getcwd(2)");
+  while (s < end) {
+    while (s < end && isdirsep(*s)) {
+      s++;
+    }
+    seg = s;
+    while (s < end && !isdirsep(*s)) {
+      s++;
+    }
+    n = s - seg;
+    if (n == 0 || (n == 1 && seg[0] == '.')) {
+      continue;
+    }
+    if (n == 2 && seg[0] == '.' && seg[1] == '.') {
+      while (fp->len > fp->root && fp->ptr[fp->len - 1] != '/') {
+        fp->len--;
+      }
+      if (fp->len > fp->root) {
+        fp->len--;
+      }
+      continue;
+    }
+    if (fp->len + 1 + n >= sizeof(fp->ptr)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "path too long");
+    }
+    if (fp->ptr[fp->len - 1] != '/') {
+      fp->ptr[fp->len++] = '/';
+    }
+    memcpy(fp->ptr + fp->len, seg, n);
+    fp->len += n;
   }
-  mrb_str_resize(mrb, path, strlen(RSTRING_PTR(path)));
-  return path;
-  */
 }
 
+static void
+file_path_getwd(mrb_state *mrb, struct file_path *fp)
+{
+#ifdef MRB_IO_POSIX
+  if (getcwd(fp->ptr, sizeof(fp->ptr)) == NULL) {
+    mrb_sys_fail(mrb, "getcwd");
+  }
+  fp->len = strlen(fp->ptr);
+  fp->root = 1;
+#else
+  /* FatFS on EV3RT has no current directory: relative paths start at the root */
+  file_path_root(fp, "/", "/" + 1);
+#endif
+}
+
+static const char *
+file_gethome(mrb_state *mrb, const char *user, size_t len)
+{
+#ifdef MRB_IO_POSIX
+  struct passwd *pw;
+  char name[64];
+
+  if (len == 0) {
+    return getenv("HOME");
+  }
+  if (len >= sizeof(name)) {
+    return NULL;
+  }
+  memcpy(name, user, len);
+  name[len] = '\0';
+  pw = getpwnam(name);
+  return pw ? pw->pw_dir : NULL;
+#else
+  return NULL;
+#endif
+}
+
+/*
+ * Resolve path against dir (the current directory when dir is NULL) into
+ * fp.  With expand_home, a leading "~" or "~user" is replaced by the home
+ * directory.
+ */
+static void
+file_expand(mrb_state *mrb, struct file_path *fp, const char *path, mrb_int len,
+            const char *dir, mrb_int dlen, int expand_home)
+{
+  const char *s = path, *end = path + len;
+
+  if (file_path_absolute_p(s, end)) {
+    s = file_path_root(fp, s, end);
+  } else if (expand_home && s < end && *s == '~') {
+    const char *user = ++s, *home;
+
+    while (s < end && !isdirsep(*s)) {
+      s++;
+    }
+    home = file_gethome(mrb, user, s - user);
+    if (home == NULL) {
+      if (s == user) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "couldn't find HOME environment -- expanding '~'");
+      }
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "user %S doesn't exist", mrb_str_new(mrb, user, s - user));
+    }
+    if (!file_path_absolute_p(home, home + strlen(home))) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "non-absolute home");
+    }
+    file_path_append(mrb, fp, file_path_root(fp, home, home + strlen(home)), home + strlen(home));
+  } else if (dir != NULL) {
+    file_expand(mrb, fp, dir, dlen, NULL, 0, expand_home);
+  } else {
+    file_path_getwd(mrb, fp);
+  }
+  file_path_append(mrb, fp, s, end);
+}
+
+static mrb_value
+file_expand_path(mrb_state *mrb, int expand_home)
+{
+  struct file_path fp;
+  mrb_value path, dir = mrb_nil_value();
+
+  mrb_get_args(mrb, "S|o", &path, &dir);
+  if (mrb_nil_p(dir)) {
+    file_expand(mrb, &fp, RSTRING_PTR(path), RSTRING_LEN(path), NULL, 0, expand_home);
+  } else {
+    dir = mrb_convert_type(mrb, dir, MRB_TT_STRING, "String", "to_str");
+    file_expand(mrb, &fp, RSTRING_PTR(path), RSTRING_LEN(path),
+                RSTRING_PTR(dir), RSTRING_LEN(dir), expand_home);
+  }
+  return mrb_str_new(mrb, fp.ptr, fp.len);
+}
+
+/*
+ * call-seq:
+ *   File.expand_path(path, dir = nil)  -> String
+ */
+static mrb_value
+mrb_file_s_expand_path(mrb_state *mrb, mrb_value klass)
+{
+  return file_expand_path(mrb, 1);
+}
+
+/*
+ * call-seq:
+ *   File.absolute_path(path, dir = nil)  -> String
+ *
+ * Like File.expand_path, but "~" is an ordinary file name.
+ */
 static mrb_value
-mrb_file__gethome(mrb_state *mrb, mrb_value klass)
+mrb_file_s_absolute_path(mrb_state *mrb, mrb_value klass)
 {
-  return mrb_nil_value();
+  return file_expand_path(mrb, 0);
 }
 
 void
@@ -151,9 +431,12 @@ mrb_init_file(mrb_state *mrb)
   mrb_define_class_method(mrb, file, "unlink", mrb_file_s_unlink, MRB_ARGS_ANY());
   mrb_define_class_method(mrb, file, "rename", mrb_file_s_rename, MRB_ARGS_REQ(2));
 
-  mrb_define_class_method(mrb, file, "basename",  mrb_file_basename,   MRB_ARGS_REQ(1));
-  mrb_define_class_method(mrb, file, "_getwd",    mrb_file__getwd,     MRB_ARGS_NONE());
-  mrb_define_class_method(mrb, file, "_gethome",  mrb_file__gethome,   MRB_ARGS_OPT(1));
+  mrb_define_class_method(mrb, file, "basename",      mrb_file_basename,        MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, file, "dirname",       mrb_file_dirname,         MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, file, "extname",       mrb_file_extname,         MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, file, "join",          mrb_file_s_join,          MRB_ARGS_ANY());
+  mrb_define_class_method(mrb, file, "expand_path",   mrb_file_s_expand_path,   MRB_ARGS_ARG(1, 1));
+  mrb_define_class_method(mrb, file, "absolute_path", mrb_file_s_absolute_path, MRB_ARGS_ARG(1, 1));
 
   cnst = mrb_define_module_under(mrb, file, "Constants");
   mrb_define_const(mrb, cnst, "LOCK_SH", mrb_fixnum_value(LOCK_SH));
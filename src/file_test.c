@@ -27,30 +27,12 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "fatfs_dri.h"
-
 extern struct mrb_data_type mrb_io_type;
 
 static int
-mrb_stat(mrb_state *mrb, mrb_value obj, FILINFO *fno)
+mrb_stat(mrb_state *mrb, mrb_value obj, struct mrb_io_stat *st)
 {
-  FRESULT result;
-  mrb_value tmp;
-  mrb_value str_klass;
-
-  str_klass = mrb_obj_value(mrb_class_get(mrb, "String"));
-  tmp = mrb_funcall(mrb, obj, "is_a?", 1, str_klass);
-  if (!mrb_test(tmp)) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "only supported String");
-  }
-  const char *path = mrb_str_to_cstr(mrb, obj);
-  //result = f_stat(path, fno);
-  result = FR_INT_ERR;
-  if (result == FR_OK) {
-    return 0;
-  } else {
-    return -1;
-  }
+  return mrb_file_stat(mrb, obj, st);
 }
 
 /*
@@ -69,14 +51,14 @@ mrb_stat(mrb_state *mrb, mrb_value obj, FILINFO *fno)
 mrb_value
 mrb_filetest_s_directory_p(mrb_state *mrb, mrb_value klass)
 {
-  FILINFO fno;
+  struct mrb_io_stat st;
   mrb_value obj;
 
   mrb_get_args(mrb, "o", &obj);
 
-  if (mrb_stat(mrb, obj, &fno) < 0)
+  if (mrb_stat(mrb, obj, &st) < 0)
     return mrb_false_value();
-  if (fno.fattrib & AM_DIR)
+  if (S_ISDIR(st.mode))
     return mrb_true_value();
 
   return mrb_false_value();
@@ -94,11 +76,11 @@ mrb_filetest_s_directory_p(mrb_state *mrb, mrb_value klass)
 mrb_value
 mrb_filetest_s_exist_p(mrb_state *mrb, mrb_value klass)
 {
-  FILINFO fno;
+  struct mrb_io_stat st;
   mrb_value obj;
 
   mrb_get_args(mrb, "o", &obj);
-  if (mrb_stat(mrb, obj, &fno) < 0)
+  if (mrb_stat(mrb, obj, &st) < 0)
     return mrb_false_value();
 
   return mrb_true_value();
@@ -115,14 +97,14 @@ mrb_filetest_s_exist_p(mrb_state *mrb, mrb_value klass)
 mrb_value
 mrb_filetest_s_file_p(mrb_state *mrb, mrb_value klass)
 {
-  FILINFO fno;
+  struct mrb_io_stat st;
   mrb_value obj;
 
   mrb_get_args(mrb, "o", &obj);
 
-  if (mrb_stat(mrb, obj, &fno) < 0)
+  if (mrb_stat(mrb, obj, &st) < 0)
     return mrb_false_value();
-  if (!(fno.fattrib & AM_DIR))
+  if (S_ISREG(st.mode))
     return mrb_true_value();
 
   return mrb_false_value();
@@ -139,14 +121,14 @@ mrb_filetest_s_file_p(mrb_state *mrb, mrb_value klass)
 mrb_value
 mrb_filetest_s_zero_p(mrb_state *mrb, mrb_value klass)
 {
-  FILINFO fno;
+  struct mrb_io_stat st;
   mrb_value obj;
 
   mrb_get_args(mrb, "o", &obj);
 
-  if (mrb_stat(mrb, obj, &fno) < 0)
+  if (mrb_stat(mrb, obj, &st) < 0)
     return mrb_false_value();
-  if (fno.fsize == 0)
+  if (st.size == 0)
     return mrb_true_value();
 
   return mrb_false_value();
@@ -164,15 +146,15 @@ mrb_filetest_s_zero_p(mrb_state *mrb, mrb_value klass)
 mrb_value
 mrb_filetest_s_size(mrb_state *mrb, mrb_value klass)
 {
-  FILINFO fno;
+  struct mrb_io_stat st;
   mrb_value obj;
 
   mrb_get_args(mrb, "o", &obj);
 
-  if (mrb_stat(mrb, obj, &fno) < 0)
+  if (mrb_stat(mrb, obj, &st) < 0)
     mrb_sys_fail(mrb, "mrb_stat");
 
-  return mrb_fixnum_value(fno.fsize);
+  return mrb_fixnum_value(st.size);
 }
 
 /*
@@ -186,17 +168,65 @@ mrb_filetest_s_size(mrb_state *mrb, mrb_value klass)
 mrb_value
 mrb_filetest_s_size_p(mrb_state *mrb, mrb_value klass)
 {
-  FILINFO fno;
+  struct mrb_io_stat st;
   mrb_value obj;
 
   mrb_get_args(mrb, "o", &obj);
 
-  if (mrb_stat(mrb, obj, &fno) < 0)
+  if (mrb_stat(mrb, obj, &st) < 0)
     return mrb_nil_value();
-  if (fno.fsize == 0)
+  if (st.size == 0)
     return mrb_nil_value();
 
-  return mrb_fixnum_value(fno.fsize);
+  return mrb_fixnum_value(st.size);
+}
+
+/*
+ * call-seq:
+ *    File.pipe?(file_name)   -> true or false
+ *
+ * Returns <code>true</code> if the named file is a pipe.
+ */
+
+mrb_value
+mrb_filetest_s_pipe_p(mrb_state *mrb, mrb_value klass)
+{
+  struct mrb_io_stat st;
+  mrb_value obj;
+
+  mrb_get_args(mrb, "o", &obj);
+
+  if (mrb_stat(mrb, obj, &st) < 0)
+    return mrb_false_value();
+  if (S_ISFIFO(st.mode))
+    return mrb_true_value();
+
+  return mrb_false_value();
+}
+
+/*
+ * call-seq:
+ *    File.socket?(file_name)   -> true or false
+ *
+ * Returns <code>true</code> if the named file is a socket.
+ */
+
+mrb_value
+mrb_filetest_s_socket_p(mrb_state *mrb, mrb_value klass)
+{
+#ifdef S_ISSOCK
+  struct mrb_io_stat st;
+  mrb_value obj;
+
+  mrb_get_args(mrb, "o", &obj);
+
+  if (mrb_stat(mrb, obj, &st) < 0)
+    return mrb_false_value();
+  if (S_ISSOCK(st.mode))
+    return mrb_true_value();
+#endif
+
+  return mrb_false_value();
 }
 
 void
@@ -210,7 +240,9 @@ mrb_init_file_test(mrb_state *mrb)
   mrb_define_class_method(mrb, f, "exist?",     mrb_filetest_s_exist_p,     MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, f, "exists?",    mrb_filetest_s_exist_p,     MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, f, "file?",      mrb_filetest_s_file_p,      MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, f, "pipe?",      mrb_filetest_s_pipe_p,      MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, f, "size",       mrb_filetest_s_size,        MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, f, "size?",      mrb_filetest_s_size_p,      MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, f, "socket?",    mrb_filetest_s_socket_p,    MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, f, "zero?",      mrb_filetest_s_zero_p,      MRB_ARGS_REQ(1));
 }
@@ -23,12 +23,150 @@
 #include <fcntl.h>
 
 #include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef MRB_IO_POSIX
+#include <sys/uio.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#else
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
 
 static int mrb_io_modestr_to_flags(mrb_state *mrb, const char *modestr);
 static int mrb_io_flags_to_modenum(mrb_state *mrb, int flags);
 static void fptr_finalize(mrb_state *mrb, struct mrb_io *fptr, int noraise);
+static void io_buf_release(mrb_state *mrb, struct mrb_io_buf *buf);
+static int io_flush_wbuf(mrb_state *mrb, struct mrb_io *fptr, int noraise);
+static struct mrb_io *io_get_write_fptr(mrb_state *mrb, mrb_value io);
+static void io_rbuf_consume(struct mrb_io *fptr, int len);
+
+#define IO_RBUF_PTR(fptr) ((fptr)->rbuf.ptr + (fptr)->rbuf.start)
+#define IO_RBUF_LEN(fptr) ((fptr)->rbuf.end - (fptr)->rbuf.start)
+
+/*
+ * Make room for capa bytes in str, keeping its contents.  Capacity the
+ * String already has is reused, so a recycled outbuf is never reallocated.
+ */
+static char *
+io_str_reserve(mrb_state *mrb, mrb_value str, mrb_int capa)
+{
+  struct RString *s = RSTRING(str);
+  mrb_int len;
+
+  mrb_str_modify(mrb, s);
+  if (RSTRING_CAPA(str) < capa) {
+    len = RSTRING_LEN(str);
+    if (capa < RSTRING_CAPA(str) * 2) {
+      capa = RSTRING_CAPA(str) * 2;
+    }
+    mrb_str_resize(mrb, str, capa);
+    RSTR_SET_LEN(s, len);
+  }
+  return RSTRING_PTR(str);
+}
+
+/* set the length of a String whose capacity was reserved beforehand */
+static void
+io_str_set_len(mrb_value str, mrb_int len)
+{
+  RSTR_SET_LEN(RSTRING(str), len);
+  RSTRING_PTR(str)[len] = '\0';
+}
+
+/* fetch an option from a trailing keyword Hash; nil if it is not given */
+static mrb_value
+io_opt_get(mrb_state *mrb, mrb_value opt, const char *name)
+{
+  if (!mrb_hash_p(opt)) {
+    return mrb_nil_value();
+  }
+  return mrb_hash_get(mrb, opt, mrb_symbol_value(mrb_intern_cstr(mrb, name)));
+}
+
+/* false only if the trailing option Hash says exception: false */
+static mrb_bool
+io_opt_exception(mrb_state *mrb, mrb_value opt)
+{
+  mrb_value v = io_opt_get(mrb, opt, "exception");
+
+  return !(mrb_type(v) == MRB_TT_FALSE && !mrb_nil_p(v));
+}
+
+/* FMODE_* bits requested through open options (nonblock: true) */
+static int
+io_opt_flags(mrb_state *mrb, mrb_value opt)
+{
+  int flags = 0;
+
+  if (mrb_test(io_opt_get(mrb, opt, "nonblock"))) {
+    flags |= FMODE_NONBLOCK;
+  }
+  return flags;
+}
+
+#ifdef MRB_IO_POSIX
+/*
+ * set or clear O_NONBLOCK; returns the previous file status flags or -1.
+ * Descriptors of a non-native backend never block and are left alone.
+ */
+static int
+io_fcntl_nonblock(int fd, mrb_bool on)
+{
+  int flags, nflags;
+
+  if (!mrb_io_sys_native(fd)) {
+    return 0;
+  }
+  flags = fcntl(fd, F_GETFL);
+  if (flags < 0) {
+    return -1;
+  }
+  nflags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  if (nflags != flags && fcntl(fd, F_SETFL, nflags) < 0) {
+    return -1;
+  }
+  return flags;
+}
+#endif
+
+/*
+ * Sort out (len, outbuf = nil, **opt) for the sysread family.  Returns
+ * the option Hash (or nil) and leaves a usable String in *buf.
+ */
+static mrb_value
+io_get_read_args(mrb_state *mrb, mrb_int *maxlen, mrb_value *buf)
+{
+  mrb_value opt = mrb_nil_value();
+
+  *buf = mrb_nil_value();
+  mrb_get_args(mrb, "i|oo", maxlen, buf, &opt);
+  if (mrb_hash_p(*buf)) {
+    opt = *buf;
+    *buf = mrb_nil_value();
+  }
+  if (mrb_nil_p(*buf)) {
+    *buf = mrb_str_buf_new(mrb, *maxlen > 0 ? *maxlen : 0);
+  } else if (!mrb_string_p(*buf)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "outbuf must be a String");
+  }
+  return opt;
+}
 
 static int
 mrb_io_modestr_to_flags(mrb_state *mrb, const char *mode)
@@ -94,6 +232,11 @@ mrb_io_flags_to_modenum(mrb_state *mrb, int flags)
   if (flags & FMODE_CREATE) {
     modenum |= O_CREAT;
   }
+#ifdef O_NONBLOCK
+  if (flags & FMODE_NONBLOCK) {
+    modenum |= O_NONBLOCK;
+  }
+#endif
   /* ignore O_BINARY */
   return modenum;
 }
@@ -119,11 +262,304 @@ mrb_io_alloc(mrb_state *mrb)
   fptr->fd = -1;
   fptr->fd2 = -1;
   fptr->pid = 0;
+  fptr->pos = 0;
+  fptr->rbuf.ptr = NULL;
+  fptr->rbuf.capa = 0;
+  fptr->rbuf.start = 0;
+  fptr->rbuf.end = 0;
+  fptr->wbuf.ptr = NULL;
+  fptr->wbuf.capa = 0;
+  fptr->wbuf.start = 0;
+  fptr->wbuf.end = 0;
   fptr->writable = 0;
   fptr->sync = 0;
+  fptr->reg = NULL;
+  fptr->reg_prev = fptr->reg_next = NULL;
+  memset(&fptr->stats, 0, sizeof(fptr->stats));
   return fptr;
 }
 
+/*
+ * Registry of the IOs of an mrb_state that hold open descriptors, newest
+ * first.  It gives IO.open_count without walking the heap, enforces the
+ * optional IO.max_open cap, and lets gem finalization flush every IO
+ * before the heap is torn down.
+ */
+struct mrb_io_registry {
+  struct mrb_io *head;
+  mrb_int count;   /* number of registered IOs */
+  mrb_int max;     /* cap on count, 0 for none */
+  mrb_int writes;  /* bumped whenever data reaches a file; see File::Stat */
+  struct mrb_io_stats stats;  /* IO.stats */
+  mrb_bool timing; /* IO.stats_timing: clock the syscalls for :sys_time */
+  mrb_io_trace_func trace;
+  void *trace_ud;
+};
+
+#define IO_WROTE(fptr) do { if ((fptr)->reg) (fptr)->reg->writes++; } while (0)
+
+/* count an event that is not a syscall against fptr and the registry */
+#define IO_STAT_INC(fptr, field) do {                   \
+  (fptr)->stats.field++;                                \
+  if ((fptr)->reg) (fptr)->reg->stats.field++;          \
+} while (0)
+
+static struct mrb_io_registry *
+io_registry(mrb_state *mrb)
+{
+  mrb_value v;
+
+  v = mrb_obj_iv_get(mrb, (struct RObject *)mrb_class_get(mrb, "IO"), mrb_intern_lit(mrb, "__registry__"));
+  return mrb_cptr_p(v) ? (struct mrb_io_registry *)mrb_cptr(v) : NULL;
+}
+
+static void
+io_register(mrb_state *mrb, struct mrb_io *fptr)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+
+  if (reg == NULL || fptr->reg != NULL) {
+    return;
+  }
+  fptr->reg = reg;
+  fptr->reg_prev = NULL;
+  fptr->reg_next = reg->head;
+  if (reg->head != NULL) {
+    reg->head->reg_prev = fptr;
+  }
+  reg->head = fptr;
+  reg->count++;
+}
+
+mrb_int
+mrb_io_write_count(mrb_state *mrb)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+
+  return reg ? reg->writes : 0;
+}
+
+static void
+io_unregister(struct mrb_io *fptr)
+{
+  struct mrb_io_registry *reg = fptr->reg;
+
+  if (reg == NULL) {
+    return;
+  }
+  if (fptr->reg_prev != NULL) {
+    fptr->reg_prev->reg_next = fptr->reg_next;
+  } else {
+    reg->head = fptr->reg_next;
+  }
+  if (fptr->reg_next != NULL) {
+    fptr->reg_next->reg_prev = fptr->reg_prev;
+  }
+  fptr->reg = NULL;
+  fptr->reg_prev = fptr->reg_next = NULL;
+  reg->count--;
+}
+
+/*
+ * Make room for more descriptors by finalizing IOs nobody references any
+ * more.  Only the GC can tell which those are, but an IO dropped since the
+ * last collection is still in the young generation, so a minor collection
+ * normally finds it.  The full collection is the fallback when that did
+ * not release anything.
+ */
+static void
+io_reclaim(mrb_state *mrb)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+  mrb_int before;
+
+  if (reg == NULL) {
+    mrb_full_gc(mrb);
+    return;
+  }
+  before = reg->count;
+  mrb_incremental_gc(mrb);
+  if (reg->count >= before) {
+    mrb_full_gc(mrb);
+  }
+}
+
+/* true if opening n more IOs stays within IO.max_open */
+static mrb_bool
+io_registry_room(mrb_state *mrb, mrb_int n)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+
+  if (reg == NULL || reg->max == 0 || reg->count + n <= reg->max) {
+    return TRUE;
+  }
+  io_reclaim(mrb);
+  return reg->count + n <= reg->max;
+}
+
+#ifndef MRB_IO_STATS_CLOCK
+#ifdef MRB_IO_POSIX
+static uint64_t
+io_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#define MRB_IO_STATS_CLOCK() io_clock()
+#else
+#define MRB_IO_STATS_CLOCK() 0
+#endif
+#endif
+
+/*
+ * The clock before a syscall made for fptr, or 0 when no one wants the
+ * time: reading it costs a syscall of its own on some systems, so it is
+ * only read with IO.stats_timing on or a trace hook installed.
+ */
+static uint64_t
+io_stats_clock(mrb_state *mrb, struct mrb_io *fptr)
+{
+  struct mrb_io_registry *reg = fptr ? fptr->reg : io_registry(mrb);
+
+  if (reg == NULL || (!reg->timing && reg->trace == NULL)) {
+    return 0;
+  }
+  return MRB_IO_STATS_CLOCK();
+}
+
+/*
+ * Account for one syscall made for fptr (NULL if it belongs to no IO yet):
+ * it is counted there and in the registry, and reported to the trace hook.
+ * t0 is io_stats_clock() before the call.  errno is preserved.
+ */
+static void
+io_stats_add(mrb_state *mrb, struct mrb_io *fptr, enum mrb_io_trace_op op, int fd,
+             const char *path, mrb_int len, mrb_int ret, uint64_t t0)
+{
+  struct mrb_io_registry *reg = fptr ? fptr->reg : io_registry(mrb);
+  struct mrb_io_stats *st[2];
+  struct mrb_io_trace ev;
+  uint64_t nsec = (t0 != 0) ? MRB_IO_STATS_CLOCK() - t0 : 0;
+  int i, n = 0, err = errno;
+
+  if (fptr != NULL) {
+    st[n++] = &fptr->stats;
+  }
+  if (reg != NULL) {
+    st[n++] = &reg->stats;
+  }
+  for (i = 0; i < n; i++) {
+    switch (op) {
+    case MRB_IO_TRACE_OPEN:
+      st[i]->opens++;
+      break;
+    case MRB_IO_TRACE_CLOSE:
+      st[i]->closes++;
+      break;
+    case MRB_IO_TRACE_READ:
+      st[i]->reads++;
+      if (ret > 0) {
+        st[i]->read_bytes += ret;
+        if (ret < len) {
+          st[i]->short_reads++;
+        }
+      }
+      break;
+    case MRB_IO_TRACE_WRITE:
+      st[i]->writes++;
+      if (ret > 0) {
+        st[i]->write_bytes += ret;
+      }
+      break;
+    case MRB_IO_TRACE_SEEK:
+      st[i]->seeks++;
+      break;
+    }
+    st[i]->sys_nsec += nsec;
+  }
+  if (reg != NULL && reg->trace != NULL) {
+    ev.op = op;
+    ev.fd = fd;
+    ev.path = path;
+    ev.len = len;
+    ev.ret = ret;
+    ev.err = (ret < 0) ? err : 0;
+    ev.nsec = nsec;
+    reg->trace(mrb, &ev, reg->trace_ud);
+  }
+  errno = err;
+}
+
+/* the storage backend calls of the IO class, accounted for */
+
+static int
+io_sys_open(mrb_state *mrb, const char *path, int flags, int perm)
+{
+  uint64_t t0 = io_stats_clock(mrb, NULL);
+  int fd;
+
+  fd = mrb_io_sys_open(path, flags, perm);
+  io_stats_add(mrb, NULL, MRB_IO_TRACE_OPEN, fd, path, 0, fd, t0);
+  return fd;
+}
+
+static int
+io_sys_close(mrb_state *mrb, struct mrb_io *fptr, int fd)
+{
+  uint64_t t0 = io_stats_clock(mrb, fptr);
+  int n;
+
+  n = mrb_io_sys_close(fd);
+  io_stats_add(mrb, fptr, MRB_IO_TRACE_CLOSE, fd, NULL, 0, n, t0);
+  return n;
+}
+
+static ssize_t
+io_sys_read(mrb_state *mrb, struct mrb_io *fptr, int fd, void *buf, size_t len)
+{
+  uint64_t t0 = io_stats_clock(mrb, fptr);
+  ssize_t n;
+
+  n = mrb_io_sys_read(fd, buf, len);
+  io_stats_add(mrb, fptr, MRB_IO_TRACE_READ, fd, NULL, len, n, t0);
+  return n;
+}
+
+static ssize_t
+io_sys_write(mrb_state *mrb, struct mrb_io *fptr, int fd, const void *buf, size_t len)
+{
+  uint64_t t0 = io_stats_clock(mrb, fptr);
+  ssize_t n;
+
+  n = mrb_io_sys_write(fd, buf, len);
+  io_stats_add(mrb, fptr, MRB_IO_TRACE_WRITE, fd, NULL, len, n, t0);
+  return n;
+}
+
+static off_t
+io_sys_seek(mrb_state *mrb, struct mrb_io *fptr, int fd, off_t offset, int whence)
+{
+  uint64_t t0 = io_stats_clock(mrb, fptr);
+  off_t pos;
+
+  pos = mrb_io_sys_seek(fd, offset, whence);
+  io_stats_add(mrb, fptr, MRB_IO_TRACE_SEEK, fd, NULL, offset, pos, t0);
+  return pos;
+}
+
+void
+mrb_io_set_trace(mrb_state *mrb, mrb_io_trace_func func, void *ud)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+
+  if (reg != NULL) {
+    reg->trace = func;
+    reg->trace_ud = ud;
+  }
+}
+
 #ifndef NOFILE
 #define NOFILE 64
 #endif
@@ -138,18 +574,17 @@ mrb_io_initialize(mrb_state *mrb, mrb_value io)
 
   mode = opt = mrb_nil_value();
 
-  mrb_get_args(mrb, "i|So", &fd, &mode, &opt);
+  mrb_get_args(mrb, "i|oo", &fd, &mode, &opt);
+  if (mrb_hash_p(mode)) {
+    opt = mode;
+    mode = mrb_nil_value();
+  }
   if (mrb_nil_p(mode)) {
     mode = mrb_str_new_cstr(mrb, "r");
   }
-  if (mrb_nil_p(opt)) {
-    opt = mrb_hash_new(mrb);
-  }
 
   flags = mrb_io_modestr_to_flags(mrb, mrb_string_value_cstr(mrb, &mode));
-
-  mrb_iv_set(mrb, io, mrb_intern_cstr(mrb, "@buf"), mrb_str_new_cstr(mrb, ""));
-  mrb_iv_set(mrb, io, mrb_intern_cstr(mrb, "@pos"), mrb_fixnum_value(0));
+  flags |= io_opt_flags(mrb, opt);
 
   fptr = DATA_PTR(io);
   if (fptr != NULL) {
@@ -164,32 +599,54 @@ mrb_io_initialize(mrb_state *mrb, mrb_value io)
   fptr->fd = fd;
   fptr->writable = ((flags & FMODE_WRITABLE) != 0);
   fptr->sync = 0;
+  io_register(mrb, fptr);
+
+  if (flags & FMODE_NONBLOCK) {
+#ifdef MRB_IO_POSIX
+    if (io_fcntl_nonblock(fd, TRUE) < 0) {
+      mrb_sys_fail(mrb, "fcntl");
+    }
+#endif
+  }
   return io;
 }
 
 static void
 fptr_finalize(mrb_state *mrb, struct mrb_io *fptr, int noraise)
 {
-  int n = 0;
+  int n = 0, saved_errno = 0;
 
   if (fptr == NULL) {
     return;
   }
 
+  /* drain pending output before the descriptor goes away */
+  if (fptr->fd >= 0 && io_flush_wbuf(mrb, fptr, TRUE) != 0) {
+    n = -1;
+    saved_errno = errno;
+  }
+
   if (fptr->fd > 2) {
-    n = close(fptr->fd);
+    n = io_sys_close(mrb, fptr, fptr->fd);
     if (n == 0) {
       fptr->fd = -1;
     }
   }
   if (fptr->fd2 > 2) {
-    n = close(fptr->fd2);
+    n = io_sys_close(mrb, fptr, fptr->fd2);
     if (n == 0) {
       fptr->fd2 = -1;
     }
   }
 
+  io_buf_release(mrb, &fptr->rbuf);
+  io_buf_release(mrb, &fptr->wbuf);
+  io_unregister(fptr);
+
   if (!noraise && n != 0) {
+    if (saved_errno != 0) {
+      errno = saved_errno;
+    }
     mrb_sys_fail(mrb, "fptr_finalize failed.");
   }
 }
@@ -212,78 +669,277 @@ mrb_io_s_sysclose(mrb_state *mrb, mrb_value klass)
 {
   mrb_int fd;
   mrb_get_args(mrb, "i", &fd);
-  if (close(fd) == -1) {
+  if (io_sys_close(mrb, NULL, fd) == -1) {
     mrb_sys_fail(mrb, "close");
   }
   return mrb_fixnum_value(0);
 }
 
+/*
+ * Open through the storage backend within the IO.max_open cap.  When the process runs out of
+ * descriptors, unreferenced IOs are reclaimed and the open retried once.
+ */
+static int
+io_open(mrb_state *mrb, const char *path, int modenum, int perm)
+{
+  struct mrb_io_registry *reg;
+  int fd, retry = FALSE;
+
+  if (!io_registry_room(mrb, 1)) {
+    errno = EMFILE;
+    return -1;
+  }
+
+ reopen:
+  fd = io_sys_open(mrb, path, modenum, perm);
+  if (fd == -1) {
+    if (!retry) {
+      switch (errno) {
+      case ENFILE:
+      case EMFILE:
+        io_reclaim(mrb);
+        reg = io_registry(mrb);
+        if (reg != NULL) {
+          reg->stats.emfile_retries++;
+        }
+        retry = TRUE;
+        goto reopen;
+      }
+    }
+  }
+  return fd;
+}
+
 mrb_value
 mrb_io_s_sysopen(mrb_state *mrb, mrb_value klass)
 {
   mrb_value path = mrb_nil_value();
   mrb_value mode = mrb_nil_value();
-  mrb_int fd, flags, perm = -1;
+  mrb_value perm = mrb_nil_value();
+  mrb_value opt = mrb_nil_value();
+  mrb_int fd, flags;
   const char *pat;
-  int modenum, retry = FALSE;
+  int modenum;
 
-  mrb_get_args(mrb, "S|Si", &path, &mode, &perm);
+  mrb_get_args(mrb, "S|Soo", &path, &mode, &perm, &opt);
+  if (mrb_hash_p(perm)) {
+    opt = perm;
+    perm = mrb_nil_value();
+  }
   if (mrb_nil_p(mode)) {
     mode = mrb_str_new_cstr(mrb, "r");
   }
-  if (perm < 0) {
-    perm = 0666;
+  if (!mrb_nil_p(perm)) {
+    perm = mrb_to_int(mrb, perm);
+  }
+  if (mrb_nil_p(perm) || mrb_fixnum(perm) < 0) {
+    perm = mrb_fixnum_value(0666);
   }
 
   pat = mrb_string_value_cstr(mrb, &path);
   flags = mrb_io_modestr_to_flags(mrb, mrb_string_value_cstr(mrb, &mode));
+  flags |= io_opt_flags(mrb, opt);
   modenum = mrb_io_flags_to_modenum(mrb, flags);
 
- reopen:
-  fd = open(pat, modenum, perm);
+  fd = io_open(mrb, pat, modenum, mrb_fixnum(perm));
   if (fd == -1) {
-    if (!retry) {
-      switch (errno) {
-      case ENFILE:
-      case EMFILE:
-        mrb_garbage_collect(mrb);
-        retry = TRUE;
-        goto reopen;
-      }
-    }
     mrb_sys_fail(mrb, pat);
   }
+  if (flags & (FMODE_CREATE | FMODE_TRUNC)) {
+    mrb_file_stat_cache_clear(mrb);
+  }
 
   return mrb_fixnum_value(fd);
 }
 
+/*
+ * read(2) at offset.  Without pread(2) the backend seeks there and back,
+ * so the fd position is the same afterwards either way.
+ */
+static int
+io_pread(mrb_state *mrb, struct mrb_io *fptr, int fd, char *ptr, mrb_int len, off_t offset)
+{
+  off_t saved;
+  int n, saved_errno;
+#ifdef MRB_IO_POSIX
+  uint64_t t0;
+
+  if (mrb_io_sys_native(fd)) {
+    t0 = io_stats_clock(mrb, fptr);
+    n = pread(fd, ptr, len, offset);
+    io_stats_add(mrb, fptr, MRB_IO_TRACE_READ, fd, NULL, len, n, t0);
+    return n;
+  }
+#endif
+  saved = io_sys_seek(mrb, fptr, fd, 0, SEEK_CUR);
+  if (saved < 0 || io_sys_seek(mrb, fptr, fd, offset, SEEK_SET) < 0) {
+    return -1;
+  }
+  n = io_sys_read(mrb, fptr, fd, ptr, len);
+  saved_errno = errno;
+  io_sys_seek(mrb, fptr, fd, saved, SEEK_SET);
+  errno = saved_errno;
+  return n;
+}
+
+#define IO_WOULD_BLOCK(e) ((e) == EAGAIN || (e) == EWOULDBLOCK)
+
+/*
+ * Block until fd is readable (or writable), for the methods that are
+ * meant to wait even when the descriptor has O_NONBLOCK set.
+ */
+static int
+io_wait_fd(int fd, mrb_bool writing)
+{
+#ifdef MRB_IO_POSIX
+  struct pollfd pfd;
+  int n;
+
+  pfd.fd = fd;
+  pfd.events = writing ? POLLOUT : POLLIN;
+  pfd.revents = 0;
+  do {
+    n = poll(&pfd, 1, -1);
+  } while (n < 0 && errno == EINTR);
+  return n;
+#else
+  return -1;
+#endif
+}
+
+/* read(2) for the blocking readers */
+static int
+io_read_blocking(mrb_state *mrb, struct mrb_io *fptr, int fd, char *ptr, mrb_int len)
+{
+  int n;
+
+  do {
+    n = io_sys_read(mrb, fptr, fd, ptr, len);
+  } while (n < 0 && IO_WOULD_BLOCK(errno) && io_wait_fd(fd, FALSE) > 0);
+  return n;
+}
+
+/*
+ * IO._read_file(path, length = nil, offset = 0)
+ *
+ * Whole-file read behind IO.read and IO.binread.  For a regular file the
+ * size is known up front, so the result String is allocated once and
+ * filled by a pread loop.  Other files are read in growing chunks.
+ */
+mrb_value
+mrb_io_s_read_file(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value path, length = mrb_nil_value(), str;
+  mrb_int offset = 0, len = -1, size = -1, total = 0, want;
+  const char *pat;
+  int fd, n;
+  struct mrb_io_stat st;
+  off_t end;
+
+  mrb_get_args(mrb, "S|oi", &path, &length, &offset);
+  if (!mrb_nil_p(length)) {
+    if (!mrb_fixnum_p(length)) {
+      mrb_raisef(mrb, E_TYPE_ERROR, "can't convert %S into Integer",
+                 mrb_obj_value(mrb_obj_class(mrb, length)));
+    }
+    len = mrb_fixnum(length);
+    if (len < 0) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative length: %S given", length);
+    }
+  }
+  if (offset < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative offset: %S given", mrb_fixnum_value(offset));
+  }
+
+  pat = mrb_string_value_cstr(mrb, &path);
+  fd = io_open(mrb, pat, O_RDONLY, 0);
+  if (fd == -1) {
+    mrb_sys_fail(mrb, pat);
+  }
+
+  /* a size of 0 may just mean "unknown" (e.g. files under /proc) */
+  if (mrb_io_sys_fstat(fd, &st) == 0) {
+    if (S_ISREG(st.mode) && st.size > 0) {
+      size = st.size;
+    }
+  } else {
+    /* no fstat on this backend: the end offset tells the size */
+    end = io_sys_seek(mrb, NULL, fd, 0, SEEK_END);
+    if (end > 0) {
+      size = end;
+    }
+  }
+
+  if (size >= 0) {
+    want = (size > offset) ? size - offset : 0;
+    if (len >= 0 && len < want) {
+      want = len;
+    }
+  } else {
+    want = (len >= 0) ? len : MRB_IO_BUF_SIZE;
+  }
+  str = mrb_str_buf_new(mrb, want);
+
+  for (;;) {
+    if (total == want) {
+      if (size >= 0 || len >= 0) {
+        break;
+      }
+      /* size unknown: keep doubling until end of file */
+      want *= 2;
+      io_str_reserve(mrb, str, want);
+    }
+    n = io_pread(mrb, NULL, fd, RSTRING_PTR(str) + total, want - total, offset + total);
+    if (n < 0) {
+      io_sys_close(mrb, NULL, fd);
+      mrb_sys_fail(mrb, pat);
+    }
+    if (n == 0) {
+      break;
+    }
+    total += n;
+    io_str_set_len(str, total);
+  }
+  io_sys_close(mrb, NULL, fd);
+
+  if (total == 0 && len > 0) {
+    return mrb_nil_value();
+  }
+  return str;
+}
+
 mrb_value
 mrb_io_sysread(mrb_state *mrb, mrb_value io)
 {
   struct mrb_io *fptr;
-  mrb_value buf = mrb_nil_value();
+  mrb_value buf, opt;
   mrb_int maxlen;
   int ret;
 
-  mrb_get_args(mrb, "i|S", &maxlen, &buf);
+  opt = io_get_read_args(mrb, &maxlen, &buf);
   if (maxlen < 0) {
     return mrb_nil_value();
   }
-
-  if (mrb_nil_p(buf)) {
-    buf = mrb_str_new(mrb, NULL, maxlen);
-  }
-  if (RSTRING_LEN(buf) != maxlen) {
-    buf = mrb_str_resize(mrb, buf, maxlen);
-  }
+  io_str_reserve(mrb, buf, maxlen);
 
   fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
-  ret = read(fptr->fd, RSTRING_PTR(buf), maxlen);
+  if (IO_RBUF_LEN(fptr) > 0) {
+    /* read ahead, e.g. by eof?: hand that out before reading more */
+    ret = (maxlen < IO_RBUF_LEN(fptr)) ? (int)maxlen : IO_RBUF_LEN(fptr);
+    memcpy(RSTRING_PTR(buf), IO_RBUF_PTR(fptr), ret);
+    io_rbuf_consume(fptr, ret);
+    io_str_set_len(buf, ret);
+    return buf;
+  }
+  io_flush_wbuf(mrb, fptr, FALSE);
+  ret = io_sys_read(mrb, fptr, fptr->fd, RSTRING_PTR(buf), maxlen);
   switch (ret) {
     case 0: /* EOF */
-      if (maxlen == 0) {
-        buf = mrb_str_new_cstr(mrb, "");
-      } else {
+      io_str_set_len(buf, 0);
+      if (maxlen > 0) {
+        if (!io_opt_exception(mrb, opt)) {
+          return mrb_nil_value();
+        }
         mrb_raise(mrb, E_EOF_ERROR, "sysread failed: End of File");
       }
       break;
@@ -291,63 +947,2029 @@ mrb_io_sysread(mrb_state *mrb, mrb_value io)
       mrb_sys_fail(mrb, "sysread failed");
       break;
     default:
-      if (RSTRING_LEN(buf) != ret) {
-        buf = mrb_str_resize(mrb, buf, ret);
+      io_str_set_len(buf, ret);
+      fptr->pos += ret;
+      break;
+  }
+
+  return buf;
+}
+
+mrb_value
+mrb_io_sysseek(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  int pos;
+  mrb_int offset, whence = -1;
+
+  mrb_get_args(mrb, "i|i", &offset, &whence);
+  if (whence < 0) {
+    whence = 0;
+  }
+
+  fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
+  io_flush_wbuf(mrb, fptr, FALSE);
+  if (whence == SEEK_CUR && IO_RBUF_LEN(fptr) > 0) {
+    /* read ahead, e.g. by eof?: the fd is past pos, so seek from pos */
+    offset += fptr->pos;
+    whence = SEEK_SET;
+  }
+  pos = io_sys_seek(mrb, fptr, fptr->fd, offset, whence);
+  if (pos < 0) {
+    mrb_raise(mrb, E_IO_ERROR, "sysseek failed");
+  }
+  fptr->rbuf.start = fptr->rbuf.end = 0;
+  fptr->pos = pos;
+
+  return mrb_fixnum_value(pos);
+}
+
+mrb_value
+mrb_io_syswrite(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  mrb_value str, buf;
+  int fd, length;
+
+  fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
+  if (! fptr->writable) {
+    mrb_raise(mrb, E_IO_ERROR, "not opened for writing");
+  }
+
+  mrb_get_args(mrb, "S", &str);
+  if (mrb_type(str) != MRB_TT_STRING) {
+    buf = mrb_funcall(mrb, str, "to_s", 0);
+  } else {
+    buf = str;
+  }
+
+  io_flush_wbuf(mrb, fptr, FALSE);
+  if (fptr->fd2 == -1) {
+    fd = fptr->fd;
+  } else {
+    fd = fptr->fd2;
+  }
+  length = io_sys_write(mrb, fptr, fd, RSTRING_PTR(buf), RSTRING_LEN(buf));
+  if (length > 0) {
+    fptr->pos += length;
+    IO_WROTE(fptr);
+  }
+
+  return mrb_fixnum_value(length);
+}
+
+static struct mrb_io *
+io_get_open_fptr(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+
+  fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
+  if (fptr == NULL || fptr->fd < 0) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream.");
+  }
+  return fptr;
+}
+
+static void
+io_buf_alloc(mrb_state *mrb, struct mrb_io_buf *buf)
+{
+  if (buf->ptr == NULL) {
+    buf->ptr = (char *)mrb_malloc(mrb, MRB_IO_BUF_SIZE);
+    buf->capa = MRB_IO_BUF_SIZE;
+    buf->start = buf->end = 0;
+  }
+}
+
+static void
+io_buf_release(mrb_state *mrb, struct mrb_io_buf *buf)
+{
+  mrb_free(mrb, buf->ptr);
+  buf->ptr = NULL;
+  buf->capa = buf->start = buf->end = 0;
+}
+
+/*
+ * Read more data into the read buffer, keeping what is already buffered.
+ * The buffered bytes are moved to the front, and the buffer grows when it
+ * is already full so that a long line can be kept contiguous.  Returns the
+ * number of bytes added; 0 means end of file.
+ */
+static int
+io_rbuf_more(mrb_state *mrb, struct mrb_io *fptr)
+{
+  struct mrb_io_buf *buf = &fptr->rbuf;
+  int n, len;
+
+  io_flush_wbuf(mrb, fptr, FALSE);
+  io_buf_alloc(mrb, buf);
+  len = buf->end - buf->start;
+  if (len == 0 && buf->capa > MRB_IO_BUF_SIZE) {
+    /* give back the memory a long line made us grow */
+    buf->ptr = (char *)mrb_realloc(mrb, buf->ptr, MRB_IO_BUF_SIZE);
+    buf->capa = MRB_IO_BUF_SIZE;
+  }
+  if (buf->start > 0) {
+    memmove(buf->ptr, buf->ptr + buf->start, len);
+    buf->start = 0;
+    buf->end = len;
+  }
+  if (buf->end == buf->capa) {
+    buf->ptr = (char *)mrb_realloc(mrb, buf->ptr, buf->capa * 2);
+    buf->capa *= 2;
+  }
+  IO_STAT_INC(fptr, refills);
+  n = io_read_blocking(mrb, fptr, fptr->fd, buf->ptr + buf->end, buf->capa - buf->end);
+  if (n < 0) {
+    mrb_sys_fail(mrb, "read failed");
+  }
+  buf->end += n;
+  return n;
+}
+
+/*
+ * Refill the read buffer if it is empty.  Returns the number of buffered
+ * bytes; 0 means end of file.
+ */
+static int
+io_fill_rbuf(mrb_state *mrb, struct mrb_io *fptr)
+{
+  if (IO_RBUF_LEN(fptr) > 0) {
+    return IO_RBUF_LEN(fptr);
+  }
+  return io_rbuf_more(mrb, fptr);
+}
+
+static void
+io_rbuf_consume(struct mrb_io *fptr, int len)
+{
+  fptr->rbuf.start += len;
+  fptr->pos += len;
+  if (fptr->rbuf.start == fptr->rbuf.end) {
+    fptr->rbuf.start = fptr->rbuf.end = 0;
+  }
+}
+
+/* push len bytes back in front of the read buffer */
+static void
+io_rbuf_unget(mrb_state *mrb, struct mrb_io *fptr, const char *ptr, int len)
+{
+  struct mrb_io_buf *buf = &fptr->rbuf;
+  int buffered;
+
+  io_buf_alloc(mrb, buf);
+  if (buf->start >= len) {
+    buf->start -= len;
+    memcpy(buf->ptr + buf->start, ptr, len);
+    return;
+  }
+
+  buffered = buf->end - buf->start;
+  if (buffered + len > buf->capa) {
+    buf->ptr = (char *)mrb_realloc(mrb, buf->ptr, buffered + len);
+    buf->capa = buffered + len;
+  }
+  memmove(buf->ptr + len, buf->ptr + buf->start, buffered);
+  memcpy(buf->ptr, ptr, len);
+  buf->start = 0;
+  buf->end = buffered + len;
+}
+
+/* rewind the fd over read-ahead data so that a write lands at pos */
+static void
+io_rbuf_discard(mrb_state *mrb, struct mrb_io *fptr)
+{
+  if (IO_RBUF_LEN(fptr) > 0) {
+    io_sys_seek(mrb, fptr, fptr->fd, -(off_t)IO_RBUF_LEN(fptr), SEEK_CUR);
+    fptr->rbuf.start = fptr->rbuf.end = 0;
+  }
+}
+
+static int
+io_write_fd(struct mrb_io *fptr)
+{
+  return (fptr->fd2 == -1) ? fptr->fd : fptr->fd2;
+}
+
+/*
+ * write(2) until everything is out; returns -1 on error.  If done is not
+ * NULL it is set to the number of bytes that were written.
+ */
+static int
+io_write_fully(mrb_state *mrb, struct mrb_io *fptr, int fd, const char *ptr, mrb_int len, mrb_int *done)
+{
+  mrb_int written = 0;
+  int n;
+
+  while (len > 0) {
+    n = io_sys_write(mrb, fptr, fd, ptr, len);
+    if (n < 0) {
+      if (errno == EINTR || (IO_WOULD_BLOCK(errno) && io_wait_fd(fd, TRUE) > 0)) {
+        continue;
+      }
+      break;
+    }
+    ptr += n;
+    len -= n;
+    written += n;
+  }
+  if (done != NULL) {
+    *done = written;
+  }
+  return (len > 0) ? -1 : 0;
+}
+
+/*
+ * Write out the pending output.  On failure the buffer is dropped and -1
+ * returned if noraise is set; otherwise SystemCallError is raised and what
+ * was not written is kept for a later retry.
+ */
+static int
+io_flush_wbuf(mrb_state *mrb, struct mrb_io *fptr, int noraise)
+{
+  struct mrb_io_buf *buf = &fptr->wbuf;
+  mrb_int done;
+
+  if (buf->start == buf->end) {
+    return 0;
+  }
+  IO_WROTE(fptr);
+  if (io_write_fully(mrb, fptr, io_write_fd(fptr), buf->ptr + buf->start, buf->end - buf->start, &done) != 0) {
+    if (noraise) {
+      buf->start = buf->end = 0;
+      return -1;
+    }
+    buf->start += done;
+    mrb_sys_fail(mrb, "flush failed");
+  }
+  buf->start = buf->end = 0;
+  return 0;
+}
+
+/*
+ * writev(2) until everything is out; iov is consumed.  -1 on error.  done
+ * is set to the number of bytes that were written.
+ */
+static int
+io_writev_fully(mrb_state *mrb, struct mrb_io *fptr, int fd, struct iovec *iov, int cnt, mrb_int *done)
+{
+#ifdef MRB_IO_POSIX
+  ssize_t n;
+  mrb_int len;
+  uint64_t t0;
+  int i, vcnt;
+#endif
+  mrb_int piece;
+
+  *done = 0;
+#ifdef MRB_IO_POSIX
+  if (mrb_io_sys_native(fd)) {
+    while (cnt > 0) {
+      vcnt = cnt > IOV_MAX ? IOV_MAX : cnt;
+      for (len = 0, i = 0; i < vcnt; i++) {
+        len += iov[i].iov_len;
+      }
+      t0 = io_stats_clock(mrb, fptr);
+      n = writev(fd, iov, vcnt);
+      io_stats_add(mrb, fptr, MRB_IO_TRACE_WRITE, fd, NULL, len, n, t0);
+      if (n < 0) {
+        if (errno == EINTR || (IO_WOULD_BLOCK(errno) && io_wait_fd(fd, TRUE) > 0)) {
+          continue;
+        }
+        return -1;
+      }
+      *done += n;
+      while (cnt > 0 && (size_t)n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        cnt--;
+      }
+      if (cnt > 0) {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+      }
+    }
+    return 0;
+  }
+#endif
+  /* no gather write on this backend: one write per piece */
+  for (; cnt > 0; iov++, cnt--) {
+    if (io_write_fully(mrb, fptr, fd, (const char *)iov->iov_base, iov->iov_len, &piece) != 0) {
+      *done += piece;
+      return -1;
+    }
+    *done += piece;
+  }
+  return 0;
+}
+
+/*
+ * Buffered gather write.  The pieces are copied into the write buffer when
+ * they fit and the IO is not in sync mode.  Otherwise the pending output
+ * and the pieces go out together in one writev(2), straight from the
+ * callers' memory.
+ */
+static void
+io_buf_writev(mrb_state *mrb, struct mrb_io *fptr, const struct iovec *iov, int cnt)
+{
+  struct mrb_io_buf *buf = &fptr->wbuf;
+  struct iovec local[16], *vec;
+  mrb_int total = 0, done;
+  int i, n = 0, ret;
+
+  for (i = 0; i < cnt; i++) {
+    total += iov[i].iov_len;
+  }
+  if (total == 0) {
+    return;
+  }
+  io_rbuf_discard(mrb, fptr);
+  if (!fptr->sync) {
+    io_buf_alloc(mrb, buf);
+    if (buf->end + total <= buf->capa) {
+      for (i = 0; i < cnt; i++) {
+        memcpy(buf->ptr + buf->end, iov[i].iov_base, iov[i].iov_len);
+        buf->end += iov[i].iov_len;
+      }
+      fptr->pos += total;
+      return;
+    }
+  }
+
+  if (cnt + 1 <= (int)(sizeof(local) / sizeof(local[0]))) {
+    vec = local;
+  } else {
+    vec = (struct iovec *)mrb_malloc(mrb, sizeof(struct iovec) * (cnt + 1));
+  }
+  if (buf->start < buf->end) {
+    vec[n].iov_base = buf->ptr + buf->start;
+    vec[n].iov_len = buf->end - buf->start;
+    n++;
+  }
+  memcpy(vec + n, iov, sizeof(struct iovec) * cnt);
+  IO_WROTE(fptr);
+  ret = io_writev_fully(mrb, fptr, io_write_fd(fptr), vec, n + cnt, &done);
+  if (vec != local) {
+    mrb_free(mrb, vec);
+  }
+  if (ret != 0) {
+    /* keep the pending output that did not go out, as io_flush_wbuf does */
+    if (done < buf->end - buf->start) {
+      buf->start += done;
+    } else {
+      buf->start = buf->end = 0;
+    }
+    mrb_sys_fail(mrb, "write failed");
+  }
+  buf->start = buf->end = 0;
+  fptr->pos += total;
+}
+
+/*
+ * List of pieces for io_buf_writev.  Past the inline slots the vector
+ * lives in a String, so it is reclaimed by the GC even if a to_s call
+ * raises halfway through.
+ */
+struct io_gather {
+  struct iovec *iov;
+  int len, capa;
+  struct iovec local[16];
+};
+
+static void
+io_gather_init(struct io_gather *g)
+{
+  g->iov = g->local;
+  g->len = 0;
+  g->capa = sizeof(g->local) / sizeof(g->local[0]);
+}
+
+static void
+io_gather_push(mrb_state *mrb, struct io_gather *g, const char *ptr, mrb_int len)
+{
+  mrb_value store;
+
+  if (len == 0) {
+    return;
+  }
+  if (g->len == g->capa) {
+    store = mrb_str_buf_new(mrb, sizeof(struct iovec) * g->capa * 2);
+    memcpy(RSTRING_PTR(store), g->iov, sizeof(struct iovec) * g->len);
+    g->iov = (struct iovec *)RSTRING_PTR(store);
+    g->capa *= 2;
+  }
+  g->iov[g->len].iov_base = (void *)ptr;
+  g->iov[g->len].iov_len = len;
+  g->len++;
+}
+
+/* push obj.to_s, returning its length */
+static mrb_int
+io_gather_obj(mrb_state *mrb, struct io_gather *g, mrb_value obj)
+{
+  if (!mrb_string_p(obj)) {
+    obj = mrb_obj_as_string(mrb, obj);
+  }
+  io_gather_push(mrb, g, RSTRING_PTR(obj), RSTRING_LEN(obj));
+  return RSTRING_LEN(obj);
+}
+
+/*
+ * Read up to len bytes (everything up to EOF if len < 0) into str at
+ * offset off, reusing the capacity str already has.  When the read buffer
+ * is empty and the request is at least a buffer long, data goes straight
+ * from read(2) into the String.  Returns the number of bytes stored.
+ */
+static mrb_int
+io_read_into(mrb_state *mrb, struct mrb_io *fptr, mrb_value str, mrb_int off, mrb_int len)
+{
+  mrb_int total = 0, want;
+  char *p;
+  int n;
+
+  io_str_reserve(mrb, str, off);
+  io_str_set_len(str, off);
+  for (;;) {
+    want = (len >= 0) ? len - total : -1;
+    if (want == 0) {
+      break;
+    }
+    if (IO_RBUF_LEN(fptr) == 0 && (want < 0 || want >= MRB_IO_BUF_SIZE)) {
+      p = io_str_reserve(mrb, str, off + total + (want < 0 ? MRB_IO_BUF_SIZE : want));
+      if (want < 0) {
+        want = RSTRING_CAPA(str) - off - total;
+      }
+      io_flush_wbuf(mrb, fptr, FALSE);
+      n = io_read_blocking(mrb, fptr, fptr->fd, p + off + total, want);
+      if (n < 0) {
+        mrb_sys_fail(mrb, "read failed");
+      }
+      if (n == 0) {
+        break;
+      }
+      fptr->pos += n;
+    } else {
+      n = io_fill_rbuf(mrb, fptr);
+      if (n == 0) {
+        break;
+      }
+      if (want >= 0 && n > want) {
+        n = want;
+      }
+      p = io_str_reserve(mrb, str, off + total + n);
+      memcpy(p + off + total, IO_RBUF_PTR(fptr), n);
+      io_rbuf_consume(fptr, n);
+    }
+    total += n;
+    io_str_set_len(str, off + total);
+  }
+  return total;
+}
+
+/*
+ * Find the first occurrence of pat[0, patlen] in s[0, len].  Candidates
+ * are located with memchr, which libc implements with word-at-a-time or
+ * SIMD scanning, so only real first-byte matches reach memcmp.
+ */
+static const char *
+io_memsearch(const char *s, mrb_int len, const char *pat, mrb_int patlen)
+{
+  const char *p = s, *end = s + len;
+
+  if (patlen == 0) {
+    return s;
+  }
+  if (patlen == 1) {
+    return (const char *)memchr(s, pat[0], len);
+  }
+  while (end - p >= patlen) {
+    p = (const char *)memchr(p, pat[0], end - p - patlen + 1);
+    if (p == NULL) {
+      return NULL;
+    }
+    if (memcmp(p + 1, pat + 1, patlen - 1) == 0) {
+      return p;
+    }
+    p++;
+  }
+  return NULL;
+}
+
+/* drop newlines at the read position (paragraph mode) */
+static void
+io_skip_newlines(mrb_state *mrb, struct mrb_io *fptr, int refill)
+{
+  while (refill ? io_fill_rbuf(mrb, fptr) > 0 : IO_RBUF_LEN(fptr) > 0) {
+    if (*IO_RBUF_PTR(fptr) != '\n') {
+      break;
+    }
+    io_rbuf_consume(fptr, 1);
+  }
+}
+
+/*
+ * Read one line terminated by rs[0, rslen] (a paragraph if rslen is 0),
+ * at most limit bytes if limit >= 0.  The line is collected contiguously
+ * in the read buffer first, so exactly one String is allocated for it.
+ * Returns nil at end of file.
+ */
+static mrb_value
+io_getline(mrb_state *mrb, struct mrb_io *fptr, const char *rs, mrb_int rslen, mrb_int limit, mrb_bool chomp)
+{
+  mrb_int len, take, scanned = 0, chomplen = 0;
+  mrb_bool para = (rslen == 0);
+  const char *hit;
+  mrb_value line;
+
+  if (para) {
+    rs = "\n\n";
+    rslen = 2;
+    io_skip_newlines(mrb, fptr, TRUE);
+  }
+
+  for (;;) {
+    len = IO_RBUF_LEN(fptr);
+    if (limit >= 0 && len > limit) {
+      len = limit;
+    }
+    hit = io_memsearch(IO_RBUF_PTR(fptr) + scanned, len - scanned, rs, rslen);
+    if (hit != NULL) {
+      take = hit - IO_RBUF_PTR(fptr) + rslen;
+      chomplen = rslen;
+      break;
+    }
+    if (limit >= 0 && IO_RBUF_LEN(fptr) >= limit) {
+      take = limit;
+      break;
+    }
+    /* the separator may straddle the end of what we have seen so far */
+    scanned = (len > rslen - 1) ? len - (rslen - 1) : 0;
+    if (io_rbuf_more(mrb, fptr) == 0) {
+      take = IO_RBUF_LEN(fptr);
+      break;
+    }
+  }
+
+  if (take == 0) {
+    return mrb_nil_value();
+  }
+  if (chomp && chomplen == 1 && rs[0] == '\n' && take >= 2 && IO_RBUF_PTR(fptr)[take - 2] == '\r') {
+    chomplen = 2;
+  }
+  line = mrb_str_new(mrb, IO_RBUF_PTR(fptr), chomp ? take - chomplen : take);
+  io_rbuf_consume(fptr, take);
+  if (para) {
+    io_skip_newlines(mrb, fptr, FALSE);
+  }
+  return line;
+}
+
+mrb_value
+mrb_io_read(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  mrb_value length = mrb_nil_value();
+  mrb_value outbuf = mrb_nil_value();
+  mrb_int len;
+
+  mrb_get_args(mrb, "|oo", &length, &outbuf);
+  if (!mrb_nil_p(length)) {
+    if (!mrb_fixnum_p(length)) {
+      mrb_raisef(mrb, E_TYPE_ERROR, "can't convert %S into Integer",
+                 mrb_obj_value(mrb_obj_class(mrb, length)));
+    }
+    len = mrb_fixnum(length);
+    if (len < 0) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative length: %S given", length);
+    }
+  } else {
+    len = -1;
+  }
+  if (mrb_nil_p(outbuf)) {
+    outbuf = mrb_str_buf_new(mrb, (len >= 0 && len < MRB_IO_BUF_SIZE) ? len : MRB_IO_BUF_SIZE);
+  } else if (!mrb_string_p(outbuf)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "outbuf must be a String");
+  }
+  if (len == 0) {
+    io_str_reserve(mrb, outbuf, 0);
+    io_str_set_len(outbuf, 0);
+    return outbuf;
+  }
+
+  fptr = io_get_open_fptr(mrb, io);
+  if (io_read_into(mrb, fptr, outbuf, 0, len) == 0 && len > 0) {
+    return mrb_nil_value();
+  }
+  return outbuf;
+}
+
+/*
+ * read(2) or write(2) that never waits.  The descriptor is switched to
+ * O_NONBLOCK for the duration of the call unless it already is.  Other
+ * backends (FatFS, RAM) complete synchronously and have nothing to wait
+ * for, so their plain read or write is used.
+ */
+static int
+io_sys_nowait(mrb_state *mrb, struct mrb_io *fptr, int fd, char *ptr, mrb_int len, mrb_bool writing)
+{
+#ifdef MRB_IO_POSIX
+  int flags, n, saved_errno;
+  uint64_t t0;
+
+  if (mrb_io_sys_native(fd)) {
+    flags = io_fcntl_nonblock(fd, TRUE);
+    t0 = io_stats_clock(mrb, fptr);
+    n = writing ? write(fd, ptr, len) : read(fd, ptr, len);
+    io_stats_add(mrb, fptr, writing ? MRB_IO_TRACE_WRITE : MRB_IO_TRACE_READ, fd, NULL, len, n, t0);
+    if (flags >= 0 && !(flags & O_NONBLOCK)) {
+      saved_errno = errno;
+      fcntl(fd, F_SETFL, flags);
+      errno = saved_errno;
+    }
+    return n;
+  }
+#endif
+  return writing ? io_sys_write(mrb, fptr, fd, ptr, len) : io_sys_read(mrb, fptr, fd, ptr, len);
+}
+
+static void
+io_raise_would_block(mrb_state *mrb, const char *cname, const char *mesg)
+{
+  mrb_raise(mrb, mrb_class_get_under(mrb, mrb_class_get(mrb, "IO"), cname), mesg);
+}
+
+/*
+ * Body of readpartial and read_nonblock: hand out buffered data if there
+ * is any, otherwise do a single read(2).  At end of file this raises
+ * EOFError, or returns nil with exception: false.
+ */
+static mrb_value
+io_read_some(mrb_state *mrb, mrb_value io, mrb_bool nowait)
+{
+  struct mrb_io *fptr;
+  mrb_value outbuf, opt;
+  mrb_int maxlen;
+  int n;
+
+  opt = io_get_read_args(mrb, &maxlen, &outbuf);
+  if (maxlen < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative length: %S given", mrb_fixnum_value(maxlen));
+  }
+  io_str_reserve(mrb, outbuf, maxlen);
+  if (maxlen == 0) {
+    io_str_set_len(outbuf, 0);
+    return outbuf;
+  }
+
+  fptr = io_get_open_fptr(mrb, io);
+  if (IO_RBUF_LEN(fptr) > 0) {
+    n = IO_RBUF_LEN(fptr);
+    if (n > maxlen) {
+      n = maxlen;
+    }
+    memcpy(RSTRING_PTR(outbuf), IO_RBUF_PTR(fptr), n);
+    io_rbuf_consume(fptr, n);
+  } else {
+    io_flush_wbuf(mrb, fptr, FALSE);
+    if (nowait) {
+      n = io_sys_nowait(mrb, fptr, fptr->fd, RSTRING_PTR(outbuf), maxlen, FALSE);
+    } else {
+      n = io_read_blocking(mrb, fptr, fptr->fd, RSTRING_PTR(outbuf), maxlen);
+    }
+    if (n < 0) {
+      io_str_set_len(outbuf, 0);
+      if (nowait && IO_WOULD_BLOCK(errno)) {
+        if (!io_opt_exception(mrb, opt)) {
+          return mrb_symbol_value(mrb_intern_cstr(mrb, "wait_readable"));
+        }
+        io_raise_would_block(mrb, "EAGAINWaitReadable", "Resource temporarily unavailable - read would block");
+      }
+      mrb_sys_fail(mrb, nowait ? "read_nonblock failed" : "readpartial failed");
+    }
+    fptr->pos += n;
+  }
+  io_str_set_len(outbuf, n);
+  if (n == 0) {
+    if (!io_opt_exception(mrb, opt)) {
+      return mrb_nil_value();
+    }
+    mrb_raise(mrb, E_EOF_ERROR, "end of file reached");
+  }
+  return outbuf;
+}
+
+/* IO#readpartial(maxlen, outbuf = nil, exception: true) */
+mrb_value
+mrb_io_readpartial(mrb_state *mrb, mrb_value io)
+{
+  return io_read_some(mrb, io, FALSE);
+}
+
+/* IO#read_nonblock(maxlen, outbuf = nil, exception: true) */
+mrb_value
+mrb_io_read_nonblock(mrb_state *mrb, mrb_value io)
+{
+  return io_read_some(mrb, io, TRUE);
+}
+
+/*
+ * call-seq:
+ *   io.write_nonblock(string, exception: true)  -> Integer or :wait_writable
+ *
+ * Writes as much of string as the descriptor takes without waiting,
+ * after the same is done for any output still in the write buffer.
+ */
+mrb_value
+mrb_io_write_nonblock(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  struct mrb_io_buf *buf;
+  mrb_value str, opt = mrb_nil_value();
+  int n;
+
+  mrb_get_args(mrb, "o|o", &str, &opt);
+  if (!mrb_string_p(str)) {
+    str = mrb_obj_as_string(mrb, str);
+  }
+  fptr = io_get_write_fptr(mrb, io);
+  io_rbuf_discard(mrb, fptr);
+
+  buf = &fptr->wbuf;
+  while (buf->start < buf->end) {
+    n = io_sys_nowait(mrb, fptr, io_write_fd(fptr), buf->ptr + buf->start, buf->end - buf->start, TRUE);
+    if (n < 0) {
+      goto fail;
+    }
+    buf->start += n;
+  }
+  buf->start = buf->end = 0;
+
+  n = io_sys_nowait(mrb, fptr, io_write_fd(fptr), RSTRING_PTR(str), RSTRING_LEN(str), TRUE);
+  if (n < 0) {
+    goto fail;
+  }
+  fptr->pos += n;
+  IO_WROTE(fptr);
+  return mrb_fixnum_value(n);
+
+ fail:
+  if (IO_WOULD_BLOCK(errno)) {
+    if (!io_opt_exception(mrb, opt)) {
+      return mrb_symbol_value(mrb_intern_cstr(mrb, "wait_writable"));
+    }
+    io_raise_would_block(mrb, "EAGAINWaitWritable", "Resource temporarily unavailable - write would block");
+  }
+  mrb_sys_fail(mrb, "write_nonblock failed");
+  return mrb_nil_value();
+}
+
+mrb_value
+mrb_io_set_nonblock(mrb_state *mrb, mrb_value io)
+{
+#ifdef MRB_IO_POSIX
+  struct mrb_io *fptr;
+  mrb_bool b;
+
+  mrb_get_args(mrb, "b", &b);
+  fptr = io_get_open_fptr(mrb, io);
+  if (io_fcntl_nonblock(fptr->fd, b) < 0 ||
+      (fptr->fd2 != -1 && io_fcntl_nonblock(fptr->fd2, b) < 0)) {
+    mrb_sys_fail(mrb, "fcntl");
+  }
+  return mrb_bool_value(b);
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "IO#nonblock= is not supported on the platform");
+  return mrb_nil_value();
+#endif
+}
+
+mrb_value
+mrb_io_nonblock_p(mrb_state *mrb, mrb_value io)
+{
+#ifdef MRB_IO_POSIX
+  struct mrb_io *fptr;
+  int flags;
+
+  fptr = io_get_open_fptr(mrb, io);
+  if (!mrb_io_sys_native(fptr->fd)) {
+    return mrb_false_value();
+  }
+  flags = fcntl(fptr->fd, F_GETFL);
+  if (flags < 0) {
+    mrb_sys_fail(mrb, "fcntl");
+  }
+  return mrb_bool_value((flags & O_NONBLOCK) != 0);
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "IO#nonblock? is not supported on the platform");
+  return mrb_false_value();
+#endif
+}
+
+struct io_line_args {
+  mrb_value rs;     /* separator String, or nil to read everything */
+  mrb_int limit;    /* byte limit, -1 for none */
+  mrb_bool chomp;
+};
+
+/* parse (sep = $/, limit = nil, chomp: false) shared by the line readers */
+static mrb_value
+io_get_line_args(mrb_state *mrb, struct io_line_args *la)
+{
+  mrb_value *argv, blk;
+  mrb_int argc;
+
+  mrb_get_args(mrb, "*&", &argv, &argc, &blk);
+  la->limit = -1;
+  la->chomp = FALSE;
+  if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+    la->chomp = mrb_test(io_opt_get(mrb, argv[argc - 1], "chomp"));
+    argc--;
+  }
+  if (argc > 2) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (%S for 0..2)", mrb_fixnum_value(argc));
+  }
+
+  la->rs = mrb_gv_get(mrb, mrb_intern_cstr(mrb, "$/"));
+  if (argc == 1 && mrb_fixnum_p(argv[0])) {
+    la->limit = mrb_fixnum(argv[0]);
+  } else if (argc >= 1) {
+    if (!mrb_string_p(argv[0]) && !mrb_nil_p(argv[0])) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong argument type");
+    }
+    la->rs = argv[0];
+    if (argc == 2 && !mrb_nil_p(argv[1])) {
+      if (!mrb_fixnum_p(argv[1])) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong argument type");
+      }
+      la->limit = mrb_fixnum(argv[1]);
+    }
+  }
+  if (la->limit < 0) {
+    la->limit = -1;
+  }
+  return blk;
+}
+
+/* next line according to la, or nil at end of file */
+static mrb_value
+io_next_line(mrb_state *mrb, struct mrb_io *fptr, struct io_line_args *la)
+{
+  mrb_value str;
+
+  if (mrb_nil_p(la->rs)) {
+    str = mrb_str_buf_new(mrb, MRB_IO_BUF_SIZE);
+    if (io_read_into(mrb, fptr, str, 0, la->limit) == 0) {
+      return mrb_nil_value();
+    }
+    return str;
+  }
+  return io_getline(mrb, fptr, RSTRING_PTR(la->rs), RSTRING_LEN(la->rs), la->limit, la->chomp);
+}
+
+/* Shared body of IO#gets and IO#readline */
+static mrb_value
+io_gets(mrb_state *mrb, mrb_value io, mrb_bool raise_eof)
+{
+  struct mrb_io *fptr;
+  struct io_line_args la;
+  mrb_value str;
+
+  io_get_line_args(mrb, &la);
+  fptr = io_get_open_fptr(mrb, io);
+  if (la.limit == 0) {
+    return mrb_str_new(mrb, NULL, 0);
+  }
+
+  str = io_next_line(mrb, fptr, &la);
+  if (mrb_nil_p(str) && raise_eof) {
+    mrb_raise(mrb, E_EOF_ERROR, "end of file reached");
+  }
+  return str;
+}
+
+/*
+ * Split the rest of the stream into lines in a single native loop.  Each
+ * line is pushed to ary, or yielded to blk when ary is nil; no Ruby frame
+ * or EOFError is involved per line.
+ */
+static void
+io_each_line(mrb_state *mrb, mrb_value io, struct io_line_args *la, mrb_value ary, mrb_value blk)
+{
+  struct mrb_io *fptr;
+  mrb_value line;
+  int ai;
+
+  fptr = io_get_open_fptr(mrb, io);
+  if (la->limit == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid limit: 0 for each_line");
+  }
+
+  ai = mrb_gc_arena_save(mrb);
+  for (;;) {
+    line = io_next_line(mrb, fptr, la);
+    if (mrb_nil_p(line)) {
+      break;
+    }
+    if (mrb_nil_p(ary)) {
+      mrb_yield(mrb, blk, line);
+      /* the block may have closed us */
+      fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
+      if (fptr == NULL || fptr->fd < 0) {
+        break;
+      }
+    } else {
+      mrb_ary_push(mrb, ary, line);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+mrb_value
+mrb_io_readline(mrb_state *mrb, mrb_value io)
+{
+  return io_gets(mrb, io, TRUE);
+}
+
+mrb_value
+mrb_io_gets(mrb_state *mrb, mrb_value io)
+{
+  return io_gets(mrb, io, FALSE);
+}
+
+mrb_value
+mrb_io_readlines(mrb_state *mrb, mrb_value io)
+{
+  struct io_line_args la;
+  mrb_value ary;
+
+  io_get_line_args(mrb, &la);
+  ary = mrb_ary_new(mrb);
+  io_each_line(mrb, io, &la, ary, mrb_nil_value());
+  return ary;
+}
+
+mrb_value
+mrb_io_each_line(mrb_state *mrb, mrb_value io)
+{
+  struct io_line_args la;
+  mrb_value blk, *argv, args[4];
+  mrb_int argc;
+
+  blk = io_get_line_args(mrb, &la);
+  if (mrb_nil_p(blk)) {
+    /* io_get_line_args has already limited this to 3 arguments */
+    mrb_get_args(mrb, "*", &argv, &argc);
+    args[0] = mrb_symbol_value(mrb_intern_cstr(mrb, "each_line"));
+    memcpy(args + 1, argv, sizeof(mrb_value) * argc);
+    return mrb_funcall_argv(mrb, io, mrb_intern_cstr(mrb, "to_enum"), argc + 1, args);
+  }
+  io_each_line(mrb, io, &la, mrb_nil_value(), blk);
+  return io;
+}
+
+/* byte length of the character at the read position; 0 at end of file */
+static mrb_int
+io_char_len(mrb_state *mrb, struct mrb_io *fptr)
+{
+  mrb_int len = 1;
+#ifdef MRB_UTF8_STRING
+  unsigned char c;
+#endif
+
+  if (io_fill_rbuf(mrb, fptr) == 0) {
+    return 0;
+  }
+#ifdef MRB_UTF8_STRING
+  c = (unsigned char)*IO_RBUF_PTR(fptr);
+  if ((c & 0xe0) == 0xc0) {
+    len = 2;
+  } else if ((c & 0xf0) == 0xe0) {
+    len = 3;
+  } else if ((c & 0xf8) == 0xf0) {
+    len = 4;
+  }
+  /* the rest of the character may not have been read yet */
+  while (IO_RBUF_LEN(fptr) < len && io_rbuf_more(mrb, fptr) > 0)
+    ;
+  if (IO_RBUF_LEN(fptr) < len) {
+    len = IO_RBUF_LEN(fptr);
+  }
+#endif
+  return len;
+}
+
+static mrb_value
+io_getc(mrb_state *mrb, struct mrb_io *fptr)
+{
+  mrb_value c;
+  mrb_int len;
+
+  len = io_char_len(mrb, fptr);
+  if (len == 0) {
+    return mrb_nil_value();
+  }
+  c = mrb_str_new(mrb, IO_RBUF_PTR(fptr), len);
+  io_rbuf_consume(fptr, len);
+  return c;
+}
+
+static mrb_value
+io_getbyte(mrb_state *mrb, struct mrb_io *fptr)
+{
+  unsigned char c;
+
+  if (io_fill_rbuf(mrb, fptr) == 0) {
+    return mrb_nil_value();
+  }
+  c = (unsigned char)*IO_RBUF_PTR(fptr);
+  io_rbuf_consume(fptr, 1);
+  return mrb_fixnum_value(c);
+}
+
+mrb_value
+mrb_io_getc(mrb_state *mrb, mrb_value io)
+{
+  return io_getc(mrb, io_get_open_fptr(mrb, io));
+}
+
+mrb_value
+mrb_io_readchar(mrb_state *mrb, mrb_value io)
+{
+  mrb_value c;
+
+  c = io_getc(mrb, io_get_open_fptr(mrb, io));
+  if (mrb_nil_p(c)) {
+    mrb_raise(mrb, E_EOF_ERROR, "end of file reached");
+  }
+  return c;
+}
+
+mrb_value
+mrb_io_getbyte(mrb_state *mrb, mrb_value io)
+{
+  return io_getbyte(mrb, io_get_open_fptr(mrb, io));
+}
+
+mrb_value
+mrb_io_readbyte(mrb_state *mrb, mrb_value io)
+{
+  mrb_value c;
+
+  c = io_getbyte(mrb, io_get_open_fptr(mrb, io));
+  if (mrb_nil_p(c)) {
+    mrb_raise(mrb, E_EOF_ERROR, "end of file reached");
+  }
+  return c;
+}
+
+/*
+ * Walk the read buffer with a cursor, yielding each byte (as an Integer)
+ * or each character.  Nothing is allocated per byte.
+ */
+static mrb_value
+io_each_unit(mrb_state *mrb, mrb_value io, mrb_bool bytes)
+{
+  struct mrb_io *fptr;
+  mrb_value blk, v;
+  int ai;
+
+  mrb_get_args(mrb, "&", &blk);
+  if (mrb_nil_p(blk)) {
+    v = mrb_symbol_value(mrb_intern_cstr(mrb, bytes ? "each_byte" : "each_char"));
+    return mrb_funcall_argv(mrb, io, mrb_intern_cstr(mrb, "to_enum"), 1, &v);
+  }
+
+  fptr = io_get_open_fptr(mrb, io);
+  ai = mrb_gc_arena_save(mrb);
+  for (;;) {
+    v = bytes ? io_getbyte(mrb, fptr) : io_getc(mrb, fptr);
+    if (mrb_nil_p(v)) {
+      break;
+    }
+    mrb_yield(mrb, blk, v);
+    mrb_gc_arena_restore(mrb, ai);
+    /* the block may have closed us */
+    fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
+    if (fptr == NULL || fptr->fd < 0) {
+      break;
+    }
+  }
+  return io;
+}
+
+mrb_value
+mrb_io_each_byte(mrb_state *mrb, mrb_value io)
+{
+  return io_each_unit(mrb, io, TRUE);
+}
+
+mrb_value
+mrb_io_each_char(mrb_state *mrb, mrb_value io)
+{
+  return io_each_unit(mrb, io, FALSE);
+}
+
+/*
+ * IO#eof? never consumes data.  Buffered data answers it for free;
+ * otherwise the buffer is refilled with a normal block-sized read that the
+ * following reads (sysread included) use, so an `until io.eof?` loop makes
+ * no syscalls of its own.
+ */
+mrb_value
+mrb_io_eof(mrb_state *mrb, mrb_value io)
+{
+  return mrb_bool_value(io_fill_rbuf(mrb, io_get_open_fptr(mrb, io)) == 0);
+}
+
+mrb_value
+mrb_io_read_buf(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+
+  fptr = io_get_open_fptr(mrb, io);
+  if (io_fill_rbuf(mrb, fptr) == 0) {
+    mrb_raise(mrb, E_EOF_ERROR, "end of file reached");
+  }
+  return mrb_str_new(mrb, IO_RBUF_PTR(fptr), IO_RBUF_LEN(fptr));
+}
+
+mrb_value
+mrb_io_ungets(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  mrb_value str;
+
+  mrb_get_args(mrb, "o", &str);
+  if (!mrb_string_p(str)) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "expect String, got %S",
+               mrb_obj_value(mrb_obj_class(mrb, str)));
+  }
+  fptr = io_get_open_fptr(mrb, io);
+  if (fptr->pos == 0) {
+    mrb_raise(mrb, E_IO_ERROR, "can't unget at the beginning of the stream");
+  }
+  io_rbuf_unget(mrb, fptr, RSTRING_PTR(str), RSTRING_LEN(str));
+  fptr->pos -= RSTRING_LEN(str);
+  return mrb_nil_value();
+}
+
+mrb_value
+mrb_io_pos(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+
+  fptr = io_get_open_fptr(mrb, io);
+  return mrb_fixnum_value(fptr->pos);
+}
+
+mrb_value
+mrb_io_seek(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  mrb_int offset, whence = SEEK_SET;
+  off_t pos;
+
+  mrb_get_args(mrb, "i|i", &offset, &whence);
+  fptr = io_get_open_fptr(mrb, io);
+  io_flush_wbuf(mrb, fptr, FALSE);
+  if (whence == SEEK_CUR) {
+    /* the fd is ahead of us by whatever is still buffered */
+    offset -= IO_RBUF_LEN(fptr);
+  }
+  pos = io_sys_seek(mrb, fptr, fptr->fd, offset, whence);
+  if (pos < 0) {
+    mrb_sys_fail(mrb, "seek failed");
+  }
+  fptr->rbuf.start = fptr->rbuf.end = 0;
+  fptr->pos = pos;
+  return mrb_fixnum_value(0);
+}
+
+static struct mrb_io *
+io_get_write_fptr(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+
+  fptr = io_get_open_fptr(mrb, io);
+  if (! fptr->writable) {
+    mrb_raise(mrb, E_IO_ERROR, "not opened for writing");
+  }
+  return fptr;
+}
+
+/* IO#write(*objs) -> Integer */
+mrb_value
+mrb_io_write(mrb_state *mrb, mrb_value io)
+{
+  struct io_gather g;
+  mrb_value *argv;
+  mrb_int argc, i, total = 0;
+
+  mrb_get_args(mrb, "*", &argv, &argc);
+  io_gather_init(&g);
+  for (i = 0; i < argc; i++) {
+    total += io_gather_obj(mrb, &g, argv[i]);
+  }
+  io_buf_writev(mrb, io_get_write_fptr(mrb, io), g.iov, g.len);
+  return mrb_fixnum_value(total);
+}
+
+/* IO#<<(obj) -> self */
+mrb_value
+mrb_io_lshift(mrb_state *mrb, mrb_value io)
+{
+  struct io_gather g;
+  mrb_value obj;
+
+  mrb_get_args(mrb, "o", &obj);
+  io_gather_init(&g);
+  io_gather_obj(mrb, &g, obj);
+  io_buf_writev(mrb, io_get_write_fptr(mrb, io), g.iov, g.len);
+  return io;
+}
+
+/* IO#print(*objs) -> nil */
+mrb_value
+mrb_io_print(mrb_state *mrb, mrb_value io)
+{
+  mrb_io_write(mrb, io);
+  return mrb_nil_value();
+}
+
+/* IO#puts(*objs) -> nil; one writev for all lines and newlines */
+mrb_value
+mrb_io_puts(mrb_state *mrb, mrb_value io)
+{
+  struct io_gather g;
+  mrb_value *argv;
+  mrb_int argc, i, len;
+
+  mrb_get_args(mrb, "*", &argv, &argc);
+  io_gather_init(&g);
+  for (i = 0; i < argc; i++) {
+    len = io_gather_obj(mrb, &g, argv[i]);
+    if (len == 0 || ((char *)g.iov[g.len - 1].iov_base)[len - 1] != '\n') {
+      io_gather_push(mrb, &g, "\n", 1);
+    }
+  }
+  if (argc == 0) {
+    io_gather_push(mrb, &g, "\n", 1);
+  }
+  io_buf_writev(mrb, io_get_write_fptr(mrb, io), g.iov, g.len);
+  return mrb_nil_value();
+}
+
+/*
+ * Binary numbers, read and written byte by byte so that neither alignment
+ * nor the host's byte order matters.
+ */
+enum io_num_kind { IO_NUM_INT, IO_NUM_UINT, IO_NUM_FLOAT };
+
+struct io_num_type {
+  const char *name;
+  int size;
+  enum io_num_kind kind;
+};
+
+static const struct io_num_type io_num_types[] = {
+  { "int8",    1, IO_NUM_INT },
+  { "uint8",   1, IO_NUM_UINT },
+  { "int16",   2, IO_NUM_INT },
+  { "uint16",  2, IO_NUM_UINT },
+  { "int32",   4, IO_NUM_INT },
+  { "uint32",  4, IO_NUM_UINT },
+  { "int64",   8, IO_NUM_INT },
+  { "uint64",  8, IO_NUM_UINT },
+  { "float32", 4, IO_NUM_FLOAT },
+  { "float64", 8, IO_NUM_FLOAT },
+};
+
+enum {
+  IO_NUM_INT8, IO_NUM_UINT8, IO_NUM_INT16, IO_NUM_UINT16, IO_NUM_INT32,
+  IO_NUM_UINT32, IO_NUM_INT64, IO_NUM_UINT64, IO_NUM_FLOAT32, IO_NUM_FLOAT64
+};
+
+static const struct io_num_type *
+io_num_type(mrb_state *mrb, mrb_value type)
+{
+  const char *name;
+  size_t i;
+
+  if (!mrb_symbol_p(type)) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "type must be a Symbol: %S", type);
+  }
+  name = mrb_sym2name(mrb, mrb_symbol(type));
+  for (i = 0; i < sizeof(io_num_types) / sizeof(io_num_types[0]); i++) {
+    if (strcmp(name, io_num_types[i].name) == 0) {
+      return &io_num_types[i];
+    }
+  }
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown type: %S", type);
+  return NULL;
+}
+
+/* TRUE for big endian; endian is nil or :little, :big or :native */
+static int
+io_num_big(mrb_state *mrb, mrb_value endian)
+{
+  static const union { uint16_t u; char c[2]; } host = { 1 };
+  mrb_sym sym;
+
+  if (mrb_nil_p(endian)) {
+    return FALSE;
+  }
+  if (mrb_symbol_p(endian)) {
+    sym = mrb_symbol(endian);
+    if (sym == mrb_intern_lit(mrb, "little")) {
+      return FALSE;
+    }
+    if (sym == mrb_intern_lit(mrb, "big")) {
+      return TRUE;
+    }
+    if (sym == mrb_intern_lit(mrb, "native")) {
+      return host.c[0] == 0;
+    }
+  }
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown endian: %S", endian);
+  return FALSE;
+}
+
+/* integers outside Fixnum come back as Float, as with IO#stats */
+static mrb_value
+io_num_decode(mrb_state *mrb, const struct io_num_type *t, int big, const unsigned char *p)
+{
+  uint64_t u = 0;
+  int64_t i;
+  uint32_t w;
+  float f;
+  double d;
+  int k;
+
+  for (k = 0; k < t->size; k++) {
+    u = (u << 8) | p[big ? k : t->size - 1 - k];
+  }
+  switch (t->kind) {
+  case IO_NUM_FLOAT:
+    if (t->size == 4) {
+      w = (uint32_t)u;
+      memcpy(&f, &w, sizeof(f));
+      return mrb_float_value(mrb, (mrb_float)f);
+    }
+    memcpy(&d, &u, sizeof(d));
+    return mrb_float_value(mrb, (mrb_float)d);
+  case IO_NUM_INT:
+    if (t->size < 8 && (u >> (t->size * 8 - 1)) & 1) {
+      u |= ~(uint64_t)0 << (t->size * 8);
+    }
+    i = (int64_t)u;
+    if (i < MRB_INT_MIN || i > MRB_INT_MAX) {
+      return mrb_float_value(mrb, (mrb_float)i);
+    }
+    return mrb_fixnum_value((mrb_int)i);
+  default:
+    if (u > (uint64_t)MRB_INT_MAX) {
+      return mrb_float_value(mrb, (mrb_float)u);
+    }
+    return mrb_fixnum_value((mrb_int)u);
+  }
+}
+
+/*
+ * Out of range integers are truncated, as by Array#pack; Floats that are
+ * not finite or do not fit in 64 bits raise RangeError.
+ */
+static void
+io_num_encode(mrb_state *mrb, const struct io_num_type *t, int big, mrb_value v, unsigned char *p)
+{
+  uint64_t u;
+  uint32_t w;
+  mrb_float x;
+  float f;
+  double d;
+  int k;
+
+  if (t->kind == IO_NUM_FLOAT) {
+    x = mrb_to_flo(mrb, v);
+    if (t->size == 4) {
+      f = (float)x;
+      memcpy(&w, &f, sizeof(w));
+      u = w;
+    } else {
+      d = (double)x;
+      memcpy(&u, &d, sizeof(u));
+    }
+  } else if (mrb_float_p(v)) {
+    x = mrb_float(v);
+    /* NaN fails this too; converting it, an infinity or an out of range value is undefined */
+    if (!(x >= -9223372036854775808.0 && x < 18446744073709551616.0)) {
+      mrb_raisef(mrb, E_RANGE_ERROR, "float %S out of range of %S", v, mrb_str_new_cstr(mrb, t->name));
+    }
+    u = (x >= 9223372036854775808.0) ? (uint64_t)x : (uint64_t)(int64_t)x;
+  } else {
+    u = (uint64_t)(int64_t)mrb_fixnum(mrb_to_int(mrb, v));
+  }
+  for (k = 0; k < t->size; k++) {
+    p[big ? t->size - 1 - k : k] = (unsigned char)(u & 0xff);
+    u >>= 8;
+  }
+}
+
+static mrb_value
+io_read_num(mrb_state *mrb, mrb_value io, int type)
+{
+  const struct io_num_type *t = &io_num_types[type];
+  struct mrb_io *fptr = io_get_open_fptr(mrb, io);
+  mrb_value endian = mrb_nil_value(), v;
+  int big;
+
+  mrb_get_args(mrb, "|o", &endian);
+  big = io_num_big(mrb, endian);
+  while (IO_RBUF_LEN(fptr) < t->size && io_rbuf_more(mrb, fptr) > 0)
+    ;
+  if (IO_RBUF_LEN(fptr) < t->size) {
+    mrb_raise(mrb, E_EOF_ERROR, "end of file reached");
+  }
+  v = io_num_decode(mrb, t, big, (const unsigned char *)IO_RBUF_PTR(fptr));
+  io_rbuf_consume(fptr, t->size);
+  return v;
+}
+
+/* IO#read_int8(endian = :little) -> Integer, and so on */
+mrb_value
+mrb_io_read_int8(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_INT8);
+}
+
+mrb_value
+mrb_io_read_uint8(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_UINT8);
+}
+
+mrb_value
+mrb_io_read_int16(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_INT16);
+}
+
+mrb_value
+mrb_io_read_uint16(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_UINT16);
+}
+
+mrb_value
+mrb_io_read_int32(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_INT32);
+}
+
+mrb_value
+mrb_io_read_uint32(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_UINT32);
+}
+
+mrb_value
+mrb_io_read_int64(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_INT64);
+}
+
+mrb_value
+mrb_io_read_uint64(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_UINT64);
+}
+
+mrb_value
+mrb_io_read_float32(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_FLOAT32);
+}
+
+mrb_value
+mrb_io_read_float64(mrb_state *mrb, mrb_value io)
+{
+  return io_read_num(mrb, io, IO_NUM_FLOAT64);
+}
+
+/*
+ * call-seq:
+ *   io.read_array(type, count, endian = :little)  -> Array or nil
+ *
+ * Reads up to count numbers of type (:int8 ... :uint64, :float32,
+ * :float64), decoding them straight out of the read buffer.  Fewer at end
+ * of file, nil if there are none; a trailing partial number is left
+ * unread.
+ */
+mrb_value
+mrb_io_read_array(mrb_state *mrb, mrb_value io)
+{
+  const struct io_num_type *t;
+  struct mrb_io *fptr = io_get_open_fptr(mrb, io);
+  mrb_value type, endian = mrb_nil_value(), ary;
+  const unsigned char *p;
+  mrb_int count, n = 0, take, k;
+  int big, ai;
+
+  mrb_get_args(mrb, "oi|o", &type, &count, &endian);
+  t = io_num_type(mrb, type);
+  big = io_num_big(mrb, endian);
+  if (count < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative count: %S given", mrb_fixnum_value(count));
+  }
+  ary = mrb_ary_new_capa(mrb, count < MRB_IO_BUF_SIZE ? count : MRB_IO_BUF_SIZE);
+  ai = mrb_gc_arena_save(mrb);
+  while (n < count) {
+    while (IO_RBUF_LEN(fptr) < t->size && io_rbuf_more(mrb, fptr) > 0)
+      ;
+    take = IO_RBUF_LEN(fptr) / t->size;
+    if (take == 0) {
+      break;
+    }
+    if (take > count - n) {
+      take = count - n;
+    }
+    p = (const unsigned char *)IO_RBUF_PTR(fptr);
+    for (k = 0; k < take; k++, p += t->size) {
+      mrb_ary_push(mrb, ary, io_num_decode(mrb, t, big, p));
+      mrb_gc_arena_restore(mrb, ai);
+    }
+    io_rbuf_consume(fptr, take * t->size);
+    n += take;
+  }
+  if (n == 0 && count > 0) {
+    return mrb_nil_value();
+  }
+  return ary;
+}
+
+/*
+ * Room for len bytes at the end of the write buffer, flushed first if
+ * they do not fit.  The caller fills them in and calls io_wbuf_commit.
+ */
+static char *
+io_wbuf_reserve(mrb_state *mrb, struct mrb_io *fptr, mrb_int len)
+{
+  struct mrb_io_buf *buf = &fptr->wbuf;
+
+  io_buf_alloc(mrb, buf);
+  if (buf->end + len > buf->capa) {
+    io_flush_wbuf(mrb, fptr, FALSE);
+    if (len > buf->capa) {
+      buf->ptr = (char *)mrb_realloc(mrb, buf->ptr, len);
+      buf->capa = len;
+    }
+  }
+  return buf->ptr + buf->end;
+}
+
+static void
+io_wbuf_commit(struct mrb_io *fptr, mrb_int len)
+{
+  fptr->wbuf.end += len;
+  fptr->pos += len;
+}
+
+/*
+ * call-seq:
+ *   io.write_array(type, ary, endian = :little)  -> Integer
+ *
+ * Writes the numbers in ary as type, encoding them straight into the
+ * write buffer.  Returns the number of bytes written.
+ */
+mrb_value
+mrb_io_write_array(mrb_state *mrb, mrb_value io)
+{
+  const struct io_num_type *t;
+  struct mrb_io *fptr = io_get_write_fptr(mrb, io);
+  mrb_value type, ary, endian = mrb_nil_value();
+  mrb_int i;
+  char *p;
+  int big;
+
+  mrb_get_args(mrb, "oo|o", &type, &ary, &endian);
+  t = io_num_type(mrb, type);
+  big = io_num_big(mrb, endian);
+  ary = mrb_convert_type(mrb, ary, MRB_TT_ARRAY, "Array", "to_ary");
+  io_rbuf_discard(mrb, fptr);
+  for (i = 0; i < RARRAY_LEN(ary); i++) {
+    p = io_wbuf_reserve(mrb, fptr, t->size);
+    io_num_encode(mrb, t, big, RARRAY_PTR(ary)[i], (unsigned char *)p);
+    io_wbuf_commit(fptr, t->size);
+  }
+  if (fptr->sync) {
+    io_flush_wbuf(mrb, fptr, FALSE);
+  }
+  return mrb_fixnum_value(i * t->size);
+}
+
+/*
+ * Formatted numbers, written straight into the write buffer.  Floats are
+ * formatted with "%.*f" and a precision of at most IO_FLOAT_PREC_MAX, so
+ * that IO_FLOAT_MAX bytes always hold one.
+ */
+#define IO_FLOAT_PREC_MAX 20
+#define IO_FLOAT_MAX (1 + DBL_MAX_10_EXP + 2 + IO_FLOAT_PREC_MAX + 1)
+
+static void
+io_wbuf_put(mrb_state *mrb, struct mrb_io *fptr, const char *ptr, mrb_int len)
+{
+  struct mrb_io_buf *buf = &fptr->wbuf;
+  mrb_int n;
+
+  while (len > 0) {
+    io_wbuf_reserve(mrb, fptr, 1);
+    n = buf->capa - buf->end;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(buf->ptr + buf->end, ptr, n);
+    io_wbuf_commit(fptr, n);
+    ptr += n;
+    len -= n;
+  }
+}
+
+static mrb_int
+io_put_int(mrb_state *mrb, struct mrb_io *fptr, mrb_int i)
+{
+  char tmp[sizeof(mrb_int) * 3 + 1], *p;
+  uint64_t u;
+  mrb_int len;
+
+  /* negate as unsigned so that MRB_INT_MIN works */
+  u = (i < 0) ? 0 - (uint64_t)i : (uint64_t)i;
+  p = tmp + sizeof(tmp);
+  do {
+    *--p = '0' + (char)(u % 10);
+    u /= 10;
+  } while (u > 0);
+  if (i < 0) {
+    *--p = '-';
+  }
+  len = tmp + sizeof(tmp) - p;
+  memcpy(io_wbuf_reserve(mrb, fptr, len), p, len);
+  io_wbuf_commit(fptr, len);
+  return len;
+}
+
+static mrb_int
+io_put_float(mrb_state *mrb, struct mrb_io *fptr, mrb_float f, int prec)
+{
+  char *p;
+  int len;
+
+  if (isnan(f)) {
+    io_wbuf_put(mrb, fptr, "NaN", 3);
+    return 3;
+  }
+  if (isinf(f)) {
+    if (f < 0) {
+      io_wbuf_put(mrb, fptr, "-Infinity", 9);
+      return 9;
+    }
+    io_wbuf_put(mrb, fptr, "Infinity", 8);
+    return 8;
+  }
+  p = io_wbuf_reserve(mrb, fptr, IO_FLOAT_MAX);
+  len = snprintf(p, IO_FLOAT_MAX, "%.*f", prec, (double)f);
+  io_wbuf_commit(fptr, len);
+  return len;
+}
+
+static int
+io_float_prec(mrb_state *mrb, mrb_value prec)
+{
+  mrb_int n;
+
+  if (mrb_nil_p(prec)) {
+    return 6;
+  }
+  n = mrb_fixnum(mrb_to_int(mrb, prec));
+  if (n < 0 || n > IO_FLOAT_PREC_MAX) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "precision out of range: %S", prec);
+  }
+  return (int)n;
+}
+
+static struct mrb_io *
+io_get_format_fptr(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr = io_get_write_fptr(mrb, io);
+
+  io_rbuf_discard(mrb, fptr);
+  return fptr;
+}
+
+static void
+io_format_done(mrb_state *mrb, struct mrb_io *fptr)
+{
+  if (fptr->sync) {
+    io_flush_wbuf(mrb, fptr, FALSE);
+  }
+}
+
+/* IO#write_int(i) -> Integer; i in decimal, as i.to_s */
+mrb_value
+mrb_io_write_int(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  mrb_int i, len;
+
+  mrb_get_args(mrb, "i", &i);
+  fptr = io_get_format_fptr(mrb, io);
+  len = io_put_int(mrb, fptr, i);
+  io_format_done(mrb, fptr);
+  return mrb_fixnum_value(len);
+}
+
+/*
+ * call-seq:
+ *   io.write_float(f, precision = 6)  -> Integer
+ *
+ * Writes f with precision digits after the point, as
+ * io.printf("%.*f", precision, f) would; NaN and Infinity as Float#to_s.
+ */
+mrb_value
+mrb_io_write_float(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  mrb_value prec = mrb_nil_value();
+  mrb_float f;
+  mrb_int len;
+  int digits;
+
+  mrb_get_args(mrb, "f|o", &f, &prec);
+  digits = io_float_prec(mrb, prec);
+  fptr = io_get_format_fptr(mrb, io);
+  len = io_put_float(mrb, fptr, f, digits);
+  io_format_done(mrb, fptr);
+  return mrb_fixnum_value(len);
+}
+
+/*
+ * call-seq:
+ *   io.write_row(values, sep = ",", precision = 6)  -> Integer
+ *
+ * Writes values separated by sep and a newline.  Integers and Floats are
+ * formatted as by write_int and write_float, Strings are copied, nil is
+ * an empty field and anything else is written as to_s.
+ */
+mrb_value
+mrb_io_write_row(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  mrb_value ary, sep = mrb_nil_value(), prec = mrb_nil_value(), v;
+  const char *sptr = ",";
+  mrb_int slen = 1, i, len = 0;
+  int digits, ai;
+
+  mrb_get_args(mrb, "o|oo", &ary, &sep, &prec);
+  ary = mrb_convert_type(mrb, ary, MRB_TT_ARRAY, "Array", "to_ary");
+  if (!mrb_nil_p(sep)) {
+    sep = mrb_convert_type(mrb, sep, MRB_TT_STRING, "String", "to_str");
+    sptr = RSTRING_PTR(sep);
+    slen = RSTRING_LEN(sep);
+  }
+  digits = io_float_prec(mrb, prec);
+  fptr = io_get_format_fptr(mrb, io);
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < RARRAY_LEN(ary); i++) {
+    if (i > 0) {
+      io_wbuf_put(mrb, fptr, sptr, slen);
+      len += slen;
+    }
+    v = RARRAY_PTR(ary)[i];
+    switch (mrb_type(v)) {
+    case MRB_TT_FIXNUM:
+      len += io_put_int(mrb, fptr, mrb_fixnum(v));
+      break;
+    case MRB_TT_FLOAT:
+      len += io_put_float(mrb, fptr, mrb_float(v), digits);
+      break;
+    default:
+      if (mrb_nil_p(v)) {
+        break;
       }
+      if (!mrb_string_p(v)) {
+        v = mrb_obj_as_string(mrb, v);
+      }
+      io_wbuf_put(mrb, fptr, RSTRING_PTR(v), RSTRING_LEN(v));
+      len += RSTRING_LEN(v);
+      mrb_gc_arena_restore(mrb, ai);
       break;
+    }
   }
-
-  return buf;
+  io_wbuf_put(mrb, fptr, "\n", 1);
+  io_format_done(mrb, fptr);
+  return mrb_fixnum_value(len + 1);
 }
 
-mrb_value
-mrb_io_sysseek(mrb_state *mrb, mrb_value io)
+#define IO_COPY_CHUNK (1 << 30)
+
+/*
+ * Copy from in to out inside the kernel: copy_file_range(2) first, then
+ * sendfile(2) for fd pairs it refuses.  off is the source offset, or NULL
+ * to read at the fd position.  Returns 1 when done, 0 when the kernel
+ * cannot copy between these fds (any progress is kept in *copied) and -1
+ * on error.  Each call counts as a write of out; the bytes also count as
+ * read from in.
+ */
+static int
+io_copy_kernel(mrb_state *mrb, struct mrb_io *fin, struct mrb_io *fout, off_t *off, mrb_int len, mrb_int *copied)
 {
-  struct mrb_io *fptr;
-  int pos;
-  mrb_int offset, whence = -1;
+#if defined(MRB_IO_POSIX) && defined(__linux__)
+  int in = fin->fd, out = io_write_fd(fout);
+  size_t chunk;
+  ssize_t n;
+  uint64_t t0;
+#ifdef __NR_copy_file_range
+  loff_t loff;
+  int use_cfr = TRUE;
+#endif
 
-  mrb_get_args(mrb, "i|i", &offset, &whence);
-  if (whence < 0) {
-    whence = 0;
+  for (;;) {
+    chunk = (len < 0 || len - *copied > IO_COPY_CHUNK) ? IO_COPY_CHUNK : (size_t)(len - *copied);
+    if (chunk == 0) {
+      return 1;
+    }
+    t0 = io_stats_clock(mrb, fout);
+#ifdef __NR_copy_file_range
+    if (use_cfr) {
+      if (off != NULL) {
+        loff = *off;
+      }
+      n = syscall(__NR_copy_file_range, in, off ? &loff : NULL, out, NULL, chunk, 0);
+      io_stats_add(mrb, fout, MRB_IO_TRACE_WRITE, out, NULL, chunk, n, t0);
+      if (n < 0) {
+        switch (errno) {
+        case EINTR:
+          continue;
+        case ENOSYS: case EXDEV: case EINVAL: case EBADF: case EOPNOTSUPP:
+          use_cfr = FALSE;
+          continue;
+        }
+        return -1;
+      }
+      if (n == 0 && *copied == 0) {
+        /* pseudo files report no data to copy_file_range; ask sendfile */
+        use_cfr = FALSE;
+        continue;
+      }
+      if (off != NULL) {
+        *off = loff;
+      }
+    }
+    else
+#endif
+    {
+      n = sendfile(out, in, off, chunk);
+      io_stats_add(mrb, fout, MRB_IO_TRACE_WRITE, out, NULL, chunk, n, t0);
+      if (n < 0) {
+        switch (errno) {
+        case EINTR:
+          continue;
+        case ENOSYS: case EINVAL:
+          return 0;
+        }
+        return -1;
+      }
+    }
+    if (n == 0) {
+      return 1;
+    }
+    fin->stats.read_bytes += n;
+    if (fin->reg) {
+      fin->reg->stats.read_bytes += n;
+    }
+    *copied += n;
   }
+#else
+  return 0;
+#endif
+}
 
-  fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
-  pos = lseek(fptr->fd, offset, whence);
-  if (pos < 0) {
-    mrb_raise(mrb, E_IO_ERROR, "sysseek faield");
+/* read/write copy through buf; returns 0 when done and -1 on error */
+static int
+io_copy_bounce(mrb_state *mrb, struct mrb_io *fin, struct mrb_io *fout, off_t *off, mrb_int len, char *buf, mrb_int capa, mrb_int *copied)
+{
+  int in = fin->fd, out = io_write_fd(fout);
+  mrb_int want;
+  int n;
+
+  for (;;) {
+    want = (len < 0 || len - *copied > capa) ? capa : len - *copied;
+    if (want == 0) {
+      return 0;
+    }
+    n = (off != NULL) ? io_pread(mrb, fin, in, buf, want, *off) : io_sys_read(mrb, fin, in, buf, want);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    if (io_write_fully(mrb, fout, out, buf, n, NULL) != 0) {
+      return -1;
+    }
+    if (off != NULL) {
+      *off += n;
+    }
+    *copied += n;
   }
-
-  return mrb_fixnum_value(pos);
 }
 
+/*
+ * IO._copy_stream(src, dst, length = nil, src_offset = nil) -> Integer
+ *
+ * Backend of IO.copy_stream for two open IOs.  Data already sitting in
+ * src's read buffer is written out first; the rest moves between the file
+ * descriptors in the kernel where possible, and otherwise through dst's
+ * write buffer, so no Strings are created.  With src_offset the source
+ * is read at that offset and its position is left alone.
+ */
 mrb_value
-mrb_io_syswrite(mrb_state *mrb, mrb_value io)
+mrb_io_s_copy_stream(mrb_state *mrb, mrb_value klass)
 {
-  struct mrb_io *fptr;
-  mrb_value str, buf;
-  int fd, length;
-
-  fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
-  if (! fptr->writable) {
-    mrb_raise(mrb, E_IO_ERROR, "not opened for writing");
+  mrb_value src, dst, length = mrb_nil_value(), src_offset = mrb_nil_value();
+  struct mrb_io *in, *out;
+  mrb_int len = -1, copied = 0, drained = 0;
+  off_t off, *offp = NULL;
+  off_t saved = 0;
+  int ret = 0;
+
+  mrb_get_args(mrb, "oo|oo", &src, &dst, &length, &src_offset);
+  in = io_get_open_fptr(mrb, src);
+  out = io_get_write_fptr(mrb, dst);
+  if (!mrb_nil_p(length)) {
+    len = mrb_fixnum(mrb_to_int(mrb, length));
+    if (len < 0) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative length: %S given", length);
+    }
+  }
+  if (!mrb_nil_p(src_offset)) {
+    off = mrb_fixnum(mrb_to_int(mrb, src_offset));
+    if (off < 0) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative offset: %S given", src_offset);
+    }
+    offp = &off;
   }
 
-  mrb_get_args(mrb, "S", &str);
-  if (mrb_type(str) != MRB_TT_STRING) {
-    buf = mrb_funcall(mrb, str, "to_s", 0);
-  } else {
-    buf = str;
+  io_flush_wbuf(mrb, in, FALSE);
+  io_flush_wbuf(mrb, out, FALSE);
+  io_rbuf_discard(mrb, out);
+
+  if (offp == NULL && IO_RBUF_LEN(in) > 0) {
+    drained = IO_RBUF_LEN(in);
+    if (len >= 0 && drained > len) {
+      drained = len;
+    }
+    if (io_write_fully(mrb, out, io_write_fd(out), IO_RBUF_PTR(in), drained, NULL) != 0) {
+      mrb_sys_fail(mrb, "copy_stream");
+    }
+    io_rbuf_consume(in, drained);
+    copied = drained;
   }
 
-  if (fptr->fd2 == -1) {
-    fd = fptr->fd;
-  } else {
-    fd = fptr->fd2;
+  if (mrb_io_sys_native(in->fd) && mrb_io_sys_native(io_write_fd(out))) {
+    ret = io_copy_kernel(mrb, in, out, offp, len, &copied);
+  }
+  if (ret == 0) {
+    io_buf_alloc(mrb, &out->wbuf);
+    if (offp != NULL && !mrb_io_sys_native(in->fd)) {
+      /* no pread on this backend: seek there once and back at the end */
+      saved = io_sys_seek(mrb, in, in->fd, 0, SEEK_CUR);
+      io_sys_seek(mrb, in, in->fd, off, SEEK_SET);
+      ret = io_copy_bounce(mrb, in, out, NULL, len, out->wbuf.ptr, out->wbuf.capa, &copied);
+      io_sys_seek(mrb, in, in->fd, saved, SEEK_SET);
+    } else {
+      ret = io_copy_bounce(mrb, in, out, offp, len, out->wbuf.ptr, out->wbuf.capa, &copied);
+    }
+  }
+  out->pos += copied;
+  IO_WROTE(out);
+  if (offp == NULL) {
+    in->pos += copied - drained;
   }
-  length = write(fd, RSTRING_PTR(buf), RSTRING_LEN(buf));
+  if (ret < 0) {
+    mrb_sys_fail(mrb, "copy_stream");
+  }
+  return mrb_fixnum_value(copied);
+}
 
-  return mrb_fixnum_value(length);
+mrb_value
+mrb_io_flush(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+
+  fptr = io_get_open_fptr(mrb, io);
+  io_flush_wbuf(mrb, fptr, FALSE);
+  return io;
 }
 
 mrb_value
@@ -395,6 +3017,251 @@ mrb_io_fileno(mrb_state *mrb, mrb_value io)
   return mrb_fixnum_value(fptr->fd);
 }
 
+#ifdef MRB_IO_POSIX
+/* seconds (Integer or Float; nil waits forever) as a poll(2) timeout */
+static int
+io_timeout_ms(mrb_state *mrb, mrb_value timeout)
+{
+  mrb_float sec;
+  int ms;
+
+  if (mrb_nil_p(timeout)) {
+    return -1;
+  }
+  sec = mrb_to_flo(mrb, timeout);
+  if (sec < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "time interval must not be negative");
+  }
+  if (sec >= INT_MAX / 1000) {
+    return INT_MAX;
+  }
+  ms = (int)(sec * 1000);
+  if (ms == 0 && sec > 0) {
+    ms = 1;
+  }
+  return ms;
+}
+
+/* poll(2), restarted after signals; returns the poll result */
+static int
+io_poll(mrb_state *mrb, struct pollfd *fds, int nfds, int ms)
+{
+  int n;
+
+  do {
+    n = poll(fds, nfds, ms);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    mrb_sys_fail(mrb, "poll");
+  }
+  return n;
+}
+
+static mrb_value
+io_wait(mrb_state *mrb, mrb_value io, short events)
+{
+  struct mrb_io *fptr;
+  struct pollfd pfd;
+  mrb_value timeout = mrb_nil_value();
+
+  mrb_get_args(mrb, "|o", &timeout);
+  fptr = io_get_open_fptr(mrb, io);
+  if (events == POLLIN) {
+    if (IO_RBUF_LEN(fptr) > 0) {
+      return io;
+    }
+    pfd.fd = fptr->fd;
+  } else {
+    io_flush_wbuf(mrb, fptr, FALSE);
+    pfd.fd = io_write_fd(fptr);
+  }
+  if (!mrb_io_sys_native(pfd.fd)) {
+    /* backend files are always ready, and poll(2) does not know them */
+    return io;
+  }
+  pfd.events = events;
+  pfd.revents = 0;
+  if (io_poll(mrb, &pfd, 1, io_timeout_ms(mrb, timeout)) == 0) {
+    return mrb_nil_value();
+  }
+  return io;
+}
+#endif
+
+/*
+ * call-seq:
+ *   IO._pipe  -> [read_io, write_io]
+ */
+mrb_value
+mrb_io_s_pipe(mrb_state *mrb, mrb_value klass)
+{
+#ifdef MRB_IO_POSIX
+  struct RClass *c = mrb_class_ptr(klass);
+  struct mrb_io *fptr;
+  mrb_value r, w;
+  int pipes[2];
+
+  if (!io_registry_room(mrb, 2)) {
+    errno = EMFILE;
+    mrb_sys_fail(mrb, "pipe");
+  }
+  if (pipe(pipes) == -1) {
+    if (errno != EMFILE && errno != ENFILE) {
+      mrb_sys_fail(mrb, "pipe");
+    }
+    io_reclaim(mrb);
+    if (pipe(pipes) == -1) {
+      mrb_sys_fail(mrb, "pipe");
+    }
+  }
+
+  r = mrb_obj_value(Data_Wrap_Struct(mrb, c, &mrb_io_type, NULL));
+  fptr = mrb_io_alloc(mrb);
+  fptr->fd = pipes[0];
+  DATA_PTR(r) = fptr;
+  io_register(mrb, fptr);
+
+  w = mrb_obj_value(Data_Wrap_Struct(mrb, c, &mrb_io_type, NULL));
+  fptr = mrb_io_alloc(mrb);
+  fptr->fd = pipes[1];
+  fptr->writable = 1;
+  fptr->sync = 1;
+  DATA_PTR(w) = fptr;
+  io_register(mrb, fptr);
+
+  return mrb_assoc_new(mrb, r, w);
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "IO.pipe is not supported on the platform");
+  return mrb_nil_value();
+#endif
+}
+
+/*
+ * call-seq:
+ *   IO.select(reads, writes = nil, errs = nil, timeout = nil)  -> [reads, writes, errs] or nil
+ *
+ * Waits with a single poll(2) over all the given IOs.  IOs with data in
+ * their read buffer, and files on a backend other than the OS's (which
+ * are always ready and unknown to poll), are reported readable or
+ * writable without blocking.
+ */
+mrb_value
+mrb_io_s_select(mrb_state *mrb, mrb_value klass)
+{
+#ifdef MRB_IO_POSIX
+  static const short events[3] = { POLLIN, POLLOUT, POLLPRI };
+  mrb_value *argv, sets[3], result, ready, store;
+  mrb_int argc, i, j, n = 0, k;
+  struct mrb_io *fptr;
+  struct pollfd *fds;
+  int ready_now = 0, ms;
+  short revents;
+
+  mrb_get_args(mrb, "*", &argv, &argc);
+  if (argc < 1 || argc > 4) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (%S for 1..4)", mrb_fixnum_value(argc));
+  }
+  for (i = 0; i < 3; i++) {
+    sets[i] = (i < argc) ? argv[i] : mrb_nil_value();
+    if (!mrb_nil_p(sets[i])) {
+      sets[i] = mrb_convert_type(mrb, sets[i], MRB_TT_ARRAY, "Array", "to_ary");
+      n += RARRAY_LEN(sets[i]);
+    }
+  }
+  ms = io_timeout_ms(mrb, (argc > 3) ? argv[3] : mrb_nil_value());
+
+  store = mrb_str_buf_new(mrb, sizeof(struct pollfd) * (n > 0 ? n : 1));
+  fds = (struct pollfd *)RSTRING_PTR(store);
+  k = 0;
+  for (i = 0; i < 3; i++) {
+    if (mrb_nil_p(sets[i])) {
+      continue;
+    }
+    for (j = 0; j < RARRAY_LEN(sets[i]); j++, k++) {
+      fptr = io_get_open_fptr(mrb, RARRAY_PTR(sets[i])[j]);
+      if (i == 1) {
+        io_flush_wbuf(mrb, fptr, FALSE);
+      }
+      fds[k].fd = (i == 1) ? io_write_fd(fptr) : fptr->fd;
+      fds[k].events = events[i];
+      fds[k].revents = 0;
+      if (!mrb_io_sys_native(fds[k].fd)) {
+        /* a negative fd is skipped by poll(2) */
+        fds[k].fd = -1;
+        if (i < 2) {
+          ready_now = 1;
+        }
+      }
+      if (i == 0 && IO_RBUF_LEN(fptr) > 0) {
+        ready_now = 1;
+      }
+    }
+  }
+
+  if (io_poll(mrb, fds, n, ready_now ? 0 : ms) == 0 && !ready_now) {
+    return mrb_nil_value();
+  }
+
+  result = mrb_ary_new_capa(mrb, 3);
+  k = 0;
+  for (i = 0; i < 3; i++) {
+    ready = mrb_ary_new(mrb);
+    mrb_ary_push(mrb, result, ready);
+    if (mrb_nil_p(sets[i])) {
+      continue;
+    }
+    for (j = 0; j < RARRAY_LEN(sets[i]); j++, k++) {
+      revents = fds[k].revents;
+      if (fds[k].fd < 0) {
+        revents = (i < 2) ? events[i] : 0;
+      }
+      if (i < 2) {
+        /* hangups and errors wake readers and writers so they see them */
+        revents &= events[i] | POLLHUP | POLLERR;
+      } else {
+        revents &= events[i];
+      }
+      if (revents != 0 ||
+          (i == 0 && IO_RBUF_LEN(io_get_open_fptr(mrb, RARRAY_PTR(sets[i])[j])) > 0)) {
+        mrb_ary_push(mrb, ready, RARRAY_PTR(sets[i])[j]);
+      }
+    }
+  }
+  return result;
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "IO.select is not supported on the platform");
+  return mrb_nil_value();
+#endif
+}
+
+/*
+ * call-seq:
+ *   io.wait_readable(timeout = nil)  -> io or nil
+ *
+ * Returns nil if nothing became readable within timeout seconds.
+ */
+mrb_value
+mrb_io_wait_readable(mrb_state *mrb, mrb_value io)
+{
+#ifdef MRB_IO_POSIX
+  return io_wait(mrb, io, POLLIN);
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "IO#wait_readable is not supported on the platform");
+  return mrb_nil_value();
+#endif
+}
+
+mrb_value
+mrb_io_wait_writable(mrb_state *mrb, mrb_value io)
+{
+#ifdef MRB_IO_POSIX
+  return io_wait(mrb, io, POLLOUT);
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "IO#wait_writable is not supported on the platform");
+  return mrb_nil_value();
+#endif
+}
+
 mrb_value
 mrb_io_close_on_exec_p(mrb_state *mrb, mrb_value io)
 {
@@ -421,6 +3288,9 @@ mrb_io_set_sync(mrb_state *mrb, mrb_value self)
   }
 
   mrb_get_args(mrb, "b", &b);
+  if (b) {
+    io_flush_wbuf(mrb, fptr, FALSE);
+  }
   fptr->sync = b;
   return mrb_bool_value(b);
 }
@@ -437,22 +3307,201 @@ mrb_io_sync(mrb_state *mrb, mrb_value self)
   return mrb_bool_value(fptr->sync);
 }
 
+/* IO.open_count -> Integer; IOs currently holding a descriptor */
+mrb_value
+mrb_io_s_open_count(mrb_state *mrb, mrb_value klass)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+
+  return mrb_fixnum_value(reg ? reg->count : 0);
+}
+
+/* IO.max_open -> Integer or nil */
+mrb_value
+mrb_io_s_max_open(mrb_state *mrb, mrb_value klass)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+
+  if (reg == NULL || reg->max == 0) {
+    return mrb_nil_value();
+  }
+  return mrb_fixnum_value(reg->max);
+}
+
+/* IO.max_open = n; nil removes the cap */
+mrb_value
+mrb_io_s_set_max_open(mrb_state *mrb, mrb_value klass)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+  mrb_value max;
+
+  mrb_get_args(mrb, "o", &max);
+  if (mrb_nil_p(max)) {
+    reg->max = 0;
+  } else {
+    reg->max = mrb_fixnum(mrb_to_int(mrb, max));
+    if (reg->max <= 0) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid max_open: %S", max);
+    }
+  }
+  return max;
+}
+
+/* a counter as an Integer, or a Float once it outgrows Fixnum */
+static mrb_value
+io_stats_num(mrb_state *mrb, uint64_t n)
+{
+  if (n > (uint64_t)MRB_INT_MAX) {
+    return mrb_float_value(mrb, (mrb_float)n);
+  }
+  return mrb_fixnum_value((mrb_int)n);
+}
+
+static mrb_value
+io_stats_hash(mrb_state *mrb, const struct mrb_io_stats *st)
+{
+  mrb_value hash = mrb_hash_new(mrb);
+
+#define IO_STATS_SET(name, v) mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, name)), (v))
+  IO_STATS_SET("reads",          io_stats_num(mrb, st->reads));
+  IO_STATS_SET("writes",         io_stats_num(mrb, st->writes));
+  IO_STATS_SET("read_bytes",     io_stats_num(mrb, st->read_bytes));
+  IO_STATS_SET("write_bytes",    io_stats_num(mrb, st->write_bytes));
+  IO_STATS_SET("short_reads",    io_stats_num(mrb, st->short_reads));
+  IO_STATS_SET("seeks",          io_stats_num(mrb, st->seeks));
+  IO_STATS_SET("refills",        io_stats_num(mrb, st->refills));
+  IO_STATS_SET("opens",          io_stats_num(mrb, st->opens));
+  IO_STATS_SET("closes",         io_stats_num(mrb, st->closes));
+  IO_STATS_SET("emfile_retries", io_stats_num(mrb, st->emfile_retries));
+  IO_STATS_SET("sys_time",       mrb_float_value(mrb, (mrb_float)st->sys_nsec / 1e9));
+#undef IO_STATS_SET
+  return hash;
+}
+
+/*
+ * call-seq:
+ *   IO.stats  -> Hash
+ *
+ * Syscalls made by every IO of this interpreter since start up or the
+ * last IO.reset_stats: :reads, :writes, :read_bytes, :write_bytes,
+ * :short_reads, :seeks, :refills (of read buffers), :opens, :closes,
+ * :emfile_retries and :sys_time (seconds spent in those calls, measured
+ * only while IO.stats_timing is on or a trace hook is installed).
+ */
+mrb_value
+mrb_io_s_stats(mrb_state *mrb, mrb_value klass)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+  struct mrb_io_stats zero;
+
+  if (reg == NULL) {
+    memset(&zero, 0, sizeof(zero));
+    return io_stats_hash(mrb, &zero);
+  }
+  return io_stats_hash(mrb, &reg->stats);
+}
+
+mrb_value
+mrb_io_s_reset_stats(mrb_state *mrb, mrb_value klass)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+
+  if (reg != NULL) {
+    memset(&reg->stats, 0, sizeof(reg->stats));
+  }
+  return mrb_nil_value();
+}
+
+/* IO.stats_timing -> true or false */
+mrb_value
+mrb_io_s_stats_timing(mrb_state *mrb, mrb_value klass)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+
+  return mrb_bool_value(reg != NULL && reg->timing);
+}
+
+/* IO.stats_timing = bool; clock every syscall for :sys_time */
+mrb_value
+mrb_io_s_set_stats_timing(mrb_state *mrb, mrb_value klass)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+  mrb_bool timing;
+
+  mrb_get_args(mrb, "b", &timing);
+  if (reg != NULL) {
+    reg->timing = timing;
+  }
+  return mrb_bool_value(timing);
+}
+
+/* IO#stats -> Hash; as IO.stats, for the syscalls made for this IO */
+mrb_value
+mrb_io_stats(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+  struct mrb_io_stats zero;
+
+  fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
+  if (fptr == NULL) {
+    memset(&zero, 0, sizeof(zero));
+    return io_stats_hash(mrb, &zero);
+  }
+  return io_stats_hash(mrb, &fptr->stats);
+}
+
+mrb_value
+mrb_io_reset_stats(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io *fptr;
+
+  fptr = (struct mrb_io *)mrb_get_datatype(mrb, io, &mrb_io_type);
+  if (fptr != NULL) {
+    memset(&fptr->stats, 0, sizeof(fptr->stats));
+  }
+  return io;
+}
+
 void
 mrb_init_io(mrb_state *mrb)
 {
   struct RClass *io;
+  struct mrb_io_registry *reg;
 
   io      = mrb_define_class(mrb, "IO", mrb->object_class);
   MRB_SET_INSTANCE_TT(io, MRB_TT_DATA);
 
+  reg = (struct mrb_io_registry *)mrb_malloc(mrb, sizeof(struct mrb_io_registry));
+  reg->head = NULL;
+  reg->count = 0;
+  reg->max = 0;
+  reg->writes = 0;
+  memset(&reg->stats, 0, sizeof(reg->stats));
+  reg->timing = FALSE;
+  reg->trace = NULL;
+  reg->trace_ud = NULL;
+  mrb_obj_iv_set(mrb, (struct RObject *)io, mrb_intern_lit(mrb, "__registry__"), mrb_cptr_value(mrb, reg));
+
   mrb_include_module(mrb, io, mrb_module_get(mrb, "Enumerable")); /* 15.2.20.3 */
   mrb_define_class_method(mrb, io, "for_fd",  mrb_io_s_for_fd,   MRB_ARGS_ANY());
   mrb_define_class_method(mrb, io, "sysopen", mrb_io_s_sysopen, MRB_ARGS_ANY());
+  mrb_define_class_method(mrb, io, "_sysclose", mrb_io_s_sysclose, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, io, "_read_file", mrb_io_s_read_file, MRB_ARGS_ARG(1, 2));
+  mrb_define_class_method(mrb, io, "_copy_stream", mrb_io_s_copy_stream, MRB_ARGS_ARG(2, 2));
+  mrb_define_class_method(mrb, io, "_pipe",   mrb_io_s_pipe,    MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, io, "select",  mrb_io_s_select,  MRB_ARGS_ARG(1, 3));
+  mrb_define_class_method(mrb, io, "open_count", mrb_io_s_open_count, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, io, "max_open",   mrb_io_s_max_open,   MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, io, "max_open=",  mrb_io_s_set_max_open, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, io, "stats",      mrb_io_s_stats,      MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, io, "reset_stats", mrb_io_s_reset_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, io, "stats_timing",  mrb_io_s_stats_timing,     MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, io, "stats_timing=", mrb_io_s_set_stats_timing, MRB_ARGS_REQ(1));
 
   mrb_define_method(mrb, io, "initialize", mrb_io_initialize, MRB_ARGS_ANY());    /* 15.2.20.5.21 (x)*/
   mrb_define_method(mrb, io, "sync",       mrb_io_sync,       MRB_ARGS_NONE());
   mrb_define_method(mrb, io, "sync=",      mrb_io_set_sync,   MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, io, "sysread",    mrb_io_sysread,    MRB_ARGS_ANY());
+  mrb_define_method(mrb, io, "sysread",    mrb_io_sysread,    MRB_ARGS_ARG(1, 2));
   mrb_define_method(mrb, io, "sysseek",    mrb_io_sysseek,    MRB_ARGS_REQ(1));
   mrb_define_method(mrb, io, "syswrite",   mrb_io_syswrite,   MRB_ARGS_REQ(1));
   mrb_define_method(mrb, io, "close",      mrb_io_close,      MRB_ARGS_NONE());   /* 15.2.20.5.1 */
@@ -461,7 +3510,80 @@ mrb_init_io(mrb_state *mrb)
   mrb_define_method(mrb, io, "closed?",    mrb_io_closed,     MRB_ARGS_NONE());   /* 15.2.20.5.2 */
   mrb_define_method(mrb, io, "pid",        mrb_io_pid,        MRB_ARGS_NONE());   /* 15.2.20.5.2 */
   mrb_define_method(mrb, io, "fileno",     mrb_io_fileno,     MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "stats",      mrb_io_stats,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "reset_stats", mrb_io_reset_stats, MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "read",       mrb_io_read,       MRB_ARGS_OPT(2));   /* 15.2.20.5.14 */
+  mrb_define_method(mrb, io, "readpartial", mrb_io_readpartial, MRB_ARGS_ARG(1, 2));
+  mrb_define_method(mrb, io, "read_nonblock", mrb_io_read_nonblock, MRB_ARGS_ARG(1, 2));
+  mrb_define_method(mrb, io, "write_nonblock", mrb_io_write_nonblock, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, io, "nonblock=",  mrb_io_set_nonblock, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, io, "nonblock?",  mrb_io_nonblock_p,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "wait_readable", mrb_io_wait_readable, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "wait_writable", mrb_io_wait_writable, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "eof?",       mrb_io_eof,        MRB_ARGS_NONE());   /* 15.2.20.5.6 */
+  mrb_define_method(mrb, io, "eof",        mrb_io_eof,        MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "readline",   mrb_io_readline,   MRB_ARGS_ANY());    /* 15.2.20.5.16 */
+  mrb_define_method(mrb, io, "gets",       mrb_io_gets,       MRB_ARGS_ANY());    /* 15.2.20.5.9 */
+  mrb_define_method(mrb, io, "readlines",  mrb_io_readlines,  MRB_ARGS_ANY());    /* 15.2.20.5.17 */
+  mrb_define_method(mrb, io, "each",       mrb_io_each_line,  MRB_ARGS_ANY());    /* 15.2.20.5.3 */
+  mrb_define_method(mrb, io, "each_line",  mrb_io_each_line,  MRB_ARGS_ANY());    /* 15.2.20.5.5 */
+  mrb_define_method(mrb, io, "readchar",   mrb_io_readchar,   MRB_ARGS_NONE());   /* 15.2.20.5.15 */
+  mrb_define_method(mrb, io, "getc",       mrb_io_getc,       MRB_ARGS_NONE());   /* 15.2.20.5.8 */
+  mrb_define_method(mrb, io, "getbyte",    mrb_io_getbyte,    MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "readbyte",   mrb_io_readbyte,   MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "read_int8",    mrb_io_read_int8,    MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_uint8",   mrb_io_read_uint8,   MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_int16",   mrb_io_read_int16,   MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_uint16",  mrb_io_read_uint16,  MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_int32",   mrb_io_read_int32,   MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_uint32",  mrb_io_read_uint32,  MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_int64",   mrb_io_read_int64,   MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_uint64",  mrb_io_read_uint64,  MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_float32", mrb_io_read_float32, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_float64", mrb_io_read_float64, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, io, "read_array",   mrb_io_read_array,   MRB_ARGS_ARG(2, 1));
+  mrb_define_method(mrb, io, "write_array",  mrb_io_write_array,  MRB_ARGS_ARG(2, 1));
+  mrb_define_method(mrb, io, "write_int",    mrb_io_write_int,    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, io, "write_float",  mrb_io_write_float,  MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, io, "write_row",    mrb_io_write_row,    MRB_ARGS_ARG(1, 2));
+  mrb_define_method(mrb, io, "each_byte",  mrb_io_each_byte,  MRB_ARGS_BLOCK());  /* 15.2.20.5.4 */
+  mrb_define_method(mrb, io, "each_char",  mrb_io_each_char,  MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, io, "pos",        mrb_io_pos,        MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "tell",       mrb_io_pos,        MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "seek",       mrb_io_seek,       MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, io, "write",      mrb_io_write,      MRB_ARGS_ANY());    /* 15.2.20.5.20 */
+  mrb_define_method(mrb, io, "<<",         mrb_io_lshift,     MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, io, "print",      mrb_io_print,      MRB_ARGS_ANY());    /* 15.2.20.5.11 */
+  mrb_define_method(mrb, io, "puts",       mrb_io_puts,       MRB_ARGS_ANY());    /* 15.2.20.5.13 */
+  mrb_define_method(mrb, io, "flush",      mrb_io_flush,      MRB_ARGS_NONE());   /* 15.2.20.5.7 */
+  mrb_define_method(mrb, io, "_read_buf",  mrb_io_read_buf,   MRB_ARGS_NONE());
+  mrb_define_method(mrb, io, "_ungets",    mrb_io_ungets,     MRB_ARGS_REQ(1));
 
 
   mrb_gv_set(mrb, mrb_intern_cstr(mrb, "$/"), mrb_str_new_cstr(mrb, "\n"));
 }
+
+/*
+ * Flush every registered IO while the heap is still intact, and detach
+ * them from the registry, which goes away before they are collected.
+ */
+void
+mrb_final_io(mrb_state *mrb)
+{
+  struct mrb_io_registry *reg = io_registry(mrb);
+  struct mrb_io *fptr, *next;
+
+  if (reg == NULL) {
+    return;
+  }
+  for (fptr = reg->head; fptr != NULL; fptr = next) {
+    next = fptr->reg_next;
+    if (fptr->fd >= 0) {
+      io_flush_wbuf(mrb, fptr, TRUE);
+    }
+    fptr->reg = NULL;
+    fptr->reg_prev = fptr->reg_next = NULL;
+  }
+  mrb_obj_iv_set(mrb, (struct RObject *)mrb_class_get(mrb, "IO"), mrb_intern_lit(mrb, "__registry__"), mrb_nil_value());
+  mrb_free(mrb, reg);
+}
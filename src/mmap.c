@@ -0,0 +1,312 @@
+/*
+** mmap.c - IO::Mmap class
+*/
+
+#include "mruby.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/string.h"
+#include "mruby/ext/io.h"
+
+#include "mruby/error.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef MRB_IO_POSIX
+#include <sys/mman.h>
+#endif
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <errno.h>
+#include <string.h>
+
+/*
+ * A read-only view of a file mapped with mmap(2).  The mapping is released
+ * when the object is closed or collected, so Strings handed out by the
+ * view are copies of just the bytes asked for.
+ */
+struct mrb_io_mmap {
+  char *ptr;    /* start of the mapping, or NULL for an empty file */
+  mrb_int len;  /* mapped length */
+  int closed;
+};
+
+static void
+mmap_unmap(struct mrb_io_mmap *m)
+{
+#ifdef MRB_IO_POSIX
+  if (m->ptr != NULL) {
+    munmap(m->ptr, m->len);
+  }
+#endif
+  m->ptr = NULL;
+  m->len = 0;
+  m->closed = 1;
+}
+
+static void
+mrb_io_mmap_free(mrb_state *mrb, void *ptr)
+{
+  struct mrb_io_mmap *m = (struct mrb_io_mmap *)ptr;
+
+  if (m != NULL) {
+    mmap_unmap(m);
+    mrb_free(mrb, m);
+  }
+}
+
+struct mrb_data_type mrb_io_mmap_type = { "IO::Mmap", mrb_io_mmap_free };
+
+static struct mrb_io_mmap *
+mmap_get(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_mmap *m;
+
+  m = (struct mrb_io_mmap *)mrb_get_datatype(mrb, self, &mrb_io_mmap_type);
+  if (m == NULL || m->closed) {
+    mrb_raise(mrb, E_IO_ERROR, "closed mapping");
+  }
+  return m;
+}
+
+/*
+ * call-seq:
+ *   IO.mmap(path)   -> IO::Mmap
+ *   IO.mmap(fd)     -> IO::Mmap
+ *
+ * Maps the whole file read-only.  The descriptor is not needed once the
+ * mapping exists; a path is opened and closed again right away.  Only
+ * files of the OS can be mapped, not those of a mounted backend.
+ */
+mrb_value
+mrb_io_s_mmap(mrb_state *mrb, mrb_value klass)
+{
+#ifdef MRB_IO_POSIX
+  struct mrb_io_mmap *m;
+  struct RClass *c;
+  struct mrb_io_stat st;
+  mrb_value target, obj;
+  const char *path = NULL;
+  void *ptr = NULL;
+  int fd, saved_errno;
+
+  mrb_get_args(mrb, "o", &target);
+
+  /* owned by the object from the start, so that nothing leaks on raise */
+  c = mrb_class_get_under(mrb, mrb_class_get(mrb, "IO"), "Mmap");
+  m = (struct mrb_io_mmap *)mrb_malloc(mrb, sizeof(struct mrb_io_mmap));
+  m->ptr = NULL;
+  m->len = 0;
+  m->closed = 1;
+  obj = mrb_obj_value(Data_Wrap_Struct(mrb, c, &mrb_io_mmap_type, m));
+
+  if (mrb_fixnum_p(target)) {
+    fd = mrb_fixnum(target);
+  } else {
+    target = mrb_convert_type(mrb, target, MRB_TT_STRING, "String", "to_str");
+    path = mrb_string_value_cstr(mrb, &target);
+    fd = mrb_io_sys_open(path, O_RDONLY, 0);
+    if (fd == -1) {
+      mrb_sys_fail(mrb, path);
+    }
+  }
+  if (!mrb_io_sys_native(fd)) {
+    if (path != NULL) {
+      mrb_io_sys_close(fd);
+    }
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "IO.mmap needs an OS file descriptor");
+  }
+
+  if (mrb_io_sys_fstat(fd, &st) == -1) {
+    goto fail;
+  }
+  if (st.size > 0) {
+    ptr = mmap(NULL, st.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+      goto fail;
+    }
+  }
+  if (path != NULL) {
+    mrb_io_sys_close(fd);
+  }
+
+  m->ptr = (char *)ptr;
+  m->len = st.size;
+  m->closed = 0;
+  return obj;
+
+ fail:
+  saved_errno = errno;
+  if (path != NULL) {
+    mrb_io_sys_close(fd);
+  }
+  errno = saved_errno;
+  mrb_sys_fail(mrb, path != NULL ? path : "mmap");
+  return mrb_nil_value();
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "IO.mmap is not supported on the platform");
+  return mrb_nil_value();
+#endif
+}
+
+mrb_value
+mrb_io_mmap_size(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(mmap_get(mrb, self)->len);
+}
+
+/*
+ * call-seq:
+ *   map.byteslice(index)          -> String or nil
+ *   map.byteslice(start, length)  -> String or nil
+ *
+ * Copies only the requested bytes out of the mapping.
+ */
+mrb_value
+mrb_io_mmap_byteslice(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_mmap *m = mmap_get(mrb, self);
+  mrb_int start, len = 1;
+  mrb_int argc;
+
+  argc = mrb_get_args(mrb, "i|i", &start, &len);
+  if (start < 0) {
+    start += m->len;
+  }
+  if (len < 0 || start < 0 || start > m->len || (argc == 1 && start == m->len)) {
+    return mrb_nil_value();
+  }
+  if (len > m->len - start) {
+    len = m->len - start;
+  }
+  return mrb_str_new(mrb, m->ptr + start, len);
+}
+
+mrb_value
+mrb_io_mmap_getbyte(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_mmap *m = mmap_get(mrb, self);
+  mrb_int i;
+
+  mrb_get_args(mrb, "i", &i);
+  if (i < 0) {
+    i += m->len;
+  }
+  if (i < 0 || i >= m->len) {
+    return mrb_nil_value();
+  }
+  return mrb_fixnum_value((unsigned char)m->ptr[i]);
+}
+
+/*
+ * call-seq:
+ *   map.index(substring, offset = 0)  -> Integer or nil
+ *
+ * Searches the mapped bytes in place.
+ */
+mrb_value
+mrb_io_mmap_index(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_mmap *m = mmap_get(mrb, self);
+  mrb_value sub;
+  mrb_int off = 0, sublen;
+  const char *p, *end, *s;
+
+  mrb_get_args(mrb, "S|i", &sub, &off);
+  if (off < 0) {
+    off += m->len;
+  }
+  if (off < 0 || off > m->len) {
+    return mrb_nil_value();
+  }
+  s = RSTRING_PTR(sub);
+  sublen = RSTRING_LEN(sub);
+  if (sublen == 0) {
+    return mrb_fixnum_value(off);
+  }
+  p = m->ptr + off;
+  end = m->ptr + m->len;
+  while (end - p >= sublen) {
+    p = (const char *)memchr(p, s[0], end - p - sublen + 1);
+    if (p == NULL) {
+      break;
+    }
+    if (memcmp(p, s, sublen) == 0) {
+      return mrb_fixnum_value(p - m->ptr);
+    }
+    p++;
+  }
+  return mrb_nil_value();
+}
+
+/*
+ * call-seq:
+ *   map.unpack(template, offset = 0)  -> Array
+ *
+ * Runs String#unpack directly over the mapped bytes from offset on.  The
+ * String passed to unpack only borrows the mapping for the duration of
+ * the call.
+ */
+mrb_value
+mrb_io_mmap_unpack(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_mmap *m = mmap_get(mrb, self);
+  mrb_value fmt, view;
+  mrb_int off = 0;
+
+  mrb_get_args(mrb, "S|i", &fmt, &off);
+  if (off < 0 || off > m->len) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "offset %S outside of mapping", mrb_fixnum_value(off));
+  }
+  view = mrb_str_new_static(mrb, m->len > 0 ? m->ptr + off : "", m->len - off);
+  return mrb_funcall(mrb, view, "unpack", 1, fmt);
+}
+
+mrb_value
+mrb_io_mmap_to_s(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_mmap *m = mmap_get(mrb, self);
+
+  return mrb_str_new(mrb, m->ptr, m->len);
+}
+
+mrb_value
+mrb_io_mmap_close(mrb_state *mrb, mrb_value self)
+{
+  mmap_unmap(mmap_get(mrb, self));
+  return mrb_nil_value();
+}
+
+mrb_value
+mrb_io_mmap_closed(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_mmap *m;
+
+  m = (struct mrb_io_mmap *)mrb_get_datatype(mrb, self, &mrb_io_mmap_type);
+  return mrb_bool_value(m == NULL || m->closed);
+}
+
+void
+mrb_init_mmap(mrb_state *mrb)
+{
+  struct RClass *io, *map;
+
+  io  = mrb_class_get(mrb, "IO");
+  map = mrb_define_class_under(mrb, io, "Mmap", mrb->object_class);
+  MRB_SET_INSTANCE_TT(map, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, map, "new");
+
+  mrb_define_class_method(mrb, io, "mmap", mrb_io_s_mmap, MRB_ARGS_REQ(1));
+
+  mrb_define_method(mrb, map, "size",      mrb_io_mmap_size,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, map, "bytesize",  mrb_io_mmap_size,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, map, "byteslice", mrb_io_mmap_byteslice, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, map, "getbyte",   mrb_io_mmap_getbyte,   MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, map, "index",     mrb_io_mmap_index,     MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, map, "unpack",    mrb_io_mmap_unpack,    MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, map, "to_s",      mrb_io_mmap_to_s,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, map, "close",     mrb_io_mmap_close,     MRB_ARGS_NONE());
+  mrb_define_method(mrb, map, "closed?",   mrb_io_mmap_closed,    MRB_ARGS_NONE());
+}
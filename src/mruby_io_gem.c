@@ -2,7 +2,15 @@
 
 void mrb_init_io(mrb_state *mrb);
 void mrb_init_file(mrb_state *mrb);
+void mrb_init_backend(mrb_state *mrb);
 void mrb_init_file_test(mrb_state *mrb);
+void mrb_init_file_stat(mrb_state *mrb);
+void mrb_init_mmap(mrb_state *mrb);
+void mrb_init_async_writer(mrb_state *mrb);
+void mrb_init_ring(mrb_state *mrb);
+void mrb_init_dir(mrb_state *mrb);
+void mrb_final_io(mrb_state *mrb);
+void mrb_final_backend(mrb_state *mrb);
 
 #define DONE mrb_gc_arena_restore(mrb, 0)
 
@@ -11,10 +19,18 @@ mrb_mruby_ev3rt_io_gem_init(mrb_state* mrb)
 {
   mrb_init_io(mrb); DONE;
   mrb_init_file(mrb); DONE;
+  mrb_init_backend(mrb); DONE;
   mrb_init_file_test(mrb); DONE;
+  mrb_init_file_stat(mrb); DONE;
+  mrb_init_mmap(mrb); DONE;
+  mrb_init_async_writer(mrb); DONE;
+  mrb_init_ring(mrb); DONE;
+  mrb_init_dir(mrb); DONE;
 }
 
 void
 mrb_mruby_ev3rt_io_gem_final(mrb_state* mrb)
 {
+  mrb_final_io(mrb);
+  mrb_final_backend(mrb);
 }
@@ -0,0 +1,624 @@
+/*
+** ring.c - IO::Ring class
+*/
+
+#include "mruby.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/string.h"
+#include "mruby/ext/io.h"
+
+#include "mruby/error.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef MRB_IO_POSIX
+#include <kernel.h>
+#endif
+
+#ifndef MRB_IO_CACHE_LINE
+#define MRB_IO_CACHE_LINE 64
+#endif
+
+#define RING_DEFAULT_CAPA 4096
+
+/*
+ * How the reader waits for the producer, which never signals: a sleep of
+ * at least usec microseconds that lets other tasks run.  On EV3RT that is
+ * the kernel's dly_tsk(), which counts milliseconds.
+ */
+#ifndef MRB_IO_RING_WAIT
+#ifdef MRB_IO_POSIX
+#define MRB_IO_RING_WAIT(usec) usleep(usec)
+#else
+#define MRB_IO_RING_WAIT(usec) dly_tsk(((usec) + 999) / 1000)
+#endif
+#endif
+
+/* monotonic time for timeouts, in microseconds */
+static uint64_t
+ring_clock_usec(void)
+{
+#ifdef MRB_IO_POSIX
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  SYSTIM now;
+
+  get_tim(&now);
+  return (uint64_t)now * 1000;
+#endif
+}
+
+/*
+ * head and tail count the bytes ever written and read; only the producer
+ * stores head and only the reader stores tail, so one release store and
+ * one acquire load per side are all the synchronization there is.  They
+ * sit a cache line apart, each next to the other side's cached copy of
+ * it, so that the two sides do not bounce one line between cores.
+ */
+struct mrb_io_ring {
+  /* producer */
+  size_t head;
+  size_t tail_seen;     /* tail as last loaded by the producer */
+  size_t wclosed;       /* set by close_write, after the last head */
+  char pad0[MRB_IO_CACHE_LINE - 3 * sizeof(size_t)];
+  /* reader */
+  size_t tail;
+  size_t head_seen;     /* head as last loaded by the reader */
+  char pad1[MRB_IO_CACHE_LINE - 2 * sizeof(size_t)];
+  /* fixed */
+  size_t mask;          /* capacity - 1; capacity is a power of 2 */
+  int closed;           /* reader side closed */
+  char *buf;
+};
+
+#if defined(MRB_IO_POSIX) && defined(__ATOMIC_ACQUIRE)
+#define ring_load(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+/* EV3RT has a single core: keeping the compiler from reordering is enough */
+#define RING_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+static size_t
+ring_load(const size_t *p)
+{
+  size_t v = *(const volatile size_t *)p;
+
+  RING_BARRIER();
+  return v;
+}
+
+static void
+ring_store(size_t *p, size_t v)
+{
+  RING_BARRIER();
+  *(volatile size_t *)p = v;
+}
+#endif
+
+static void
+mrb_io_ring_free(mrb_state *mrb, void *ptr)
+{
+  struct mrb_io_ring *r = (struct mrb_io_ring *)ptr;
+
+  if (r != NULL) {
+    mrb_free(mrb, r->buf);
+    mrb_free(mrb, r);
+  }
+}
+
+struct mrb_data_type mrb_io_ring_type = { "IO::Ring", mrb_io_ring_free };
+
+struct mrb_io_ring *
+mrb_io_ring_ptr(mrb_state *mrb, mrb_value ring)
+{
+  struct mrb_io_ring *r;
+
+  r = (struct mrb_io_ring *)mrb_data_get_ptr(mrb, ring, &mrb_io_ring_type);
+  if (r == NULL) {
+    mrb_raise(mrb, E_TYPE_ERROR, "uninitialized IO::Ring");
+  }
+  return r;
+}
+
+/* producer side */
+
+size_t
+mrb_io_ring_writable(struct mrb_io_ring *r)
+{
+  r->tail_seen = ring_load(&r->tail);
+  return r->mask + 1 - (r->head - r->tail_seen);
+}
+
+size_t
+mrb_io_ring_write(struct mrb_io_ring *r, const void *ptr, size_t len)
+{
+  size_t head = r->head, capa = r->mask + 1, room, off, first;
+
+  if (r->wclosed) {
+    return 0;
+  }
+  room = capa - (head - r->tail_seen);
+  if (room < len) {
+    room = mrb_io_ring_writable(r);
+  }
+  if (len > room) {
+    len = room;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  off = head & r->mask;
+  first = capa - off;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(r->buf + off, ptr, first);
+  memcpy(r->buf, (const char *)ptr + first, len - first);
+  ring_store(&r->head, head + len);
+  return len;
+}
+
+void
+mrb_io_ring_close_write(struct mrb_io_ring *r)
+{
+  ring_store(&r->wclosed, 1);
+}
+
+/* reader side */
+
+static struct mrb_io_ring *
+ring_get(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r = mrb_io_ring_ptr(mrb, self);
+
+  if (r->closed) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream.");
+  }
+  return r;
+}
+
+/* bytes readable now */
+static size_t
+ring_avail(struct mrb_io_ring *r)
+{
+  if (r->head_seen == r->tail) {
+    r->head_seen = ring_load(&r->head);
+  }
+  return r->head_seen - r->tail;
+}
+
+/* nothing readable and nothing more to come */
+static int
+ring_eof(struct mrb_io_ring *r)
+{
+  if (ring_avail(r) > 0 || !ring_load(&r->wclosed)) {
+    return FALSE;
+  }
+  /* the producer may have written just before closing */
+  return ring_avail(r) == 0;
+}
+
+/*
+ * Wait until there is something to read or the producer is done, for at
+ * most ms milliseconds (-1: no limit).  The sleeps back off from 10us to
+ * 1ms; the timeout is measured on the clock, not by adding them up.
+ * Returns FALSE on timeout.
+ */
+static int
+ring_wait(struct mrb_io_ring *r, int ms)
+{
+  uint64_t deadline = 0;
+  long usec = 10;
+
+  if (ring_avail(r) > 0 || ring_eof(r)) {
+    return TRUE;
+  }
+  if (ms >= 0) {
+    deadline = ring_clock_usec() + (uint64_t)ms * 1000;
+  }
+  while (ring_avail(r) == 0 && !ring_eof(r)) {
+    if (ms >= 0 && ring_clock_usec() >= deadline) {
+      return FALSE;
+    }
+    MRB_IO_RING_WAIT(usec);
+    if (usec < 1000) {
+      usec *= 2;
+    }
+  }
+  return TRUE;
+}
+
+/* drop newlines at the read position (paragraph mode) */
+static void
+ring_skip_newlines(struct mrb_io_ring *r, int wait)
+{
+  for (;;) {
+    if (wait) {
+      ring_wait(r, -1);
+    }
+    if (ring_avail(r) == 0 || r->buf[r->tail & r->mask] != '\n') {
+      break;
+    }
+    ring_store(&r->tail, r->tail + 1);
+  }
+}
+
+/* append len readable bytes to str and consume them */
+static void
+ring_cat(mrb_state *mrb, struct mrb_io_ring *r, mrb_value str, size_t len)
+{
+  size_t off = r->tail & r->mask, first = r->mask + 1 - off;
+
+  if (first > len) {
+    first = len;
+  }
+  mrb_str_cat(mrb, str, r->buf + off, first);
+  if (len > first) {
+    mrb_str_cat(mrb, str, r->buf, len - first);
+  }
+  ring_store(&r->tail, r->tail + len);
+}
+
+static size_t
+ring_round_capa(mrb_state *mrb, mrb_int capa)
+{
+  size_t n = 16;
+
+  if (capa <= 0 || (size_t)capa > ((size_t)1 << (sizeof(size_t) * CHAR_BIT - 2))) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid capacity: %S", mrb_fixnum_value(capa));
+  }
+  while (n < (size_t)capa) {
+    n <<= 1;
+  }
+  return n;
+}
+
+/*
+ * call-seq:
+ *   IO::Ring.new(capacity = 4096)  -> ring
+ *
+ * capacity is rounded up to a power of 2.
+ */
+mrb_value
+mrb_io_ring_initialize(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r;
+  mrb_int capa = RING_DEFAULT_CAPA;
+  size_t size;
+
+  mrb_get_args(mrb, "|i", &capa);
+  size = ring_round_capa(mrb, capa);
+
+  if (DATA_PTR(self) != NULL) {
+    mrb_io_ring_free(mrb, DATA_PTR(self));
+  }
+  DATA_TYPE(self) = &mrb_io_ring_type;
+  DATA_PTR(self) = NULL;
+
+  r = (struct mrb_io_ring *)mrb_malloc(mrb, sizeof(struct mrb_io_ring));
+  memset(r, 0, sizeof(*r));
+  r->buf = (char *)mrb_malloc_simple(mrb, size);
+  if (r->buf == NULL) {
+    mrb_free(mrb, r);
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "capacity too large");
+  }
+  r->mask = size - 1;
+  DATA_PTR(self) = r;
+  return self;
+}
+
+mrb_value
+mrb_io_ring_capacity(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(mrb_io_ring_ptr(mrb, self)->mask + 1);
+}
+
+/* ring.nread -> Integer; bytes that can be read without waiting */
+mrb_value
+mrb_io_ring_nread(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(ring_avail(ring_get(mrb, self)));
+}
+
+/*
+ * call-seq:
+ *   ring.write(str)  -> Integer
+ *
+ * Producer side from Ruby: copies as much of str as fits, without
+ * waiting, and returns the number of bytes written.
+ */
+mrb_value
+mrb_io_ring_write_m(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r = mrb_io_ring_ptr(mrb, self);
+  mrb_value str;
+
+  mrb_get_args(mrb, "o", &str);
+  if (!mrb_string_p(str)) {
+    str = mrb_obj_as_string(mrb, str);
+  }
+  if (r->wclosed) {
+    mrb_raise(mrb, E_IO_ERROR, "not opened for writing");
+  }
+  return mrb_fixnum_value(mrb_io_ring_write(r, RSTRING_PTR(str), RSTRING_LEN(str)));
+}
+
+mrb_value
+mrb_io_ring_close_write_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_io_ring_close_write(mrb_io_ring_ptr(mrb, self));
+  return mrb_nil_value();
+}
+
+/*
+ * call-seq:
+ *   ring.read             -> String
+ *   ring.read(length)     -> String or nil
+ *
+ * As IO#read: waits for length bytes, or for the producer to close.
+ */
+mrb_value
+mrb_io_ring_read(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r = ring_get(mrb, self);
+  mrb_value length = mrb_nil_value(), str;
+  mrb_int len = -1;
+  size_t n, got = 0;
+
+  mrb_get_args(mrb, "|o", &length);
+  if (!mrb_nil_p(length)) {
+    len = mrb_fixnum(mrb_to_int(mrb, length));
+    if (len < 0) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative length: %S given", length);
+    }
+  }
+  str = mrb_str_buf_new(mrb, len > 0 ? len : 0);
+  while (len < 0 || got < (size_t)len) {
+    ring_wait(r, -1);
+    n = ring_avail(r);
+    if (n == 0) {
+      break;
+    }
+    if (len >= 0 && n > (size_t)len - got) {
+      n = len - got;
+    }
+    ring_cat(mrb, r, str, n);
+    got += n;
+  }
+  if (got == 0 && len > 0) {
+    return mrb_nil_value();
+  }
+  return str;
+}
+
+/* ring.readpartial(maxlen) -> String; waits only for the first byte */
+mrb_value
+mrb_io_ring_readpartial(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r = ring_get(mrb, self);
+  mrb_value str;
+  mrb_int maxlen;
+  size_t n;
+
+  mrb_get_args(mrb, "i", &maxlen);
+  if (maxlen < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative length: %S given", mrb_fixnum_value(maxlen));
+  }
+  str = mrb_str_buf_new(mrb, maxlen);
+  if (maxlen == 0) {
+    return str;
+  }
+  ring_wait(r, -1);
+  n = ring_avail(r);
+  if (n == 0) {
+    mrb_raise(mrb, E_EOF_ERROR, "end of file reached");
+  }
+  ring_cat(mrb, r, str, n < (size_t)maxlen ? n : (size_t)maxlen);
+  return str;
+}
+
+/*
+ * call-seq:
+ *   ring.gets(sep = $/)  -> String or nil
+ *
+ * Reads up to and including sep, to the end with sep nil, or a paragraph
+ * with sep "" as IO#gets does.
+ */
+mrb_value
+mrb_io_ring_gets(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r = ring_get(mrb, self);
+  mrb_value rs, str = mrb_nil_value();
+  const char *p, *sep = NULL;
+  size_t n, off, first, take;
+  mrb_int seplen = 0, len;
+  char last = 0;
+  int argc, para = FALSE;
+
+  argc = mrb_get_args(mrb, "|o", &rs);
+  if (argc == 0) {
+    rs = mrb_gv_get(mrb, mrb_intern_lit(mrb, "$/"));
+  }
+  if (!mrb_nil_p(rs)) {
+    rs = mrb_convert_type(mrb, rs, MRB_TT_STRING, "String", "to_str");
+    sep = RSTRING_PTR(rs);
+    seplen = RSTRING_LEN(rs);
+    if (seplen == 0) {
+      para = TRUE;
+      sep = "\n\n";
+      seplen = 2;
+      ring_skip_newlines(r, TRUE);
+    }
+  }
+  if (seplen > 0) {
+    last = sep[seplen - 1];
+  }
+
+  for (;;) {
+    ring_wait(r, -1);
+    n = ring_avail(r);
+    if (n == 0) {
+      break;
+    }
+    p = NULL;
+    take = n;
+    if (seplen > 0) {
+      /* jump to the next byte that could end the separator */
+      off = r->tail & r->mask;
+      first = r->mask + 1 - off;
+      if (first > n) {
+        first = n;
+      }
+      p = (const char *)memchr(r->buf + off, last, first);
+      if (p != NULL) {
+        take = p - (r->buf + off) + 1;
+      } else if (n > first) {
+        p = (const char *)memchr(r->buf, last, n - first);
+        if (p != NULL) {
+          take = first + (p - r->buf) + 1;
+        }
+      }
+    }
+    if (mrb_nil_p(str)) {
+      str = mrb_str_buf_new(mrb, take);
+    }
+    ring_cat(mrb, r, str, take);
+    len = RSTRING_LEN(str);
+    if (p != NULL && len >= seplen && memcmp(RSTRING_PTR(str) + len - seplen, sep, seplen) == 0) {
+      break;
+    }
+  }
+  if (para) {
+    /* only what is already there, as IO#gets does */
+    ring_skip_newlines(r, FALSE);
+  }
+  return str;
+}
+
+/* ring.getbyte -> Integer or nil */
+mrb_value
+mrb_io_ring_getbyte(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r = ring_get(mrb, self);
+  unsigned char c;
+
+  ring_wait(r, -1);
+  if (ring_avail(r) == 0) {
+    return mrb_nil_value();
+  }
+  c = (unsigned char)r->buf[r->tail & r->mask];
+  ring_store(&r->tail, r->tail + 1);
+  return mrb_fixnum_value(c);
+}
+
+/* ring.each_byte {|byte| ... } -> ring; until the producer closes */
+mrb_value
+mrb_io_ring_each_byte(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r;
+  mrb_value blk;
+  unsigned char c;
+
+  mrb_get_args(mrb, "&", &blk);
+  if (mrb_nil_p(blk)) {
+    return mrb_funcall(mrb, self, "to_enum", 1, mrb_symbol_value(mrb_intern_lit(mrb, "each_byte")));
+  }
+  for (;;) {
+    /* the block may close the ring */
+    r = ring_get(mrb, self);
+    ring_wait(r, -1);
+    if (ring_avail(r) == 0) {
+      break;
+    }
+    c = (unsigned char)r->buf[r->tail & r->mask];
+    ring_store(&r->tail, r->tail + 1);
+    mrb_yield(mrb, blk, mrb_fixnum_value(c));
+  }
+  return self;
+}
+
+/* ring.eof? -> true or false; waits until it can tell */
+mrb_value
+mrb_io_ring_eof(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r = ring_get(mrb, self);
+
+  ring_wait(r, -1);
+  return mrb_bool_value(ring_avail(r) == 0);
+}
+
+/*
+ * call-seq:
+ *   ring.wait_readable(timeout = nil)  -> ring or nil
+ *
+ * Waits until there is data or the producer has closed; nil on timeout.
+ */
+mrb_value
+mrb_io_ring_wait_readable(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_ring *r = ring_get(mrb, self);
+  mrb_value timeout = mrb_nil_value();
+  mrb_float sec;
+  int ms = -1;
+
+  mrb_get_args(mrb, "|o", &timeout);
+  if (!mrb_nil_p(timeout)) {
+    sec = mrb_to_flo(mrb, timeout);
+    if (sec < 0) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "time interval must not be negative");
+    }
+    ms = (sec >= INT_MAX / 1000) ? INT_MAX / 1000 : (int)(sec * 1000);
+  }
+  return ring_wait(r, ms) ? self : mrb_nil_value();
+}
+
+/* ring.close -> nil; closes the reader side */
+mrb_value
+mrb_io_ring_close(mrb_state *mrb, mrb_value self)
+{
+  ring_get(mrb, self)->closed = 1;
+  return mrb_nil_value();
+}
+
+mrb_value
+mrb_io_ring_closed(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(mrb_io_ring_ptr(mrb, self)->closed);
+}
+
+void
+mrb_init_ring(mrb_state *mrb)
+{
+  struct RClass *io, *ring;
+
+  io   = mrb_class_get(mrb, "IO");
+  ring = mrb_define_class_under(mrb, io, "Ring", mrb->object_class);
+  MRB_SET_INSTANCE_TT(ring, MRB_TT_DATA);
+  mrb_include_module(mrb, ring, mrb_module_get(mrb, "Enumerable"));
+
+  mrb_define_method(mrb, ring, "initialize",    mrb_io_ring_initialize,    MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, ring, "capacity",      mrb_io_ring_capacity,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, ring, "nread",         mrb_io_ring_nread,         MRB_ARGS_NONE());
+  mrb_define_method(mrb, ring, "write",         mrb_io_ring_write_m,       MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ring, "close_write",   mrb_io_ring_close_write_m, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ring, "read",          mrb_io_ring_read,          MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, ring, "readpartial",   mrb_io_ring_readpartial,   MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ring, "gets",          mrb_io_ring_gets,          MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, ring, "getbyte",       mrb_io_ring_getbyte,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, ring, "each_byte",     mrb_io_ring_each_byte,     MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, ring, "eof?",          mrb_io_ring_eof,           MRB_ARGS_NONE());
+  mrb_define_method(mrb, ring, "eof",           mrb_io_ring_eof,           MRB_ARGS_NONE());
+  mrb_define_method(mrb, ring, "wait_readable", mrb_io_ring_wait_readable, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, ring, "close",         mrb_io_ring_close,         MRB_ARGS_NONE());
+  mrb_define_method(mrb, ring, "closed?",       mrb_io_ring_closed,        MRB_ARGS_NONE());
+}
@@ -0,0 +1,416 @@
+/*
+** stat.c - File::Stat class
+*/
+
+#include "mruby.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include "mruby/ext/io.h"
+
+#include "mruby/error.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <string.h>
+
+extern struct mrb_data_type mrb_io_type;
+
+static void
+mrb_stat_free(mrb_state *mrb, void *ptr)
+{
+  mrb_free(mrb, ptr);
+}
+
+struct mrb_data_type mrb_stat_type = { "File::Stat", mrb_stat_free };
+
+/*
+ * The path cache lives in hidden ivars of File::Stat: __cache__ is a
+ * Hash from path to File::Stat (or false for a path that did not exist),
+ * nil while caching is off; __cache_gen__ is the IO write count the
+ * entries were taken at.
+ */
+static struct RClass *
+stat_class(mrb_state *mrb)
+{
+  return mrb_class_get_under(mrb, mrb_class_get(mrb, "File"), "Stat");
+}
+
+static mrb_value
+stat_cache(mrb_state *mrb)
+{
+  struct RObject *c = (struct RObject *)stat_class(mrb);
+  mrb_value cache, gen;
+
+  cache = mrb_obj_iv_get(mrb, c, mrb_intern_lit(mrb, "__cache__"));
+  if (mrb_nil_p(cache)) {
+    return cache;
+  }
+  gen = mrb_obj_iv_get(mrb, c, mrb_intern_lit(mrb, "__cache_gen__"));
+  if (!mrb_fixnum_p(gen) || mrb_fixnum(gen) != mrb_io_write_count(mrb)) {
+    /* something was written since the entries were taken */
+    cache = mrb_hash_new(mrb);
+    mrb_obj_iv_set(mrb, c, mrb_intern_lit(mrb, "__cache__"), cache);
+    mrb_obj_iv_set(mrb, c, mrb_intern_lit(mrb, "__cache_gen__"), mrb_fixnum_value(mrb_io_write_count(mrb)));
+  }
+  return cache;
+}
+
+void
+mrb_file_stat_cache_clear(mrb_state *mrb)
+{
+  struct RObject *c = (struct RObject *)stat_class(mrb);
+
+  if (!mrb_nil_p(mrb_obj_iv_get(mrb, c, mrb_intern_lit(mrb, "__cache__")))) {
+    mrb_obj_iv_set(mrb, c, mrb_intern_lit(mrb, "__cache__"), mrb_hash_new(mrb));
+  }
+}
+
+static mrb_value
+stat_wrap(mrb_state *mrb, const struct mrb_io_stat *st)
+{
+  struct mrb_io_stat *p;
+
+  p = (struct mrb_io_stat *)mrb_malloc(mrb, sizeof(struct mrb_io_stat));
+  *p = *st;
+  return mrb_obj_value(Data_Wrap_Struct(mrb, stat_class(mrb), &mrb_stat_type, p));
+}
+
+/*
+ * Stat a path, going through the cache when it is enabled.  Returns the
+ * File::Stat, or nil with errno set when the path cannot be stat'ed.
+ */
+static mrb_value
+stat_path_value(mrb_state *mrb, mrb_value path)
+{
+  struct mrb_io_stat st;
+  mrb_value cache, v;
+
+  cache = stat_cache(mrb);
+  if (!mrb_nil_p(cache)) {
+    v = mrb_hash_get(mrb, cache, path);
+    if (!mrb_nil_p(v)) {
+      if (mrb_type(v) == MRB_TT_FALSE) {
+        errno = ENOENT;
+        return mrb_nil_value();
+      }
+      return v;
+    }
+  }
+  if (mrb_io_sys_stat(mrb_string_value_cstr(mrb, &path), &st) == -1) {
+    if (!mrb_nil_p(cache) && errno == ENOENT) {
+      mrb_hash_set(mrb, cache, mrb_str_dup(mrb, path), mrb_false_value());
+    }
+    return mrb_nil_value();
+  }
+  v = stat_wrap(mrb, &st);
+  if (!mrb_nil_p(cache)) {
+    mrb_hash_set(mrb, cache, mrb_str_dup(mrb, path), v);
+  }
+  return v;
+}
+
+/*
+ * Stat a path String or an open IO with a single system call.  Returns
+ * 0, or -1 with errno set.  A closed IO raises IOError.
+ */
+int
+mrb_file_stat(mrb_state *mrb, mrb_value obj, struct mrb_io_stat *st)
+{
+  struct mrb_io *fptr;
+  mrb_value v;
+
+  if (mrb_type(obj) == MRB_TT_DATA && DATA_TYPE(obj) == &mrb_io_type) {
+    fptr = (struct mrb_io *)DATA_PTR(obj);
+    if (fptr == NULL || fptr->fd < 0) {
+      mrb_raise(mrb, E_IO_ERROR, "closed stream.");
+    }
+    if (mrb_io_sys_fstat(fptr->fd, st) == 0) {
+      return 0;
+    }
+    if (errno != ENOSYS) {
+      return -1;
+    }
+    /* no fstat on this backend (FatFS); a File still knows its path */
+    v = mrb_iv_get(mrb, obj, mrb_intern_lit(mrb, "@path"));
+    if (!mrb_string_p(v)) {
+      errno = EBADF;
+      return -1;
+    }
+    obj = v;
+  }
+
+  obj = mrb_convert_type(mrb, obj, MRB_TT_STRING, "String", "to_str");
+  v = stat_path_value(mrb, obj);
+  if (mrb_nil_p(v)) {
+    return -1;
+  }
+  *st = *(struct mrb_io_stat *)DATA_PTR(v);
+  return 0;
+}
+
+static struct mrb_io_stat *
+stat_get(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_stat *st;
+
+  st = (struct mrb_io_stat *)mrb_get_datatype(mrb, self, &mrb_stat_type);
+  if (st == NULL) {
+    mrb_raise(mrb, E_TYPE_ERROR, "uninitialized File::Stat");
+  }
+  return st;
+}
+
+/*
+ * call-seq:
+ *   File.stat(file_name)  -> File::Stat
+ *   File::Stat.new(file_name)  -> File::Stat
+ */
+mrb_value
+mrb_file_s_stat(mrb_state *mrb, mrb_value klass)
+{
+  struct mrb_io_stat st;
+  mrb_value obj, path;
+
+  mrb_get_args(mrb, "o", &obj);
+  if (mrb_type(obj) == MRB_TT_DATA && DATA_TYPE(obj) == &mrb_io_type) {
+    if (mrb_file_stat(mrb, obj, &st) == -1) {
+      mrb_sys_fail(mrb, "fstat");
+    }
+    return stat_wrap(mrb, &st);
+  }
+  path = mrb_convert_type(mrb, obj, MRB_TT_STRING, "String", "to_str");
+  obj = stat_path_value(mrb, path);
+  if (mrb_nil_p(obj)) {
+    mrb_sys_fail(mrb, mrb_string_value_cstr(mrb, &path));
+  }
+  return obj;
+}
+
+/* IO#stat -> File::Stat */
+mrb_value
+mrb_io_stat(mrb_state *mrb, mrb_value io)
+{
+  struct mrb_io_stat st;
+
+  if (mrb_file_stat(mrb, io, &st) == -1) {
+    mrb_sys_fail(mrb, "fstat");
+  }
+  return stat_wrap(mrb, &st);
+}
+
+/*
+ * call-seq:
+ *   File::Stat.cache = true or false
+ *
+ * Turns the path stat cache on or off (it starts off).  Entries are
+ * dropped whenever this gem writes to, renames or unlinks a file.
+ */
+mrb_value
+mrb_stat_s_set_cache(mrb_state *mrb, mrb_value klass)
+{
+  struct RObject *c = (struct RObject *)mrb_class_ptr(klass);
+  mrb_bool b;
+
+  mrb_get_args(mrb, "b", &b);
+  mrb_obj_iv_set(mrb, c, mrb_intern_lit(mrb, "__cache__"), b ? mrb_hash_new(mrb) : mrb_nil_value());
+  mrb_obj_iv_set(mrb, c, mrb_intern_lit(mrb, "__cache_gen__"), mrb_fixnum_value(mrb_io_write_count(mrb)));
+  return mrb_bool_value(b);
+}
+
+mrb_value
+mrb_stat_s_cache_p(mrb_state *mrb, mrb_value klass)
+{
+  return mrb_bool_value(!mrb_nil_p(mrb_obj_iv_get(mrb, (struct RObject *)mrb_class_ptr(klass), mrb_intern_lit(mrb, "__cache__"))));
+}
+
+mrb_value
+mrb_stat_s_clear_cache(mrb_state *mrb, mrb_value klass)
+{
+  mrb_file_stat_cache_clear(mrb);
+  return mrb_nil_value();
+}
+
+static mrb_value
+stat_time(mrb_state *mrb, mrb_int t)
+{
+  if (mrb_class_defined(mrb, "Time")) {
+    return mrb_funcall(mrb, mrb_obj_value(mrb_class_get(mrb, "Time")), "at", 1, mrb_fixnum_value(t));
+  }
+  return mrb_fixnum_value(t);
+}
+
+mrb_value
+mrb_stat_size(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(stat_get(mrb, self)->size);
+}
+
+mrb_value
+mrb_stat_size_p(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_io_stat *st = stat_get(mrb, self);
+
+  return st->size == 0 ? mrb_nil_value() : mrb_fixnum_value(st->size);
+}
+
+mrb_value
+mrb_stat_zero_p(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(stat_get(mrb, self)->size == 0);
+}
+
+mrb_value
+mrb_stat_mode(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(stat_get(mrb, self)->mode);
+}
+
+mrb_value
+mrb_stat_file_p(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(S_ISREG(stat_get(mrb, self)->mode));
+}
+
+mrb_value
+mrb_stat_directory_p(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(S_ISDIR(stat_get(mrb, self)->mode));
+}
+
+mrb_value
+mrb_stat_pipe_p(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(S_ISFIFO(stat_get(mrb, self)->mode));
+}
+
+mrb_value
+mrb_stat_chardev_p(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(S_ISCHR(stat_get(mrb, self)->mode));
+}
+
+mrb_value
+mrb_stat_socket_p(mrb_state *mrb, mrb_value self)
+{
+#ifdef S_ISSOCK
+  return mrb_bool_value(S_ISSOCK(stat_get(mrb, self)->mode));
+#else
+  return mrb_false_value();
+#endif
+}
+
+mrb_value
+mrb_stat_ftype(mrb_state *mrb, mrb_value self)
+{
+  int mode = stat_get(mrb, self)->mode;
+  const char *t;
+
+  if (S_ISREG(mode)) {
+    t = "file";
+  } else if (S_ISDIR(mode)) {
+    t = "directory";
+  } else if (S_ISCHR(mode)) {
+    t = "characterSpecial";
+  } else if (S_ISBLK(mode)) {
+    t = "blockSpecial";
+  } else if (S_ISFIFO(mode)) {
+    t = "fifo";
+#ifdef S_ISSOCK
+  } else if (S_ISSOCK(mode)) {
+    t = "socket";
+#endif
+  } else {
+    t = "unknown";
+  }
+  return mrb_str_new_cstr(mrb, t);
+}
+
+mrb_value
+mrb_stat_mtime(mrb_state *mrb, mrb_value self)
+{
+  return stat_time(mrb, stat_get(mrb, self)->mtime);
+}
+
+mrb_value
+mrb_stat_atime(mrb_state *mrb, mrb_value self)
+{
+  return stat_time(mrb, stat_get(mrb, self)->atime);
+}
+
+mrb_value
+mrb_stat_ctime(mrb_state *mrb, mrb_value self)
+{
+  return stat_time(mrb, stat_get(mrb, self)->ctime);
+}
+
+mrb_value
+mrb_stat_dev(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(stat_get(mrb, self)->dev);
+}
+
+mrb_value
+mrb_stat_ino(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(stat_get(mrb, self)->ino);
+}
+
+mrb_value
+mrb_stat_nlink(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(stat_get(mrb, self)->nlink);
+}
+
+mrb_value
+mrb_stat_uid(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(stat_get(mrb, self)->uid);
+}
+
+mrb_value
+mrb_stat_gid(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(stat_get(mrb, self)->gid);
+}
+
+void
+mrb_init_file_stat(mrb_state *mrb)
+{
+  struct RClass *file, *stat;
+
+  file = mrb_class_get(mrb, "File");
+  stat = mrb_define_class_under(mrb, file, "Stat", mrb->object_class);
+  MRB_SET_INSTANCE_TT(stat, MRB_TT_DATA);
+
+  mrb_define_class_method(mrb, file, "stat", mrb_file_s_stat, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, stat, "new",  mrb_file_s_stat, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, stat, "cache=", mrb_stat_s_set_cache, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, stat, "cache?", mrb_stat_s_cache_p,   MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, stat, "clear_cache", mrb_stat_s_clear_cache, MRB_ARGS_NONE());
+  mrb_define_method(mrb, mrb_class_get(mrb, "IO"), "stat", mrb_io_stat, MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, stat, "size",       mrb_stat_size,        MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "size?",      mrb_stat_size_p,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "zero?",      mrb_stat_zero_p,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "mode",       mrb_stat_mode,        MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "ftype",      mrb_stat_ftype,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "file?",      mrb_stat_file_p,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "directory?", mrb_stat_directory_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "pipe?",      mrb_stat_pipe_p,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "chardev?",   mrb_stat_chardev_p,   MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "socket?",    mrb_stat_socket_p,    MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "mtime",      mrb_stat_mtime,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "atime",      mrb_stat_atime,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "ctime",      mrb_stat_ctime,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "dev",        mrb_stat_dev,         MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "ino",        mrb_stat_ino,         MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "nlink",      mrb_stat_nlink,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "uid",        mrb_stat_uid,         MRB_ARGS_NONE());
+  mrb_define_method(mrb, stat, "gid",        mrb_stat_gid,         MRB_ARGS_NONE());
+}
@@ -0,0 +1,116 @@
+##
+# Dir Test
+
+$mrbtest_dir = "tmp.mruby-io-test.dir"
+$mrbtest_dir_files = ["a.rb", "b.rb", "c.txt", ".hidden", "sub/d.rb", "sub/deep/e.rb", "sub/deep/f.c", "other/g.rb"]
+
+assert('Dir TEST SETUP') do
+  Dir.mkdir $mrbtest_dir
+  Dir.mkdir "#{$mrbtest_dir}/sub"
+  Dir.mkdir "#{$mrbtest_dir}/sub/deep"
+  Dir.mkdir "#{$mrbtest_dir}/other"
+  $mrbtest_dir_files.each do |name|
+    File.open("#{$mrbtest_dir}/#{name}", "w") { |f| f.write name }
+  end
+  true
+end
+
+assert('Dir.exist?') do
+  assert_true Dir.exist?($mrbtest_dir)
+  assert_false Dir.exist?("#{$mrbtest_dir}/a.rb")
+  assert_false Dir.exist?("#{$mrbtest_dir}/none")
+end
+
+assert('Dir.new') do
+  assert_raise(StandardError) { Dir.new("#{$mrbtest_dir}/none") }
+  dir = Dir.new($mrbtest_dir)
+  assert_equal $mrbtest_dir, dir.path
+  assert_false dir.closed?
+  assert_nil dir.close
+  assert_true dir.closed?
+  assert_raise(IOError) { dir.read }
+end
+
+assert('Dir#read, Dir#rewind') do
+  Dir.open($mrbtest_dir) do |dir|
+    names = []
+    while name = dir.read
+      names << name
+    end
+    assert_nil dir.read
+    dir.rewind
+    assert_equal names.size, dir.to_a.size
+    assert_true names.include?(".")
+    assert_true names.include?("a.rb")
+  end
+end
+
+assert('Dir#each_child, Dir.children') do
+  expected = [".hidden", "a.rb", "b.rb", "c.txt", "other", "sub"]
+  assert_equal expected, Dir.children($mrbtest_dir).sort
+  names = []
+  assert_nil Dir.each_child($mrbtest_dir) { |name| names << name }
+  assert_equal expected, names.sort
+  assert_equal [".", ".."] + expected, Dir.entries($mrbtest_dir).sort
+end
+
+assert('Dir.foreach') do
+  names = []
+  assert_nil Dir.foreach("#{$mrbtest_dir}/sub") { |name| names << name }
+  assert_equal [".", "..", "d.rb", "deep"], names.sort
+end
+
+assert('Dir.glob') do
+  d = $mrbtest_dir
+  assert_equal ["#{d}/a.rb", "#{d}/b.rb"], Dir.glob("#{d}/*.rb").sort
+  assert_equal ["#{d}/a.rb", "#{d}/b.rb"], Dir.glob("#{d}/?.rb").sort
+  assert_equal ["#{d}/a.rb", "#{d}/c.txt"], Dir.glob("#{d}/[ac].*").sort
+  assert_equal ["#{d}/b.rb", "#{d}/c.txt"], Dir.glob("#{d}/[!a]*.*").sort
+  assert_equal ["#{d}/.hidden"], Dir.glob("#{d}/.h*")
+  assert_equal ["#{d}/sub/d.rb"], Dir.glob("#{d}/sub/*.rb")
+  assert_equal ["#{d}/sub/deep/e.rb"], Dir.glob("#{d}/*/deep/*.rb")
+  assert_equal ["#{d}/c.txt"], Dir.glob("#{d}/c.txt")
+  assert_equal [], Dir.glob("#{d}/none/*.rb")
+  assert_equal [], Dir.glob("#{d}/none")
+end
+
+assert('Dir.glob with **') do
+  d = $mrbtest_dir
+  expected = ["a.rb", "b.rb", "other/g.rb", "sub/d.rb", "sub/deep/e.rb"].map { |n| "#{d}/#{n}" }
+  assert_equal expected, Dir.glob("#{d}/**/*.rb").sort
+  assert_equal ["#{d}/sub/deep/f.c"], Dir.glob("#{d}/**/*.c")
+  assert_equal ["#{d}/sub/deep/e.rb"], Dir.glob("#{d}/**/deep/e.rb")
+end
+
+assert('Dir.glob with ** and a symbolic link') do
+  d = $mrbtest_dir
+  MRubyIOTestUtil.symlink "..", "#{d}/sub/up"
+  begin
+    # ** does not enter the link, which would loop back to d
+    expected = ["a.rb", "b.rb", "other/g.rb", "sub/d.rb", "sub/deep/e.rb"].map { |n| "#{d}/#{n}" }
+    assert_equal expected, Dir.glob("#{d}/**/*.rb").sort
+    # other segments still follow it
+    assert_equal ["#{d}/sub/up/sub/d.rb"], Dir.glob("#{d}/sub/up/sub/*.rb")
+  ensure
+    File.unlink "#{d}/sub/up"
+  end
+end
+
+assert('Dir.glob with a block, Dir.[]') do
+  d = $mrbtest_dir
+  names = []
+  assert_nil Dir.glob("#{d}/*.rb") { |name| names << name }
+  assert_equal ["#{d}/a.rb", "#{d}/b.rb"], names.sort
+  assert_equal ["#{d}/a.rb", "#{d}/b.rb", "#{d}/c.txt"], Dir["#{d}/*.rb", "#{d}/*.txt"].sort
+end
+
+assert('Dir TEST CLEANUP') do
+  $mrbtest_dir_files.each do |name|
+    File.unlink "#{$mrbtest_dir}/#{name}"
+  end
+  Dir.rmdir "#{$mrbtest_dir}/sub/deep"
+  Dir.rmdir "#{$mrbtest_dir}/sub"
+  Dir.rmdir "#{$mrbtest_dir}/other"
+  assert_equal 0, Dir.rmdir($mrbtest_dir)
+  assert_false Dir.exist?($mrbtest_dir)
+end
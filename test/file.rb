@@ -43,6 +43,8 @@ assert('File.dirname') do
   assert_equal '/',    File.dirname('/a')
   assert_equal 'a',    File.dirname('a/b')
   assert_equal '/a',   File.dirname('/a/b')
+  assert_equal '/a',   File.dirname('/a//b/')
+  assert_equal '/',    File.dirname('//')
 end
 
 assert('File.extname') do
@@ -52,6 +54,8 @@ assert('File.extname') do
   assert_equal '', File.extname('foo/.bar')
   assert_equal '', File.extname('foo.txt/bar')
   assert_equal '', File.extname('.foo')
+  assert_equal '', File.extname('foo.')
+  assert_equal '.rb', File.extname('a/.b.rb')
 end
 
 assert('File.join') do
@@ -62,7 +66,9 @@ assert('File.join') do
   File.join("a", "b", "c") == "a/b/c" and
   File.join("/a", "b", "c") == "/a/b/c" and
   File.join("a", "b", "c/") == "a/b/c/" and
-  File.join("a/", "/b/", "/c") == "a/b/c"
+  File.join("a/", "/b/", "/c") == "a/b/c" and
+  File.join("a", "", "b") == "a/b" and
+  File.join("a", ["b", ["c"]]) == "a/b/c"
 end
 
 assert('File.realpath') do
@@ -70,6 +76,100 @@ assert('File.realpath') do
   assert_equal usrbin, File.realpath("bin")
 end
 
+assert('File#map') do
+  File.open($mrbtest_io_rfname, "r") do |f|
+    m = f.map
+    assert_equal $mrbtest_io_msg.size, m.size
+    assert_equal $mrbtest_io_msg, m.to_s
+    assert_equal "mruby", m.byteslice(0, 5)
+    assert_equal "test\n", m.byteslice(-5, 10)
+    assert_equal "m", m.byteslice(0)
+    assert_nil m.byteslice(m.size)
+    assert_equal "", m.byteslice(m.size, 1)
+    assert_equal "r".getbyte(0), m.getbyte(1)
+    assert_nil m.getbyte(m.size)
+    assert_equal 6, m.index("io")
+    assert_equal 9, m.index("t")
+    assert_equal 12, m.index("t", 10)
+    assert_nil m.index("xyz")
+    assert_equal [109, 114], m.unpack("C2") if "".respond_to?(:unpack)
+    m.close
+    assert_true m.closed?
+    assert_raise(IOError) { m.size }
+  end
+end
+
+assert('IO.mmap') do
+  m = IO.mmap($mrbtest_io_rfname)
+  assert_equal $mrbtest_io_msg, m.to_s
+  assert_equal "io", m.byteslice(6, 2)
+  m.close
+
+  assert_raise(SystemCallError) { IO.mmap("/nonexistent/mruby-io-mmap") }
+end
+
+assert('IO.mmap, File#map on a mounted backend') do
+  File.mount("/mrbtest-ram", :ram)
+  begin
+    File.open("/mrbtest-ram/map.txt", "w") { |f| f.write "ram" }
+    assert_raise(ArgumentError) { IO.mmap("/mrbtest-ram/map.txt") }
+    File.open("/mrbtest-ram/map.txt") do |f|
+      assert_raise(ArgumentError) { f.map }
+    end
+    File.unlink "/mrbtest-ram/map.txt"
+  ensure
+    File.unmount("/mrbtest-ram")
+  end
+end
+
+assert('File.stat, IO#stat') do
+  st = File.stat($mrbtest_io_rfname)
+  assert_kind_of File::Stat, st
+  assert_equal $mrbtest_io_msg.size, st.size
+  assert_equal $mrbtest_io_msg.size, st.size?
+  assert_false st.zero?
+  assert_true st.file?
+  assert_false st.directory?
+  assert_equal "file", st.ftype
+
+  assert_true File.stat("/tmp").directory?
+  assert_equal "directory", File::Stat.new("/tmp").ftype
+  assert_raise(StandardError) { File.stat($mrbtest_io_rfname + "-") }
+
+  File.open($mrbtest_io_rfname) do |f|
+    st2 = f.stat
+    assert_equal st.size, st2.size
+    assert_equal st.mode, st2.mode
+  end
+  IO.pipe { |r, w| assert_true r.stat.pipe? } if IO.respond_to?(:pipe)
+end
+
+assert('File::Stat.cache') do
+  path = $mrbtest_io_wfname + ".stat"
+  assert_false File::Stat.cache?
+  File::Stat.cache = true
+  begin
+    assert_true File::Stat.cache?
+    assert_false File.exist?(path)
+    File.open(path, "w") { |f| f.write "abc" }
+    assert_equal 3, File.size(path)
+    assert_equal File.stat(path).object_id, File.stat(path).object_id
+
+    # writes through the gem drop cached entries
+    File.open(path, "a") { |f| f.write "de" }
+    assert_equal 5, File.stat(path).size
+
+    File.rename path, path + "2"
+    assert_false File.exist?(path)
+    assert_equal 5, File.size(path + "2")
+    File.unlink path + "2"
+    assert_false File.exist?(path + "2")
+  ensure
+    File::Stat.cache = false
+  end
+  assert_false File::Stat.cache?
+end
+
 assert('File TEST CLEANUP') do
   assert_nil MRubyIOTestUtil.io_test_cleanup
 end
@@ -87,3 +187,54 @@ assert('File.expand_path') do
   assert_equal "/", File.expand_path("../../../..", "/")
   assert_equal "/", File.expand_path(([".."] * 100).join("/"))
 end
+
+assert('File.expand_path with a relative base_dir') do
+  assert_equal "/tmp/a/c", File.expand_path("../c", "/tmp/a/b")
+  assert_equal File.expand_path("a/b"), File.expand_path("b", "a")
+  assert_equal File.expand_path("."), File.expand_path("a/..")
+end
+
+assert('File.absolute_path') do
+  assert_equal "/tmp/~", File.absolute_path("~", "/tmp")
+  assert_equal "/hoge", File.absolute_path("/tmp/./../hoge/")
+  assert_equal File.expand_path("a"), File.absolute_path("a")
+end
+
+assert('File.mount with the RAM backend') do
+  assert_equal "/mrbtest-ram", File.mount("/mrbtest-ram", :ram)
+  assert_equal "ram", File.mounts["/mrbtest-ram"]
+  assert_raise(ArgumentError) { File.mount("/mrbtest-x", :nosuch) }
+  begin
+    path = "/mrbtest-ram/log.txt"
+    File.open(path, "w") { |f| f.write "ram\n" * 3 }
+    assert_true File.exist?(path)
+    assert_equal 12, File.size(path)
+    assert_equal "ram\n" * 3, File.read(path)
+    File.open(path, "a") { |f| f.write "end" }
+    assert_equal ["ram\n", "ram\n", "ram\n", "end"], File.open(path) { |f| f.readlines }
+
+    Dir.mkdir "/mrbtest-ram/sub"
+    File.rename path, "/mrbtest-ram/sub/log.txt"
+    assert_false File.exist?(path)
+    assert_equal ["log.txt"], Dir.children("/mrbtest-ram/sub")
+    assert_equal ["/mrbtest-ram/sub/log.txt"], Dir.glob("/mrbtest-ram/*/*.txt")
+
+    f = File.open("/mrbtest-ram/sub/log.txt")
+    assert_raise(StandardError) { File.unmount("/mrbtest-ram") }
+    f.close
+    File.unlink "/mrbtest-ram/sub/log.txt"
+    Dir.rmdir "/mrbtest-ram/sub"
+    assert_equal [], Dir.children("/mrbtest-ram")
+  ensure
+    File.unmount("/mrbtest-ram")
+  end
+  assert_nil File.mounts["/mrbtest-ram"]
+end
+
+assert('File.mount is process-wide') do
+  assert_true MRubyIOTestUtil.mount_in_other_state("/mrbtest-other")
+  # closing the other interpreter unmounted it
+  assert_nil File.mounts["/mrbtest-other"]
+  File.mount("/mrbtest-other", :ram)
+  File.unmount("/mrbtest-other")
+end
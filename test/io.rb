@@ -45,24 +45,82 @@ assert('IO#closed?', '15.2.20.5.2') do
   assert_true io.closed?
 end
 
-#assert('IO#each', '15.2.20.5.3') do
-#assert('IO#each_byte', '15.2.20.5.4') do
-#assert('IO#each_line', '15.2.20.5.5') do
+assert('IO#each', '15.2.20.5.3') do
+  lines = []
+  IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
+    assert_equal io, io.each { |line| lines << line }
+  end
+  assert_equal [$mrbtest_io_msg], lines
+end
+
+assert('IO#each_byte', '15.2.20.5.4') do
+  bytes = []
+  IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
+    assert_equal io, io.each_byte { |b| bytes << b }
+  end
+  assert_equal $mrbtest_io_msg.bytes, bytes
+end
+
+assert('IO#each_line', '15.2.20.5.5') do
+  File.open($mrbtest_io_wfname, "w") { |f| f.write "a\nbb\n\nccc" }
+  lines = []
+  IO.open(IO.sysopen($mrbtest_io_wfname)) do |io|
+    io.each_line(chomp: true) { |line| lines << line }
+  end
+  assert_equal ["a", "bb", "", "ccc"], lines
+
+  lines = []
+  IO.open(IO.sysopen($mrbtest_io_wfname)) do |io|
+    io.each_line("b") { |line| lines << line; io.close if lines.size == 2 }
+  end
+  assert_equal ["a\nb", "b"], lines
+end
 
 assert('IO#eof?', '15.2.20.5.6') do
   io = IO.new(IO.sysopen($mrbtest_io_rfname))
   $mrbtest_io_msg.each_char { |ch|
-    # XXX
-    #assert_false io.eof?
+    assert_false io.eof?
     io.getc
   }
   assert_true io.eof?
   io.close
+
+  io = IO.new(IO.sysopen($mrbtest_io_rfname))
+  assert_false io.eof?
+  assert_equal 0, io.pos
+  assert_equal $mrbtest_io_msg, io.read
+  assert_true io.eof?
+  io.close
   true
 end
 
+assert('IO#eof? with IO#sysread') do
+  io = IO.new(IO.sysopen($mrbtest_io_rfname))
+  s = ""
+  until io.eof?
+    s << io.sysread(3)
+  end
+  assert_equal $mrbtest_io_msg, s
+  st = io.stats
+  assert_equal 0, st[:seeks]
+  # one block-sized read for the data and one that finds end of file
+  assert_equal 2, st[:reads]
+  io.close
+end
+
+assert('IO#eof? with IO#sysseek') do
+  io = IO.new(IO.sysopen($mrbtest_io_rfname))
+  assert_false io.eof?
+  assert_equal 0, io.sysseek(0)
+  assert_equal $mrbtest_io_msg[0, 5], io.sysread(5)
+  assert_false io.eof?
+  # relative to what has been read, not to the read-ahead
+  assert_equal 7, io.sysseek(2, IO::SEEK_CUR)
+  assert_equal $mrbtest_io_msg[7, 2], io.sysread(2)
+  io.close
+end
+
 assert('IO#flush', '15.2.20.5.7') do
-  # Note: mruby-io does not have any buffer to be flushed now.
   io = IO.new(IO.sysopen($mrbtest_io_wfname))
   assert_equal io, io.flush
   io.close
@@ -83,9 +141,48 @@ end
 
 #assert('IO#gets', '15.2.20.5.9') do
 #assert('IO#initialize_copy', '15.2.20.5.10') do
-#assert('IO#print', '15.2.20.5.11') do
+assert('IO#print', '15.2.20.5.11') do
+  io = IO.new(IO.sysopen($mrbtest_io_wfname, "w"), "w")
+  assert_nil io.print("a", 1, nil, :b)
+  io.close
+  assert_equal "a1b", IO.read($mrbtest_io_wfname)
+end
+
 #assert('IO#putc', '15.2.20.5.12') do
-#assert('IO#puts', '15.2.20.5.13') do
+
+assert('IO#puts', '15.2.20.5.13') do
+  io = IO.new(IO.sysopen($mrbtest_io_wfname, "w"), "w")
+  io.sync = true
+  assert_nil io.puts("a", "b\n", 3, "")
+  assert_nil io.puts
+  io.close
+  assert_equal "a\nb\n3\n\n\n", IO.read($mrbtest_io_wfname)
+
+  io = IO.new(IO.sysopen($mrbtest_io_wfname, "w"), "w")
+  args = (1..100).to_a
+  io.puts(*args)
+  io.close
+  assert_equal args.join("\n") + "\n", IO.read($mrbtest_io_wfname)
+end
+
+assert('IO#getbyte, IO#readbyte') do
+  IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
+    assert_equal 109, io.getbyte
+    assert_equal 114, io.readbyte
+    assert_equal 2, io.pos
+    io.read
+    assert_nil io.getbyte
+    assert_raise(EOFError) { io.readbyte }
+  end
+end
+
+assert('IO#each_char') do
+  chars = []
+  IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
+    io.each_char { |c| chars << c }
+  end
+  assert_equal $mrbtest_io_msg.split(""), chars
+end
 
 assert('IO#read', '15.2.20.5.14') do
   IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
@@ -106,6 +203,30 @@ assert('IO#read', '15.2.20.5.14') do
   end
 end
 
+assert('IO#read with outbuf') do
+  IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
+    buf = "previous contents"
+    assert_equal 'mruby', io.read(5, buf)
+    assert_equal 'mruby', buf
+    assert_equal '', io.read(0, buf)
+    assert_equal $mrbtest_io_msg[5, 100], io.read(nil, buf)
+    assert_equal $mrbtest_io_msg[5, 100], buf
+    assert_nil io.read(5, buf)
+    assert_equal '', buf
+  end
+end
+
+assert('IO#readpartial') do
+  IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
+    buf = "x" * 100
+    assert_equal 'mruby', io.readpartial(5, buf)
+    assert_equal 'mruby', buf
+    assert_equal $mrbtest_io_msg[5, 100], io.readpartial(100)
+    assert_raise(EOFError) { io.readpartial(1, buf) }
+    assert_equal '', buf
+  end
+end
+
 assert('IO#readchar', '15.2.20.5.15') do
   # almost same as IO#getc
   IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
@@ -119,7 +240,29 @@ assert('IO#readchar', '15.2.20.5.15') do
 end
 
 #assert('IO#readline', '15.2.20.5.16') do
-#assert('IO#readlines', '15.2.20.5.17') do
+
+assert('IO#readlines', '15.2.20.5.17') do
+  File.open($mrbtest_io_wfname, "w") { |f| f.write "a\nbb\n\nccc" }
+  IO.open(IO.sysopen($mrbtest_io_wfname)) do |io|
+    assert_equal ["a\n", "bb\n", "\n", "ccc"], io.readlines
+    assert_equal [], io.readlines
+  end
+  IO.open(IO.sysopen($mrbtest_io_wfname)) do |io|
+    assert_equal ["a\nbb\n\n", "ccc"], io.readlines("")
+  end
+  assert_equal ["a", "bb", "", "ccc"], IO.readlines($mrbtest_io_wfname, chomp: true)
+  assert_equal ["a\n", "bb", "\n", "\n", "cc", "c"], IO.readlines($mrbtest_io_wfname, 2)
+end
+
+assert('IO.foreach') do
+  File.open($mrbtest_io_wfname, "w") { |f| f.write "a\nbb\n" }
+  lines = []
+  assert_nil IO.foreach($mrbtest_io_wfname) { |line| lines << line }
+  assert_equal ["a\n", "bb\n"], lines
+  lines = []
+  File.foreach($mrbtest_io_wfname, chomp: true) { |line| lines << line }
+  assert_equal ["a", "bb"], lines
+end
 
 assert('IO#sync', '15.2.20.5.18') do
   io = IO.new(IO.sysopen($mrbtest_io_rfname))
@@ -147,9 +290,35 @@ assert('IO#write', '15.2.20.5.20') do
   io = IO.open(IO.sysopen($mrbtest_io_wfname))
   assert_equal 0, io.write("")
   io.close
+
+  io = IO.new(IO.sysopen($mrbtest_io_wfname, "w"), "w")
+  assert_equal 6, io.write("ab", :cd, 12)
+  assert_equal io, io << "x" << 5
+  io.sync = true
+  assert_equal 4000 * 3, io.write("x" * 4000, "y" * 4000, "z" * 4000)
+  io.close
+  assert_equal "abcd12x5" + "x" * 4000 + "y" * 4000 + "z" * 4000, IO.read($mrbtest_io_wfname)
   true
 end
 
+assert('IO#write buffering') do
+  io = IO.new(IO.sysopen($mrbtest_io_wfname, "w"), "w")
+  assert_equal 3, io.write("abc")
+  assert_equal 3, io.pos
+  assert_equal "", IO.read($mrbtest_io_wfname)
+  io.flush
+  assert_equal "abc", IO.read($mrbtest_io_wfname)
+  io.write "def"
+  io.sync = true
+  assert_equal "abcdef", IO.read($mrbtest_io_wfname)
+  io.write "ghi"
+  assert_equal "abcdefghi", IO.read($mrbtest_io_wfname)
+  io.sync = false
+  io.write "jkl"
+  io.close
+  assert_equal "abcdefghijkl", IO.read($mrbtest_io_wfname)
+end
+
 assert('IO.for_fd') do
   fd = IO.sysopen($mrbtest_io_rfname)
   io = IO.for_fd(fd)
@@ -168,6 +337,256 @@ assert('IO gc check') do
   100.times { IO.new(0) }
 end
 
+assert('IO.open_count') do
+  base = IO.open_count
+  io = File.open($mrbtest_io_rfname)
+  assert_equal base + 1, IO.open_count
+  r, w = IO.pipe
+  assert_equal base + 3, IO.open_count
+  io.close
+  r.close
+  w.close
+  assert_equal base, IO.open_count
+end
+
+assert('IO.max_open') do
+  assert_nil IO.max_open
+  GC.start
+  base = IO.open_count
+  begin
+    # dropped IOs are reclaimed to stay within the cap
+    IO.max_open = base + 3
+    assert_equal base + 3, IO.max_open
+    20.times { File.open($mrbtest_io_rfname) }
+    assert_true IO.open_count <= base + 3
+
+    GC.start
+    IO.max_open = IO.open_count + 1
+    f = File.open($mrbtest_io_rfname)
+    assert_raise(StandardError) { File.open($mrbtest_io_rfname) }
+    f.close
+  ensure
+    IO.max_open = nil
+  end
+  assert_nil IO.max_open
+  assert_raise(ArgumentError) { IO.max_open = 0 }
+end
+
+assert('IO#stats') do
+  File.open($mrbtest_io_rfname) do |io|
+    assert_equal 0, io.stats[:reads]
+    assert_equal $mrbtest_io_msg, io.read
+    st = io.stats
+    assert_true st[:reads] >= 1
+    assert_equal $mrbtest_io_msg.size, st[:read_bytes]
+    assert_equal 0, st[:writes]
+    assert_kind_of Float, st[:sys_time]
+    io.seek 0
+    assert_true io.stats[:seeks] >= 1
+    io.reset_stats
+    assert_equal 0, io.stats[:reads]
+    assert_equal 0, io.stats[:seeks]
+  end
+end
+
+assert('IO.stats') do
+  GC.start
+  IO.reset_stats
+  assert_equal 0, IO.stats[:opens]
+  assert_equal $mrbtest_io_msg, IO.read($mrbtest_io_rfname)
+  st = IO.stats
+  assert_equal 1, st[:opens]
+  assert_equal 1, st[:closes]
+  assert_equal $mrbtest_io_msg.size, st[:read_bytes]
+
+  File.open($mrbtest_io_wfname, "w") { |f| f.write "abc" }
+  assert_equal 3, IO.stats[:write_bytes]
+end
+
+assert('IO.stats_timing') do
+  assert_false IO.stats_timing
+  IO.reset_stats
+  IO.read($mrbtest_io_rfname)
+  assert_equal 0.0, IO.stats[:sys_time]
+  assert_equal 1, IO.stats[:opens]
+
+  IO.stats_timing = true
+  begin
+    assert_true IO.stats_timing
+    IO.read($mrbtest_io_rfname)
+    assert_true IO.stats[:sys_time] > 0.0
+    assert_equal 2, IO.stats[:opens]
+  ensure
+    IO.stats_timing = false
+  end
+end
+
+assert('IO trace hook') do
+  MRubyIOTestUtil.trace_start
+  File.open($mrbtest_io_rfname) { |f| f.read }
+  opens, closes, reads, writes, seeks = MRubyIOTestUtil.trace_stop
+  assert_equal 1, opens
+  assert_true closes >= 1
+  assert_true reads >= 1
+  assert_equal 0, writes
+end
+
+assert('IO#read_int8 ... IO#read_float64') do
+  File.open($mrbtest_io_wfname, "w") do |f|
+    f.write "\xfe\x01\x02\x01\x02\xff\xff\xff\xff"
+    f.write "\x00\x00\xc0\x3f" + "\xc0\x02" + "\x00" * 6
+    f.write "\x07"
+  end
+  File.open($mrbtest_io_wfname) do |f|
+    assert_equal(-2, f.read_int8)
+    assert_equal 0x0201, f.read_int16
+    assert_equal 0x0102, f.read_uint16(:big)
+    assert_equal(-1, f.read_int32(:native))
+    assert_equal 1.5, f.read_float32
+    assert_equal(-2.25, f.read_float64(:big))
+    assert_raise(ArgumentError) { f.read_uint8(:middle) }
+    assert_raise(EOFError) { f.read_int16 }
+    assert_equal 7, f.read_uint8
+    assert_raise(EOFError) { f.read_uint8 }
+  end
+end
+
+assert('IO#read_array, IO#write_array') do
+  File.open($mrbtest_io_wfname, "w") do |f|
+    assert_equal 6, f.write_array(:int16, [1, -2, 3])
+    assert_equal 8, f.write_array(:uint32, [0xdead, 1], :big)
+    assert_equal 16, f.write_array(:float64, [0.5, -1])
+    assert_raise(RangeError) { f.write_array(:int32, [0.0 / 0]) }
+    assert_raise(RangeError) { f.write_array(:int64, [1.0 / 0]) }
+    assert_raise(RangeError) { f.write_array(:uint64, [1e20]) }
+    assert_raise(RangeError) { f.write_int(1.0 / 0) }
+    f.write "\x01"
+  end
+  assert_equal "\x00\x00\xde\xad", File.read($mrbtest_io_wfname)[6, 4]
+  File.open($mrbtest_io_wfname) do |f|
+    assert_equal [1, -2, 3], f.read_array(:int16, 3)
+    assert_equal [0xdead, 1], f.read_array(:uint32, 5, :big)[0, 2]
+  end
+  File.open($mrbtest_io_wfname) do |f|
+    f.read 14
+    assert_equal [0.5, -1.0], f.read_array(:float64, 10)
+    assert_nil f.read_array(:int16, 1)
+    assert_equal "\x01", f.read
+    assert_equal [], f.read_array(:int8, 0)
+    assert_raise(ArgumentError) { f.read_array(:int24, 1) }
+  end
+end
+
+assert('IO#write_int, IO#write_float, IO#write_row') do
+  File.open($mrbtest_io_wfname, "w") do |f|
+    assert_equal 1, f.write_int(0)
+    assert_equal 4, f.write_int(-123)
+    f.write " "
+    assert_equal 4, f.write_float(3.14159, 2)
+    f.write " "
+    assert_equal 8, f.write_float(0.5)
+    f.write " "
+    f.write_float(2, 0)
+    f.write "\n"
+    assert_equal 16, f.write_row([1, -2.5, "ab", nil, :c, 10], ";", 1)
+    f.write_row []
+    f.sync = true
+    f.write_row [1.0 / 0, -1.0 / 0, 0.0 / 0]
+    assert_raise(ArgumentError) { f.write_float(1.0, 21) }
+  end
+  assert_equal "0-123 3.14 0.500000 2\n1;-2.5;ab;;c;10\n\nInfinity,-Infinity,NaN\n", File.read($mrbtest_io_wfname)
+end
+
+assert('IO::AsyncWriter') do
+  File.open($mrbtest_io_wfname, "w") {}
+  w = IO::AsyncWriter.new($mrbtest_io_wfname, capacity: 64)
+  assert_equal 6, w.write("hello\n")
+  100.times { |i| w.puts i }
+  w << "big " * 40 << "\n"
+  w.flush
+  st = w.stats
+  assert_equal 64, st[:capacity]
+  assert_equal 0, st[:queued]
+  assert_equal 0, st[:dropped]
+  assert_true st[:writes] >= 1
+  w.close
+  assert_true w.closed?
+  assert_raise(IOError) { w.write "x" }
+
+  lines = File.read($mrbtest_io_wfname).split("\n")
+  assert_equal "hello", lines[0]
+  assert_equal "99", lines[100]
+  assert_equal "big " * 40, lines[101]
+  assert_equal st[:written], File.size($mrbtest_io_wfname)
+end
+
+assert('IO::AsyncWriter overflow') do
+  w = IO::AsyncWriter.new($mrbtest_io_wfname, capacity: 16, overflow: :drop)
+  assert_equal 0, w.write("x" * 32)
+  assert_equal 32, w.stats[:dropped]
+  w.close
+
+  w = IO::AsyncWriter.new($mrbtest_io_wfname, capacity: 16, overflow: :error)
+  assert_raise(IOError) { w.write "x" * 32 }
+  w.close
+
+  assert_raise(ArgumentError) { IO::AsyncWriter.new($mrbtest_io_wfname, overflow: :wait) }
+end
+
+assert('IO::Ring') do
+  r = IO::Ring.new(100)
+  assert_equal 128, r.capacity
+  assert_equal 0, r.nread
+  assert_nil r.wait_readable(0.01)
+
+  assert_equal 12, r.write("abc\ndef\nghi")
+  assert_equal 12, r.nread
+  assert_equal r, r.wait_readable(0)
+  assert_equal "abc\n", r.gets
+  assert_equal "de", r.read(2)
+  assert_equal "f\n", r.readpartial(10)
+  assert_equal 103, r.getbyte
+
+  # wraps around the end of the buffer
+  r << "x" * 120
+  assert_equal 128 - 122, r.write("y" * 10)
+  assert_equal "hi" + "x" * 120 + "y" * 6, r.read(128)
+
+  r << "1,2\r\n3"
+  assert_equal "1,2\r\n", r.gets("\r\n")
+  assert_equal "3", r.read(1)
+
+  # paragraph mode, as IO#gets("")
+  r << "\n\npara 1\nline\n\n\n\npara 2"
+  assert_equal "para 1\nline\n\n", r.gets("")
+  r.close_write
+  assert_raise(IOError) { r.write "4" }
+  assert_equal "para 2", r.gets("")
+  assert_nil r.gets
+  assert_nil r.read(1)
+  assert_equal "", r.read
+  assert_true r.eof?
+  assert_raise(EOFError) { r.readpartial 1 }
+
+  r.close
+  assert_true r.closed?
+  assert_raise(IOError) { r.read }
+end
+
+assert('IO::Ring#each_byte, #readlines') do
+  r = IO::Ring.new
+  r << "ab\ncd"
+  r.close_write
+  a = []
+  r.each_byte { |b| a << b }
+  assert_equal [97, 98, 10, 99, 100], a
+
+  r = IO::Ring.new(16)
+  r << "ab\ncd"
+  r.close_write
+  assert_equal ["ab\n", "cd"], r.readlines
+end
+
 assert('IO.sysopen("./nonexistent")') do
   if Object.const_defined? :Errno
     eclass = Errno::ENOENT
@@ -191,10 +610,25 @@ assert('IO.sysopen, IO#sysread') do
     io.sysread(10000)
     io.sysread(10000)
   end
+  assert_nil io.sysread(10000, exception: false)
+  assert_nil io.sysread(10000, str1, exception: false)
+  assert_equal '', str1
   io.close
   io.closed?
 end
 
+assert('IO#read_nonblock') do
+  IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
+    buf = ''
+    assert_equal 'mruby', io.read_nonblock(5, buf)
+    assert_equal 'mruby', buf
+    assert_equal $mrbtest_io_msg[5, 100], io.read_nonblock(100)
+    assert_nil io.read_nonblock(1, exception: false)
+    assert_raise(EOFError) { io.read_nonblock(1) }
+    assert_nil io.readpartial(1, exception: false)
+  end
+end
+
 assert('IO.sysopen, IO#syswrite') do
   fd = IO.sysopen $mrbtest_io_wfname, "w"
   io = IO.new fd, "w"
@@ -213,18 +647,14 @@ end
 assert('IO#_read_buf') do
   fd = IO.sysopen $mrbtest_io_rfname
   io = IO.new fd
-  def io._buf
-    @buf
-  end
   msg_len = $mrbtest_io_msg.size
-  assert_equal '', io._buf
   assert_equal $mrbtest_io_msg, io._read_buf
-  assert_equal $mrbtest_io_msg, io._buf
+  assert_equal 0, io.pos
   assert_equal 'mruby', io.read(5)
   assert_equal 5, io.pos
-  assert_equal msg_len - 5, io._buf.size
+  assert_equal $mrbtest_io_msg[5, msg_len], io._read_buf
   assert_equal $mrbtest_io_msg[5,100], io.read
-  assert_equal 0, io._buf.size
+  assert_equal msg_len, io.pos
   assert_raise EOFError do
     io._read_buf
   end
@@ -234,12 +664,19 @@ assert('IO#_read_buf') do
   io.closed?
 end
 
+assert('IO#ungetc') do
+  IO.open(IO.sysopen($mrbtest_io_rfname)) do |io|
+    assert_equal 'mruby', io.read(5)
+    io.ungetc 'by'
+    assert_equal 3, io.pos
+    assert_equal 'by io', io.read(5)
+    assert_equal 8, io.pos
+  end
+end
+
 assert('IO#pos=, IO#seek') do
   fd = IO.sysopen $mrbtest_io_rfname
   io = IO.new fd
-  def io._buf
-    @buf
-  end
   assert_equal 'm', io.getc
   assert_equal 1, io.pos
   assert_equal 0, io.seek(0)
@@ -315,10 +752,44 @@ assert('IO#gets - paragraph mode') do
   para2 = "#{'2' * 10}\n"
   text2 = io.gets("")
   assert_equal para2, text2
+  assert_nil io.gets("")
   io.close
   io.closed?
 end
 
+assert('IO#gets - separators and limits') do
+  long = "x" * 5000
+  File.open($mrbtest_io_wfname, "w") do |f|
+    f.write "ab\r\ncd\n#{long}\nef<>gh<"
+    f.write ">ij"
+  end
+
+  File.open($mrbtest_io_wfname) do |io|
+    assert_equal "ab\r\n", io.gets
+    assert_equal "cd\n", io.gets(100)
+    assert_equal long + "\n", io.gets
+    assert_equal "ef<>", io.gets("<>")
+    assert_equal "gh<>", io.gets("<>")
+    assert_equal "ij", io.gets("<>")
+    assert_nil io.gets("<>")
+  end
+
+  File.open($mrbtest_io_wfname) do |io|
+    assert_equal "ab", io.gets(chomp: true)
+    assert_equal "c", io.gets(1, chomp: true)
+    assert_equal "d", io.gets(chomp: true)
+    assert_equal long, io.gets(chomp: true)
+    assert_equal "ef", io.gets("<>", chomp: true)
+  end
+
+  File.open($mrbtest_io_wfname) do |io|
+    io.gets
+    assert_raise(EOFError) do
+      loop { io.readline }
+    end
+  end
+end
+
 assert('IO.read') do
   # empty file
   fd = IO.sysopen $mrbtest_io_wfname, "w"
@@ -340,6 +811,153 @@ assert('IO.read') do
   assert_equal "23",  IO.read($mrbtest_io_wfname, 10, 1)
   assert_equal "",    IO.read($mrbtest_io_wfname, nil, 10)
   assert_equal nil,   IO.read($mrbtest_io_wfname, 1, 10)
+
+  # larger than the IO buffer
+  str = "0123456789" * 1000
+  File.open($mrbtest_io_wfname, "w") { |f| f.write str }
+  assert_equal str,               IO.read($mrbtest_io_wfname)
+  assert_equal str[9000, 1000],   IO.read($mrbtest_io_wfname, nil, 9000)
+  assert_equal str[4095, 10],     IO.binread($mrbtest_io_wfname, 10, 4095)
+  assert_equal str,               File.read($mrbtest_io_wfname)
+  assert_raise(ArgumentError) { IO.read($mrbtest_io_wfname, -1) }
+end
+
+assert('IO.copy_stream') do
+  str = "0123456789" * 1000
+  File.open($mrbtest_io_wfname, "w") { |f| f.write str }
+  dst = $mrbtest_io_wfname + ".copy"
+
+  assert_equal str.size, IO.copy_stream($mrbtest_io_wfname, dst)
+  assert_equal str, IO.read(dst)
+  assert_equal 10, IO.copy_stream($mrbtest_io_wfname, dst, 10, 4095)
+  assert_equal str[4095, 10], IO.read(dst)
+
+  File.open($mrbtest_io_wfname) do |src|
+    assert_equal "01", src.read(2)
+    File.open(dst, "w") do |out|
+      out.write "head:"
+      assert_equal 100, IO.copy_stream(src, out, 100)
+      assert_equal 105, out.pos
+    end
+    assert_equal 102, src.pos
+    assert_equal "head:" + str[2, 100], IO.read(dst)
+
+    # an explicit offset leaves the source position alone
+    File.open(dst, "w") do |out|
+      assert_equal 5, IO.copy_stream(src, out, 5, 0)
+    end
+    assert_equal 102, src.pos
+    assert_equal "01234", IO.read(dst)
+    assert_equal str[102, 3], src.read(3)
+  end
+  File.unlink dst
+end
+
+assert('IO.pipe') do
+  r, w = IO.pipe
+  assert_kind_of IO, r
+  assert_kind_of IO, w
+  w.write "abc\ndef"
+  assert_equal "abc\n", r.gets
+  w.close
+  assert_equal "def", r.read
+  assert_true r.eof?
+  r.close
+
+  rr = ww = nil
+  IO.pipe do |r2, w2|
+    rr, ww = r2, w2
+    w2.puts "x"
+    assert_equal "x\n", r2.gets
+  end
+  assert_true rr.closed?
+  assert_true ww.closed?
+end
+
+assert('IO.select, IO#wait_readable, IO#wait_writable') do
+  IO.pipe do |r, w|
+    assert_nil IO.select([r], nil, nil, 0)
+    assert_nil r.wait_readable(0.01)
+    assert_equal [[], [w], []], IO.select([r], [w], nil, 0)
+    assert_equal w, w.wait_writable(0)
+
+    w.write "ab"
+    assert_equal [[r], [], []], IO.select([r], nil, nil, 1)
+    assert_equal r, r.wait_readable(1)
+
+    # data already in the read buffer counts as readable
+    assert_equal "a", r.getc
+    assert_equal [[r], [], []], IO.select([r], nil, nil, 1)
+    assert_equal "b", r.getc
+
+    w.close
+    assert_equal [[r], [], []], IO.select([r])
+    assert_nil r.getc
+  end
+  assert_raise(ArgumentError) { IO.select([], nil, nil, -1) }
+end
+
+assert('IO.select on a file of a mounted backend') do
+  File.mount("/mrbtest-ram", :ram)
+  begin
+    File.open("/mrbtest-ram/select.txt", "w+") do |f|
+      IO.pipe do |r, w|
+        # ready at once, without waiting out the timeout
+        assert_equal [[f], [f], []], IO.select([f, r], [f], [f], 10)
+        assert_equal f, f.wait_readable(10)
+        assert_equal f, f.wait_writable(10)
+      end
+    end
+    File.unlink "/mrbtest-ram/select.txt"
+  ensure
+    File.unmount("/mrbtest-ram")
+  end
+end
+
+assert('IO#read_nonblock, IO#write_nonblock') do
+  IO.pipe do |r, w|
+    assert_false r.nonblock?
+    assert_equal :wait_readable, r.read_nonblock(1, exception: false)
+    assert_false r.nonblock?
+    e = assert_raise(IO::EAGAINWaitReadable) { r.read_nonblock(1) }
+    assert_kind_of IO::WaitReadable, e
+
+    assert_equal 3, w.write_nonblock("abc")
+    assert_equal "abc", r.read_nonblock(10)
+
+    # fill the pipe until the kernel refuses more
+    chunk = "x" * 4096
+    total = 0
+    loop do
+      n = w.write_nonblock(chunk, exception: false)
+      break if n == :wait_writable
+      total += n
+    end
+    assert_true total > 0
+    e = assert_raise(IO::EAGAINWaitWritable) { w.write_nonblock(chunk) }
+    assert_kind_of IO::WaitWritable, e
+    assert_equal total, r.read(total).size
+  end
+end
+
+assert('IO#nonblock=, nonblock: true') do
+  IO.pipe do |r, w|
+    r.nonblock = true
+    assert_true r.nonblock?
+    # blocking readers still wait for data on a non-blocking descriptor
+    w.write "line\n"
+    assert_equal "line\n", r.gets
+    r.nonblock = false
+    assert_false r.nonblock?
+  end
+
+  File.open($mrbtest_io_rfname, "r", nonblock: true) do |f|
+    assert_true f.nonblock?
+    assert_equal $mrbtest_io_msg, f.read
+  end
+  io = IO.new(IO.sysopen($mrbtest_io_rfname), nonblock: true)
+  assert_true io.nonblock?
+  io.close
 end
 
 assert('IO#fileno') do
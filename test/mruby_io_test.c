@@ -4,12 +4,15 @@
 #include <sys/un.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "mruby.h"
 #include "mruby/array.h"
+#include "mruby/hash.h"
 #include "mruby/string.h"
 #include "mruby/variable.h"
+#include "mruby/ext/io.h"
 
 static mrb_value
 mrb_io_test_io_setup(mrb_state *mrb, mrb_value self)
@@ -113,6 +116,75 @@ mrb_io_test_file_cleanup(mrb_state *mrb, mrb_value self)
   return mrb_nil_value();
 }
 
+/* MRubyIOTestUtil.symlink(target, link) */
+static mrb_value
+mrb_io_test_symlink(mrb_state *mrb, mrb_value self)
+{
+  mrb_value target, link;
+
+  mrb_get_args(mrb, "SS", &target, &link);
+  if (symlink(mrb_string_value_cstr(mrb, &target), mrb_string_value_cstr(mrb, &link)) == -1) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't make a symbolic link");
+  }
+  return mrb_nil_value();
+}
+
+/*
+ * MRubyIOTestUtil.mount_in_other_state(prefix) -> true or false
+ * File.mount prefix in a second mrb_state and close it; true if this
+ * state saw the mount meanwhile.
+ */
+static mrb_value
+mrb_io_test_mount_in_other_state(mrb_state *mrb, mrb_value self)
+{
+  mrb_state *mrb2;
+  mrb_value prefix, mounts;
+
+  mrb_get_args(mrb, "S", &prefix);
+  mrb2 = mrb_open();
+  if (mrb2 == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't open an mrb_state");
+  }
+  mrb_funcall(mrb2, mrb_obj_value(mrb_class_get(mrb2, "File")), "mount", 2,
+              mrb_str_new(mrb2, RSTRING_PTR(prefix), RSTRING_LEN(prefix)),
+              mrb_symbol_value(mrb_intern_lit(mrb2, "ram")));
+  mounts = mrb_funcall(mrb, mrb_obj_value(mrb_class_get(mrb, "File")), "mounts", 0);
+  mrb_close(mrb2);
+  return mrb_bool_value(!mrb_nil_p(mrb_hash_get(mrb, mounts, prefix)));
+}
+
+/* syscalls seen by the trace hook, by enum mrb_io_trace_op */
+static mrb_int trace_counts[MRB_IO_TRACE_SEEK + 1];
+
+static void
+mrb_io_test_trace(mrb_state *mrb, const struct mrb_io_trace *ev, void *ud)
+{
+  trace_counts[ev->op]++;
+}
+
+static mrb_value
+mrb_io_test_trace_start(mrb_state *mrb, mrb_value self)
+{
+  memset(trace_counts, 0, sizeof(trace_counts));
+  mrb_io_set_trace(mrb, mrb_io_test_trace, NULL);
+  return mrb_nil_value();
+}
+
+/* -> [opens, closes, reads, writes, seeks] since trace_start */
+static mrb_value
+mrb_io_test_trace_stop(mrb_state *mrb, mrb_value self)
+{
+  mrb_value ary;
+  int i;
+
+  mrb_io_set_trace(mrb, NULL, NULL);
+  ary = mrb_ary_new(mrb);
+  for (i = 0; i <= MRB_IO_TRACE_SEEK; i++) {
+    mrb_ary_push(mrb, ary, mrb_fixnum_value(trace_counts[i]));
+  }
+  return ary;
+}
+
 void
 mrb_mruby_io_gem_test(mrb_state* mrb)
 {
@@ -123,4 +195,10 @@ mrb_mruby_io_gem_test(mrb_state* mrb)
   mrb_define_class_method(mrb, io_test, "file_test_setup", mrb_io_test_file_setup, MRB_ARGS_NONE());
   mrb_define_class_method(mrb, io_test, "file_test_cleanup", mrb_io_test_file_cleanup, MRB_ARGS_NONE());
 
+  mrb_define_class_method(mrb, io_test, "symlink", mrb_io_test_symlink, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, io_test, "mount_in_other_state", mrb_io_test_mount_in_other_state, MRB_ARGS_REQ(1));
+
+  mrb_define_class_method(mrb, io_test, "trace_start", mrb_io_test_trace_start, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, io_test, "trace_stop", mrb_io_test_trace_stop, MRB_ARGS_NONE());
+
 }